@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2022, Kalopa Robotics Limited.  All rights
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
  * reserved.
  *
  * Redistribution and use in source and binary forms, with or without
@@ -32,107 +32,398 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  * ABSTRACT
- * This code handles the actual operation of creating a tone (or silence)
- * for morse output. It relies heavily on the ALSA sound library for the
- * dirty work of getting audio out.
+ * The ALSA audio backend. This relies heavily on the ALSA sound library
+ * for the dirty work of getting audio out.
  */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <math.h>
+#include <errno.h>
 
 #include "libmorse.h"
 
 #ifdef ALSA
 #include <alsa/asoundlib.h>
 
-static char		*device = "default";
+/*
+ * What we need to know about the device. If it supports mmap access, the
+ * audio is generated straight into the sound card buffer, and "offset"
+ * is where the area handed out by alsa_begin() starts.
+ */
+struct	alsa	{
+	snd_pcm_t			*handle;
+	int					mmap;
+	snd_pcm_uframes_t	offset;
+	snd_pcm_uframes_t	buffer_size;
+};
 
 /*
- * Initialise the ALSA library.
+ * Open the ALSA device. If no device is specified, use the default.
  */
-void
-sound_open(struct morse *mp)
+static int
+alsa_open(struct morse *mp, const char *device)
 {
 	int err;
-	snd_pcm_t *handle = NULL;
+	struct alsa *ap;
 
-	if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+	if (device == NULL)
+		device = "default";
+	if ((ap = (struct alsa *)malloc(sizeof(struct alsa))) == NULL) {
+		perror("libmorse init: malloc");
+		return(-1);
+	}
+	if ((err = snd_pcm_open(&ap->handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
 		fprintf(stderr, "libmorse init: snd_pcm_open: %s\n", snd_strerror(err));
-		exit(1);
+		free(ap);
+		return(-1);
 	}
-	mp->audio = (void *)handle;
+	ap->mmap = 0;
+	ap->offset = 0;
+	ap->buffer_size = 0;
+	mp->backend_data = (void *)ap;
+	return(0);
+}
+
+/*
+ * The sample formats we can generate, in order of preference.
+ */
+static const struct {
+	snd_pcm_format_t	alsa;
+	int					morse;
+} alsa_formats[] = {
+	{SND_PCM_FORMAT_S16,	MORSE_S16},
+	{SND_PCM_FORMAT_S32,	MORSE_S32},
+	{SND_PCM_FORMAT_FLOAT,	MORSE_FLOAT}
+};
+
+#define NFORMATS	(sizeof(alsa_formats) / sizeof(alsa_formats[0]))
+
+/*
+ * Report an ALSA error. Always returns -1.
+ */
+static int
+alsa_error(const char *what, int err)
+{
+	fprintf(stderr, "libmorse: %s: %s\n", what, snd_strerror(err));
+	return(-1);
 }
 
 /*
- * Just before we begin audio out, we need to set up some bits and pieces
- * like the audio buffer and some of the offsets. Recompute the parameters
- * for good measure, too.
+ * Try to get going again after something went wrong. An underrun (or the
+ * device being suspended) counts as an xrun. Returns -1 if the device
+ * can't be recovered.
  */
-void
-sound_commence(struct morse *mp)
+static int
+alsa_recover(struct morse *mp, const char *what, int err)
+{
+	struct alsa *ap = (struct alsa *)mp->backend_data;
+
+	if (err == -EPIPE || err == -ESTRPIPE)
+		mp->stats.xruns++;
+	if ((err = snd_pcm_recover(ap->handle, err, 1)) < 0)
+		return(alsa_error(what, err));
+	return(0);
+}
+
+/*
+ * Work out the hardware parameters. Resampling is turned off, so the
+ * device runs at whichever of its own rates is nearest the one asked for
+ * and we render at that, rather than have the plug layer convert every
+ * sample. Likewise the first sample format it takes, and as few channels
+ * as it allows. The buffer (and period, if given) are as near as it can
+ * get to what's asked for, which is how the latency is kept down for
+ * live sending. Ask for mmap access first, and fall back to the usual
+ * read/write access if the device can't do that.
+ */
+static int
+alsa_hw_params(struct morse *mp, snd_pcm_hw_params_t *hp)
+{
+	int i, err, dir = 0;
+	unsigned int rate, channels = 1, period_time, buffer_time;
+	struct alsa *ap = (struct alsa *)mp->backend_data;
+
+	if ((err = snd_pcm_hw_params_any(ap->handle, hp)) < 0)
+		return(alsa_error("snd_pcm_hw_params_any", err));
+	snd_pcm_hw_params_set_rate_resample(ap->handle, hp, 0);
+	ap->mmap = 1;
+	if (snd_pcm_hw_params_set_access(ap->handle, hp, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
+		ap->mmap = 0;
+		if ((err = snd_pcm_hw_params_set_access(ap->handle, hp, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+			return(alsa_error("snd_pcm_hw_params_set_access", err));
+	}
+	for (i = 0; i < NFORMATS; i++)
+		if (snd_pcm_hw_params_test_format(ap->handle, hp, alsa_formats[i].alsa) == 0)
+			break;
+	if (i == NFORMATS) {
+		fprintf(stderr, "libmorse: no usable sample format.\n");
+		return(-1);
+	}
+	if ((err = snd_pcm_hw_params_set_format(ap->handle, hp, alsa_formats[i].alsa)) < 0)
+		return(alsa_error("snd_pcm_hw_params_set_format", err));
+	if ((err = snd_pcm_hw_params_set_channels_near(ap->handle, hp, &channels)) < 0)
+		return(alsa_error("snd_pcm_hw_params_set_channels_near", err));
+	rate = mp->sample_rate;
+	if ((err = snd_pcm_hw_params_set_rate_near(ap->handle, hp, &rate, &dir)) < 0)
+		return(alsa_error("snd_pcm_hw_params_set_rate_near", err));
+	if (mp->period_time > 0.0) {
+		period_time = (unsigned int )(mp->period_time * 1000.0 + 0.5);
+		dir = 0;
+		if ((err = snd_pcm_hw_params_set_period_time_near(ap->handle, hp, &period_time, &dir)) < 0)
+			return(alsa_error("snd_pcm_hw_params_set_period_time_near", err));
+	}
+	buffer_time = (unsigned int )(mp->buffer_time * 1000.0 + 0.5);
+	dir = 0;
+	if ((err = snd_pcm_hw_params_set_buffer_time_near(ap->handle, hp, &buffer_time, &dir)) < 0)
+		return(alsa_error("snd_pcm_hw_params_set_buffer_time_near", err));
+	if ((err = snd_pcm_hw_params(ap->handle, hp)) < 0)
+		return(alsa_error("snd_pcm_hw_params", err));
+	mp->format = alsa_formats[i].morse;
+	mp->channels = (int )channels;
+	mp->sample_rate = (int )rate;
+	return(0);
+}
+
+/*
+ * Don't start playing until the buffer is full, and wake us up whenever
+ * there's a period's worth of room in it (as snd_pcm_set_params() does).
+ * Turn on the time stamps too, on the monotonic clock, so the sample
+ * clock can be matched up with the time of day (see alsa_delay()). The
+ * buffer and period times are set to what the device actually gave us.
+ */
+static int
+alsa_sw_params(struct morse *mp, snd_pcm_hw_params_t *hp, snd_pcm_sw_params_t *sp)
+{
+	int err, dir = 0;
+	snd_pcm_uframes_t buffer_size, period_size;
+	struct alsa *ap = (struct alsa *)mp->backend_data;
+
+	snd_pcm_hw_params_get_buffer_size(hp, &buffer_size);
+	snd_pcm_hw_params_get_period_size(hp, &period_size, &dir);
+	ap->buffer_size = buffer_size;
+	mp->buffer_time = (double )buffer_size * 1000.0 / (double )mp->sample_rate;
+	mp->period_time = (double )period_size * 1000.0 / (double )mp->sample_rate;
+	if ((err = snd_pcm_sw_params_current(ap->handle, sp)) < 0)
+		return(alsa_error("snd_pcm_sw_params_current", err));
+	if ((err = snd_pcm_sw_params_set_start_threshold(ap->handle, sp,
+				(buffer_size / period_size) * period_size)) < 0)
+		return(alsa_error("snd_pcm_sw_params_set_start_threshold", err));
+	if ((err = snd_pcm_sw_params_set_avail_min(ap->handle, sp, period_size)) < 0)
+		return(alsa_error("snd_pcm_sw_params_set_avail_min", err));
+	snd_pcm_sw_params_set_tstamp_mode(ap->handle, sp, SND_PCM_TSTAMP_ENABLE);
+	snd_pcm_sw_params_set_tstamp_type(ap->handle, sp, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	if ((err = snd_pcm_sw_params(ap->handle, sp)) < 0)
+		return(alsa_error("snd_pcm_sw_params", err));
+	return(0);
+}
+
+/*
+ * Just before we begin audio out, set up the device. The sample rate,
+ * format and channel count are left in the morse structure, and the
+ * timing is worked out to suit once we return.
+ */
+static int
+alsa_commence(struct morse *mp)
+{
+	int err;
+	snd_pcm_hw_params_t *hp;
+	snd_pcm_sw_params_t *sp;
+
+	if ((err = snd_pcm_hw_params_malloc(&hp)) < 0)
+		return(alsa_error("snd_pcm_hw_params_malloc", err));
+	if ((err = snd_pcm_sw_params_malloc(&sp)) < 0) {
+		snd_pcm_hw_params_free(hp);
+		return(alsa_error("snd_pcm_sw_params_malloc", err));
+	}
+	err = 0;
+	if (alsa_hw_params(mp, hp) < 0 || alsa_sw_params(mp, hp, sp) < 0)
+		err = -1;
+	snd_pcm_sw_params_free(sp);
+	snd_pcm_hw_params_free(hp);
+	return(err);
+}
+
+/*
+ * Write a block of audio samples to the device. The buffering and
+ * time stamp are handled by the caller (see morse_audio_write()). This is
+ * only used in mmap mode if alsa_begin() couldn't get at the buffer. If
+ * the device underruns, it's recovered and the rest of the block is
+ * written, and a short write is followed up with the remainder.
+ */
+static int
+alsa_write(struct morse *mp, const void *bp, int len)
+{
+	snd_pcm_sframes_t n;
+	int size = _morse_audio_frame(mp);
+	const char *cp = (const char *)bp;
+	struct alsa *ap = (struct alsa *)mp->backend_data;
+
+	while (len > 0) {
+		if (ap->mmap)
+			n = snd_pcm_mmap_writei(ap->handle, cp, len);
+		else
+			n = snd_pcm_writei(ap->handle, cp, len);
+		if (n < 0) {
+			if (alsa_recover(mp, "snd_pcm_writei", (int )n) < 0)
+				return(-1);
+			continue;
+		}
+		if (n < len)
+			mp->stats.short_writes++;
+		cp += n * size;
+		len -= (int )n;
+	}
+	return(0);
+}
+
+/*
+ * Get the next free piece of the sound card buffer, waiting for some to
+ * come free if necessary. Returns the number of frames which will fit,
+ * or zero if we're not using mmap access.
+ */
+static int
+alsa_begin(struct morse *mp, void **areap)
 {
 	int err;
-	snd_pcm_t *handle = (snd_pcm_t *)mp->audio;
-
-	if ((err = snd_pcm_set_params(handle,
-				SND_PCM_FORMAT_S16_LE,
-				SND_PCM_ACCESS_RW_INTERLEAVED,
-				1,
-				mp->sample_rate,
-				1,
-				500000)) < 0) {
-		fprintf(stderr, "libmorse: snd_pcm_set_params: %s\n", snd_strerror(err));
-		exit(1);
+	snd_pcm_sframes_t avail;
+	snd_pcm_uframes_t frames;
+	const snd_pcm_channel_area_t *areas;
+	struct alsa *ap = (struct alsa *)mp->backend_data;
+
+	if (!ap->mmap)
+		return(0);
+	while ((avail = snd_pcm_avail_update(ap->handle)) <= 0) {
+		if (avail < 0) {
+			if (alsa_recover(mp, "snd_pcm_avail_update", (int )avail) < 0)
+				return(0);
+			continue;
+		}
+		/*
+		 * The buffer is full. If it hasn't been started yet, start it
+		 * now or we'll be waiting forever.
+		 */
+		if (snd_pcm_state(ap->handle) == SND_PCM_STATE_PREPARED)
+			snd_pcm_start(ap->handle);
+		snd_pcm_wait(ap->handle, -1);
+	}
+	frames = (snd_pcm_uframes_t )avail;
+	if ((err = snd_pcm_mmap_begin(ap->handle, &areas, &ap->offset, &frames)) < 0) {
+		fprintf(stderr, "libmorse: snd_pcm_mmap_begin: %s\n", snd_strerror(err));
+		return(0);
 	}
+	*areap = (char *)areas[0].addr + (areas[0].first + ap->offset * areas[0].step) / 8;
+	return((int )frames);
 }
 
 /*
- * Output a 16-bit audio sample. It is buffered locally and then written
- * whenever the buffer is full. We also track a time stamp so we know how
- * much audio has been written.
+ * We've filled in "len" samples of the area from alsa_begin(). Hand them
+ * over to the sound card. If it only takes some of them, that's counted
+ * as a short write. ALSA won't take a second commit without a fresh
+ * snd_pcm_mmap_begin(), so the rest are only offered again if that hands
+ * back the stretch they're already sitting in; otherwise they're dropped,
+ * and come off the time stamp as they were never heard. If it has
+ * underrun in the meantime, they're lost, but the device is recovered
+ * and carries on.
  */
-void
-sound_out(struct morse *mp, int value)
+static int
+alsa_commit(struct morse *mp, int len)
 {
-	snd_pcm_t *handle = (snd_pcm_t *)mp->audio;
+	snd_pcm_sframes_t n;
+	snd_pcm_uframes_t offset, frames;
+	const snd_pcm_channel_area_t *areas;
+	struct alsa *ap = (struct alsa *)mp->backend_data;
 
-	mp->buffer[mp->offset++] = value;
-	if (mp->offset >= AUDIO_BUFFER_SIZE) {
-		snd_pcm_writei(handle, mp->buffer, AUDIO_BUFFER_SIZE);
-		mp->offset = 0;
+	while (len > 0) {
+		if ((n = snd_pcm_mmap_commit(ap->handle, ap->offset, len)) < 0)
+			return(alsa_recover(mp, "snd_pcm_mmap_commit", (int )n));
+		if (n == len)
+			break;
+		mp->stats.short_writes++;
+		len -= (int )n;
+		frames = len;
+		if (n == 0 || snd_pcm_mmap_begin(ap->handle, &areas, &offset, &frames) < 0 ||
+				offset != ap->offset + n || frames < (snd_pcm_uframes_t )len) {
+			mp->time_stamp -= len;
+			mp->stats.samples -= len;
+			break;
+		}
+		ap->offset = offset;
 	}
-	mp->time_stamp++;
+	return(0);
 }
 
 /*
- * Called prior to close. This ensure that any buffered audio is written and
- * we wait until the audio has actually been sent. Don't bother with this
- * code if you just want to exit or close down the library.
+ * Wait until the audio has actually been sent. The device is prepared
+ * again afterwards, so it can carry on being used. If it ran dry before
+ * the end, that's counted as an xrun, but everything did go out.
  */
-void
-sound_drain(struct morse *mp)
+static int
+alsa_drain(struct morse *mp)
 {
 	int err;
-	snd_pcm_t *handle = (snd_pcm_t *)mp->audio;
+	struct alsa *ap = (struct alsa *)mp->backend_data;
 
-	if (mp->offset > 0)
-		snd_pcm_writei(handle, mp->buffer, mp->offset);
-	if ((err = snd_pcm_drain(handle)) < 0)
+	if (ap->mmap && snd_pcm_state(ap->handle) == SND_PCM_STATE_PREPARED)
+		snd_pcm_start(ap->handle);
+	if ((err = snd_pcm_drain(ap->handle)) == -EPIPE) {
+		if (alsa_recover(mp, "snd_pcm_drain", err) < 0)
+			return(-1);
+	} else if (err < 0) {
 		fprintf(stderr, "libmorse drain: snd_pcm_drain: %s\n", snd_strerror(err));
+		return(-1);
+	}
+	if ((err = snd_pcm_prepare(ap->handle)) < 0) {
+		fprintf(stderr, "libmorse drain: snd_pcm_prepare: %s\n", snd_strerror(err));
+		return(-1);
+	}
+	return(0);
 }
 
 /*
- * Close the library. Doesn't do much except release the ALSA audio channel.
+ * How many frames are queued up ahead of the next one we write. Used to
+ * work out how long it will be until a tone is actually heard. If we're
+ * asked when, the figure comes from the time stamp the driver took at
+ * its last update, which is more precise than looking at the clock
+ * afterwards. There's no time stamp until the device has started.
  */
-void
-sound_close(struct morse *mp)
+static int
+alsa_delay(struct morse *mp, struct timespec *tsp)
 {
-	snd_pcm_t *handle = (snd_pcm_t *)mp->audio;
+	snd_pcm_sframes_t delay;
+	snd_pcm_uframes_t avail;
+	struct alsa *ap = (struct alsa *)mp->backend_data;
 
-	snd_pcm_close(handle);
+	if (tsp != NULL) {
+		if (snd_pcm_htimestamp(ap->handle, &avail, tsp) < 0 ||
+				(tsp->tv_sec == 0 && tsp->tv_nsec == 0))
+			return(-1);
+		return(avail >= ap->buffer_size ? 0 : (int )(ap->buffer_size - avail));
+	}
+	if (snd_pcm_delay(ap->handle, &delay) < 0)
+		return(-1);
+	return(delay < 0 ? 0 : (int )delay);
 }
-#endif
-#ifdef SDL
-#include <SDL_audio.h>
+
+/*
+ * Doesn't do much except release the ALSA audio channel.
+ */
+static void
+alsa_close(struct morse *mp)
+{
+	struct alsa *ap = (struct alsa *)mp->backend_data;
+
+	snd_pcm_close(ap->handle);
+	free(ap);
+}
+
+const struct morse_backend morse_alsa_backend = {
+	"alsa",
+	alsa_open,
+	alsa_commence,
+	alsa_write,
+	alsa_drain,
+	alsa_close,
+	alsa_begin,
+	alsa_commit,
+	alsa_delay
+};
 #endif
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Asynchronous output. Once morse_async_start() has been called, the
+ * morse_send_*() functions no longer generate any audio themselves. They
+ * just drop the text into a queue and return, and a separate audio thread
+ * takes it from there, so the caller never has to wait on the sound
+ * device.
+ *
+ * The queue is a single-producer, single-consumer ring of characters.
+ * The head is only ever moved by the caller and the tail only by the
+ * audio thread, so neither side needs a lock to get at it. The mutex and
+ * condition variable are only used to put one side to sleep when the
+ * ring is empty (or full) and wake it again.
+ *
+ * An abort is seen by the audio code between one chunk of audio and the
+ * next, so whatever is being sent stops straight away. The audio which
+ * was generated but never handed to the device comes off the time stamp
+ * again, so the time stamp only ever counts what was sent.
+ *
+ * Only one thread should send text, and while the audio thread is busy
+ * the parameters shouldn't be changed. Call morse_async_wait() first.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "libmorse.h"
+
+/*
+ * A character queued by morse_send_char() is sent exactly as is. These
+ * are flagged with the top bit to tell them apart from words, which get
+ * the usual prosign handling and end with a word gap.
+ */
+#define ASYNC_CHAR	0x80
+
+struct	morse_async	{
+	int				size;
+	unsigned char	*ring;
+	atomic_uint		head;
+	atomic_uint		tail;
+	atomic_uint		abort_at;
+	atomic_int		abort;
+	atomic_int		stop;
+	atomic_int		busy;
+	atomic_int		sleeping;
+	atomic_int		waiting;
+	pthread_t		thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+};
+
+/*
+ * Wake up whoever is asleep on the condition variable. The flag is
+ * checked first so that the usual case doesn't go near the mutex.
+ */
+static void
+_async_wake(struct morse_async *ap, atomic_int *flag)
+{
+	if (!atomic_load(flag))
+		return;
+	pthread_mutex_lock(&ap->lock);
+	pthread_cond_broadcast(&ap->cond);
+	pthread_mutex_unlock(&ap->lock);
+}
+
+/*
+ * Go to sleep until "done" says we can carry on. The flag is raised before
+ * the condition is checked again, so a wakeup can't slip in between.
+ */
+static void
+_async_sleep(struct morse_async *ap, atomic_int *flag, int (*done)(struct morse_async *))
+{
+	pthread_mutex_lock(&ap->lock);
+	atomic_store(flag, 1);
+	while (!done(ap))
+		pthread_cond_wait(&ap->cond, &ap->lock);
+	atomic_store(flag, 0);
+	pthread_mutex_unlock(&ap->lock);
+}
+
+static int
+_async_ready(struct morse_async *ap)
+{
+	return(atomic_load(&ap->head) != atomic_load(&ap->tail) ||
+				atomic_load(&ap->abort) || atomic_load(&ap->stop));
+}
+
+static int
+_async_room(struct morse_async *ap)
+{
+	return(atomic_load(&ap->head) - atomic_load(&ap->tail) < (unsigned int )ap->size);
+}
+
+static int
+_async_idle(struct morse_async *ap)
+{
+	return(atomic_load(&ap->head) == atomic_load(&ap->tail) && !atomic_load(&ap->busy));
+}
+
+/*
+ * The audio thread. Take characters off the ring and send them. When the
+ * ring runs dry, flush out whatever audio is left, then go to sleep until
+ * there's more.
+ */
+static void *
+_async_thread(void *arg)
+{
+	int ch, word;
+	unsigned int tail;
+	struct morse *mp = (struct morse *)arg;
+	struct morse_async *ap = mp->async;
+
+	word = 0;
+	for (;;) {
+		if (atomic_load(&ap->abort)) {
+			atomic_store(&ap->tail, atomic_load(&ap->abort_at));
+			if (mp->setup_done)
+				_morse_audio_discard(mp);
+			mp->sym_delay = mp->word_delay;
+			mp->sym_exact = mp->word_exact;
+			mp->prosign = word = 0;
+			atomic_store(&ap->abort, 0);
+			_async_wake(ap, &ap->waiting);
+		}
+		if ((tail = atomic_load(&ap->tail)) == atomic_load(&ap->head)) {
+			if (atomic_load(&ap->busy)) {
+				_morse_drain(mp);
+				atomic_store(&ap->busy, 0);
+				_async_wake(ap, &ap->waiting);
+			}
+			if (atomic_load(&ap->stop))
+				break;
+			_async_sleep(ap, &ap->sleeping, _async_ready);
+			continue;
+		}
+		atomic_store(&ap->busy, 1);
+		ch = ap->ring[tail % ap->size];
+		atomic_store(&ap->tail, tail + 1);
+		_async_wake(ap, &ap->waiting);
+		if (ch & ASYNC_CHAR) {
+			_morse_send_char(mp, ch & ~ASYNC_CHAR);
+			continue;
+		}
+		/*
+		 * Part of a word. This follows morse_send_word() - a word
+		 * starting with "<" is a prosign, and anything after the ">"
+		 * is ignored. A space ends the word.
+		 */
+		if (ch == ' ') {
+			mp->prosign = word = 0;
+			mp->sym_delay = mp->word_delay;
+			mp->sym_exact = mp->word_exact;
+		} else if (word < 0)
+			continue;
+		else if (word++ == 0 && ch == '<')
+			mp->prosign = 1;
+		else if (ch == '>' && mp->prosign)
+			word = -1;
+		else
+			_morse_send_char(mp, ch);
+	}
+	return(NULL);
+}
+
+/*
+ * Switch to asynchronous output, with room in the queue for "size"
+ * characters (or a sensible default if it's zero). Returns 0 on success
+ * or -1 on failure.
+ */
+int
+morse_async_start(struct morse *mp, int size)
+{
+	struct morse_async *ap;
+
+	if (mp->async != NULL)
+		return(0);
+	if (size <= 0)
+		size = 4096;
+	if ((ap = (struct morse_async *)malloc(sizeof(struct morse_async))) == NULL)
+		return(-1);
+	if ((ap->ring = (unsigned char *)malloc(size)) == NULL) {
+		free(ap);
+		return(-1);
+	}
+	ap->size = size;
+	atomic_init(&ap->head, 0);
+	atomic_init(&ap->tail, 0);
+	atomic_init(&ap->abort_at, 0);
+	atomic_init(&ap->abort, 0);
+	atomic_init(&ap->stop, 0);
+	atomic_init(&ap->busy, 0);
+	atomic_init(&ap->sleeping, 0);
+	atomic_init(&ap->waiting, 0);
+	pthread_mutex_init(&ap->lock, NULL);
+	pthread_cond_init(&ap->cond, NULL);
+	mp->async = ap;
+	if (pthread_create(&ap->thread, NULL, _async_thread, (void *)mp) != 0) {
+		mp->async = NULL;
+		pthread_mutex_destroy(&ap->lock);
+		pthread_cond_destroy(&ap->cond);
+		free(ap->ring);
+		free(ap);
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Finish sending whatever is in the queue (call morse_async_abort()
+ * first to throw it away instead), then stop the audio thread and go
+ * back to normal synchronous output.
+ */
+void
+morse_async_stop(struct morse *mp)
+{
+	struct morse_async *ap = mp->async;
+
+	if (ap == NULL)
+		return;
+	atomic_store(&ap->stop, 1);
+	_async_wake(ap, &ap->sleeping);
+	pthread_join(ap->thread, NULL);
+	pthread_mutex_destroy(&ap->lock);
+	pthread_cond_destroy(&ap->cond);
+	free(ap->ring);
+	free(ap);
+	mp->async = NULL;
+}
+
+/*
+ * Add a character to the queue, either as part of a word or on its own.
+ * If the queue is full, this is the one place where the caller has to
+ * wait for the audio thread.
+ */
+void
+_morse_async_put(struct morse *mp, int ch, int word)
+{
+	unsigned int head;
+	struct morse_async *ap = mp->async;
+
+	if (!_async_room(ap))
+		_async_sleep(ap, &ap->waiting, _async_room);
+	head = atomic_load(&ap->head);
+	ap->ring[head % ap->size] = word ? (ch & 0x7f) : (ch & 0x7f) | ASYNC_CHAR;
+	atomic_store(&ap->head, head + 1);
+	_async_wake(ap, &ap->sleeping);
+}
+
+/*
+ * Return the number of characters still waiting in the queue. This
+ * doesn't include the one which is being sent right now.
+ */
+int
+morse_async_pending(struct morse *mp)
+{
+	struct morse_async *ap = mp->async;
+
+	if (ap == NULL)
+		return(0);
+	return(atomic_load(&ap->head) - atomic_load(&ap->tail));
+}
+
+/*
+ * Is the audio thread sending (or still draining) anything?
+ */
+int
+morse_async_busy(struct morse *mp)
+{
+	struct morse_async *ap = mp->async;
+
+	if (ap == NULL)
+		return(0);
+	return(!_async_idle(ap));
+}
+
+/*
+ * Throw away everything in the queue, and cut short whatever is being
+ * sent right now. Anything already handed to the sound device still
+ * plays out.
+ */
+void
+morse_async_abort(struct morse *mp)
+{
+	struct morse_async *ap = mp->async;
+
+	if (ap == NULL)
+		return;
+	atomic_store(&ap->abort_at, atomic_load(&ap->head));
+	atomic_store(&ap->abort, 1);
+	_async_wake(ap, &ap->sleeping);
+}
+
+/*
+ * Used by the audio code to check whether there's any point in handing
+ * the current block to the sound device.
+ */
+int
+_morse_async_aborted(struct morse *mp)
+{
+	return(mp->async != NULL && atomic_load(&mp->async->abort));
+}
+
+/*
+ * Wait until everything in the queue has been sent, and played.
+ */
+void
+morse_async_wait(struct morse *mp)
+{
+	struct morse_async *ap = mp->async;
+
+	if (ap == NULL)
+		return;
+	if (!_async_idle(ap))
+		_async_sleep(ap, &ap->waiting, _async_idle);
+}
@@ -33,52 +33,735 @@
  *
  * ABSTRACT
  * This code handles the actual operation of creating a tone (or silence)
- * for morse output. It relies heavily on the ALSA sound library for the
- * dirty work of getting audio out.
+ * for morse output. The audio is buffered here and handed off to the
+ * selected audio backend for the dirty work of getting it out.
  */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 
 #include "libmorse.h"
 
+#ifdef MORSE_FIXED
 /*
- * Generate a sinusoidal tone at the desired frequency. We use a small curve
- * at the end of the wave form to avoid clicks. The maths here might not be
- * perfect...
+ * The fixed-point synthesis. Phases are in turns, as 32-bit fractions,
+ * so the phase accumulator wraps by itself. The sine table is in 1.15
+ * fixed point, as is the envelope, except that it stops just short of one
+ * (at FIXED_ONE), which is taken to mean one exactly. The output is
+ * within a few counts of the floating point version, and the timing is
+ * the same to the sample.
+ */
+#define FIXED_ONE	32767
+
+/*
+ * A quarter of a sine wave, in 256 steps, with the end point.
+ */
+static const unsigned short sine_table[257] = {
+	0, 201, 402, 603, 804, 1005, 1206, 1407,
+	1608, 1809, 2009, 2210, 2411, 2611, 2811, 3012,
+	3212, 3412, 3612, 3812, 4011, 4211, 4410, 4609,
+	4808, 5007, 5205, 5404, 5602, 5800, 5998, 6195,
+	6393, 6590, 6787, 6983, 7180, 7376, 7571, 7767,
+	7962, 8157, 8351, 8546, 8740, 8933, 9127, 9319,
+	9512, 9704, 9896, 10088, 10279, 10469, 10660, 10850,
+	11039, 11228, 11417, 11605, 11793, 11980, 12167, 12354,
+	12540, 12725, 12910, 13095, 13279, 13463, 13646, 13828,
+	14010, 14192, 14373, 14553, 14733, 14912, 15091, 15269,
+	15447, 15624, 15800, 15976, 16151, 16326, 16500, 16673,
+	16846, 17018, 17190, 17361, 17531, 17700, 17869, 18037,
+	18205, 18372, 18538, 18703, 18868, 19032, 19195, 19358,
+	19520, 19681, 19841, 20001, 20160, 20318, 20475, 20632,
+	20788, 20943, 21097, 21251, 21403, 21555, 21706, 21856,
+	22006, 22154, 22302, 22449, 22595, 22740, 22884, 23028,
+	23170, 23312, 23453, 23593, 23732, 23870, 24008, 24144,
+	24279, 24414, 24548, 24680, 24812, 24943, 25073, 25202,
+	25330, 25457, 25583, 25708, 25833, 25956, 26078, 26199,
+	26320, 26439, 26557, 26674, 26791, 26906, 27020, 27133,
+	27246, 27357, 27467, 27576, 27684, 27791, 27897, 28002,
+	28106, 28209, 28311, 28411, 28511, 28610, 28707, 28803,
+	28899, 28993, 29086, 29178, 29269, 29359, 29448, 29535,
+	29622, 29707, 29792, 29875, 29957, 30038, 30118, 30196,
+	30274, 30350, 30425, 30499, 30572, 30644, 30715, 30784,
+	30853, 30920, 30986, 31050, 31114, 31177, 31238, 31298,
+	31357, 31415, 31471, 31527, 31581, 31634, 31686, 31737,
+	31786, 31834, 31881, 31927, 31972, 32015, 32058, 32099,
+	32138, 32177, 32214, 32251, 32286, 32319, 32352, 32383,
+	32413, 32442, 32470, 32496, 32522, 32546, 32568, 32590,
+	32610, 32629, 32647, 32664, 32679, 32693, 32706, 32718,
+	32729, 32738, 32746, 32753, 32758, 32762, 32766, 32767,
+	32768
+};
+
+/*
+ * The sine of a phase, interpolated from the table. The top two bits of
+ * the phase give the quadrant, the next eight the table entry, and the
+ * fourteen after that say how far it is to the next one.
+ */
+static int
+_audio_sine(unsigned int phase)
+{
+	unsigned int p = phase & 0x3fffffff;
+	int i, frac, v;
+
+	if (phase & 0x40000000)
+		p = 0x40000000 - p;
+	i = p >> 22;
+	frac = (p >> 8) & 0x3fff;
+	v = sine_table[i];
+	if (frac != 0)
+		v += ((sine_table[i + 1] - v) * frac + 8192) >> 14;
+	return((phase & 0x80000000) ? -v : v);
+}
+
+/*
+ * The envelope for sample "i" of a tone which is "len" samples long,
+ * with raised-cosine ramps as below. Half a turn of (1 - cos) / 2 is a
+ * quarter turn of sin squared, which is what the table has.
+ */
+static int
+_audio_envelope(int i, int len, int ramp)
+{
+	int s;
+
+	if (i < ramp)
+		s = _audio_sine((unsigned int )(((2ULL * i + 1) << 29) / ramp));
+	else if (i >= len - ramp)
+		s = _audio_sine((unsigned int )(((2ULL * (len - i) - 1) << 29) / ramp));
+	else
+		return(FIXED_ONE);
+	if ((s = (s * s + 16384) >> 15) > FIXED_ONE)
+		s = FIXED_ONE;
+	return(s);
+}
+
+/*
+ * Work out the phase step per sample, and the length of the ramps. No
+ * templates are needed, as only the ramps have to be worked out.
+ */
+void
+morse_audio_setup(struct morse *mp)
+{
+	mp->phase_step = (unsigned int )((((unsigned long long )mp->tone_frequency << 32) +
+						mp->sample_rate / 2) / mp->sample_rate);
+	mp->ramp = (mp->ramp_time * mp->sample_rate + 500) / 1000;
+	if (mp->ramp < 1)
+		mp->ramp = 1;
+}
+
+/*
+ * Get the envelope for "n" samples, starting at sample "i", of a tone
+ * which is "len" samples long, into "ep".
+ */
+const short *
+_morse_audio_envelope(struct morse *mp, short *ep, int i, int len, int n)
+{
+	int k, ramp;
+
+	if ((ramp = mp->ramp) > len / 2)
+		ramp = len / 2;
+	for (k = 0; k < n; k++)
+		ep[k] = _audio_envelope(i + k, len, ramp);
+	return(ep);
+}
+
+/*
+ * Generate "n" samples of the carrier, shaped by the envelope "ep", where
+ * the first sample is number "clock" on the sample clock. As below, the
+ * phase is worked out afresh from the clock, and here it's exact.
+ */
+void
+_morse_audio_carrier(struct morse *mp, short *out, const short *ep, unsigned long long clock, int n)
+{
+	int k, v;
+	unsigned int phase;
+	unsigned long long rate = mp->sample_rate;
+
+	phase = (unsigned int )((((clock % rate) * mp->tone_frequency % rate) << 32) / rate);
+	for (k = 0; k < n; k++) {
+		v = (mp->word * _audio_sine(phase) + 16384) >> 15;
+		out[k] = ep[k] == FIXED_ONE ? v : (v * ep[k] + 16384) >> 15;
+		phase += mp->phase_step;
+	}
+}
+#else
+/*
+ * Compute the envelope for sample "i" of a tone which is "len" samples
+ * long. The leading and trailing "ramp" samples follow a raised-cosine
+ * curve to avoid clicks. Everything in between is at full amplitude.
+ */
+static double
+_audio_envelope(int i, int len, int ramp)
+{
+	if (i < ramp)
+		return((1.0 - cos(M_PI * ((double )i + 0.5) / (double )ramp)) / 2.0);
+	if (i >= len - ramp)
+		return((1.0 - cos(M_PI * ((double )(len - i) - 0.5) / (double )ramp)) / 2.0);
+	return(1.0);
+}
+
+/*
+ * Work out the length of the attack and decay ramps in samples. A very
+ * short tone gets a ramp of half its length, so it is all curve.
+ */
+static int
+_audio_ramp(struct morse *mp, int len)
+{
+	int ramp;
+
+	ramp = (int )(mp->ramp_time * (double )mp->sample_rate / 1000.0 + 0.5);
+	if (ramp < 1)
+		ramp = 1;
+	if (ramp > len / 2)
+		ramp = len / 2;
+	return(ramp);
+}
+
+/*
+ * Fill a buffer with the envelope of a complete tone.
+ */
+static void
+_audio_fill(struct morse *mp, float *ep, int len)
+{
+	int i, ramp;
+
+	ramp = _audio_ramp(mp, len);
+	for (i = 0; i < len; i++)
+		ep[i] = (float )_audio_envelope(i, len, ramp);
+}
+
+/*
+ * Work out the carrier's rotation per sample, and build the dit and dah
+ * envelope templates. This is called from morse_calc_params() whenever
+ * the timing or tone parameters change. If we can't get the memory, the
+ * templates are left empty and the envelope is computed as we go instead.
+ */
+void
+morse_audio_setup(struct morse *mp)
+{
+	double step;
+
+	step = 2.0 * M_PI * mp->tone_frequency / (double )mp->sample_rate;
+	mp->carrier_c = (float )cos(step);
+	mp->carrier_s = (float )sin(step);
+	if (mp->dit_env != NULL)
+		free(mp->dit_env);
+	if (mp->dah_env != NULL)
+		free(mp->dah_env);
+	mp->dit_env = (float *)malloc(mp->bit_time * sizeof(float));
+	mp->dah_env = (float *)malloc(mp->bit_time * 3 * sizeof(float));
+	if (mp->dit_env == NULL || mp->dah_env == NULL) {
+		if (mp->dit_env != NULL)
+			free(mp->dit_env);
+		if (mp->dah_env != NULL)
+			free(mp->dah_env);
+		mp->dit_env = mp->dah_env = NULL;
+		return;
+	}
+	_audio_fill(mp, mp->dit_env, mp->bit_time);
+	_audio_fill(mp, mp->dah_env, mp->bit_time * 3);
+}
+
+/*
+ * Get the envelope for "n" samples, starting at sample "i", of a tone
+ * which is "len" samples long. Dits and dahs come straight from the
+ * templates. Anything else is worked out into "ep".
+ */
+const float *
+_morse_audio_envelope(struct morse *mp, float *ep, int i, int len, int n)
+{
+	int k, ramp;
+
+	if (len == mp->bit_time && mp->dit_env != NULL)
+		return(mp->dit_env + i);
+	if (len == mp->bit_time * 3 && mp->dah_env != NULL)
+		return(mp->dah_env + i);
+	ramp = _audio_ramp(mp, len);
+	for (k = 0; k < n; k++)
+		ep[k] = (float )_audio_envelope(i + k, len, ramp);
+	return(ep);
+}
+
+/*
+ * Generate "n" samples of the carrier, shaped by the envelope "ep", where
+ * the first sample is number "clock" on the sample clock.
+ *
+ * The carrier runs continuously from the start of the output, as if the
+ * oscillator were never switched off, and the keying just opens and
+ * closes a gate on it. Rather than carry the phase from one element to
+ * the next, it is worked out afresh from the sample clock each time. The
+ * callers split their output into chunks which line up with multiples of
+ * AUDIO_CHUNK samples on the clock, so any given sample always comes out
+ * the same. A transmitter which chirps or drifts is generated separately
+ * (see impair.c), except when rendering, which is always clean.
+ */
+void
+_morse_audio_carrier(struct morse *mp, float *out, const float *ep, unsigned long long clock, int n)
+{
+	double phase;
+
+	if (!mp->render && mp->impair != NULL &&
+			(mp->impair->chirp != 0.0 || mp->impair->wander != 0.0)) {
+		_morse_impair_carrier(mp, out, ep, clock, n);
+		return;
+	}
+
+	phase = fmod((double )clock * mp->tone_frequency, (double )mp->sample_rate);
+	phase *= 2.0 * M_PI / (double )mp->sample_rate;
+	mp->simd->tone(out, ep, (float )((double )mp->word * cos(phase)),
+				(float )((double )mp->word * sin(phase)),
+				mp->carrier_c, mp->carrier_s, n);
+}
+
+#endif
+
+/*
+ * Round a drift (in samples) to the nearest whole number of samples.
+ */
+static int
+_audio_round(MORSE_EXACT drift)
+{
+#ifdef MORSE_FIXED
+	if (drift < 0)
+		return(-(int )((MORSE_EXACT_ONE / 2 - drift - 1) / MORSE_EXACT_ONE));
+	return((int )((drift + MORSE_EXACT_ONE / 2) / MORSE_EXACT_ONE));
+#else
+	return((int )floor(drift + 0.5));
+#endif
+}
+
+/*
+ * Has an asynchronous send just been aborted? If so, there's no point in
+ * generating any more audio, as it's only going to be thrown away. The
+ * fixed-point build has no asynchronous sending.
+ */
+static int
+_audio_aborted(struct morse *mp)
+{
+#ifdef MORSE_FIXED
+	return(0);
+#else
+	return(!mp->render && _morse_async_aborted(mp));
+#endif
+}
+
+/*
+ * Send a single element (a dit, or a dah if the flag is set). The
+ * element is a whole number of samples, so every one is the same, and
+ * the part of a sample left over is added to the drift.
+ */
+void
+morse_audio_element(struct morse *mp, int dah)
+{
+	int len = dah ? mp->bit_time * 3 : mp->bit_time;
+
+	if (!mp->render || mp->exact_render)
+		mp->drift += (dah ? mp->bit_exact * 3 : mp->bit_exact) - (MORSE_EXACT )len * MORSE_EXACT_ONE;
+	morse_audio_tone(mp, len);
+}
+
+/*
+ * Generate a sinusoidal tone of arbitrary length. We use a raised-cosine
+ * curve at either end of the wave form to avoid clicks. When we're only
+ * after the keying (see render.c), no audio is generated at all. If an
+ * asynchronous send is aborted, the rest of the tone is left out.
  */
 void
 morse_audio_tone(struct morse *mp, int len)
 {
-	int i, fade = 0;
-	double value, theta;
+	int i, n;
+	unsigned long long clock;
+	MORSE_SAMPLE env[AUDIO_CHUNK], out[AUDIO_CHUNK];
 
-	fade = mp->sample_rate / 440;
-	for (i = 0; i < len; i++) {
-		if (i > (len - fade)) {
-			/*
-			 * Need to decay the last 100 or so samples to avoid clicking.
-			 */
-			theta = (double )(i - len + fade) * M_PI_2 / (double )fade;
-			value = (1 - sin(theta)) * (double )mp->word;
-		} else
-			value = (double )mp->word;
-		theta = (2.0 * M_PI * (double )i * (double )mp->tone_frequency / mp->sample_rate);
-		sound_out(mp, (int )(value * sin(theta) + 0.5));
+	if (mp->render == MORSE_RENDER_KEYS) {
+		_morse_render_key(mp, len);
+		return;
+	}
+	for (i = 0; i < len && !_audio_aborted(mp); i += n) {
+		clock = mp->render ? mp->render_count : mp->time_stamp;
+		if ((n = AUDIO_CHUNK - clock % AUDIO_CHUNK) > len - i)
+			n = len - i;
+		_morse_audio_carrier(mp, out, _morse_audio_envelope(mp, env, i, len, n), clock, n);
+		morse_audio_write(mp, out, n);
 	}
 }
 
 /*
  * Add a block of silence. Note that it is the larger of the element delay,
  * the character delay, and the word delay. Whichever was last.
+ *
+ * This is also where the timing is kept exact (see below). Rendered audio
+ * is left alone, so that a word always renders the same way, unless the
+ * exact_render flag is set.
  */
 void
 morse_audio_silence(struct morse *mp)
 {
-	while (mp->sym_delay > 0) {
-		sound_out(mp, 0);
-		mp->sym_delay--;
+	int len = mp->sym_delay;
+
+	if ((!mp->render || mp->exact_render) && len > 0)
+		len = _morse_audio_gap(&mp->drift, len, mp->sym_exact);
+	morse_audio_zero(mp, len);
+	mp->sym_delay = 0;
+}
+
+/*
+ * The drift is what the rounding to whole samples has cost so far. Add
+ * in what it costs for a gap of "len" samples which should have been
+ * "exact", and return the gap stretched or shrunk (by a sample at most,
+ * each time) to make it up.
+ */
+int
+_morse_audio_gap(MORSE_EXACT *drift, int len, MORSE_EXACT exact)
+{
+	int adjust;
+
+	*drift += exact - (MORSE_EXACT )len * MORSE_EXACT_ONE;
+	adjust = _audio_round(*drift);
+	*drift -= (MORSE_EXACT )adjust * MORSE_EXACT_ONE;
+	return(len + adjust);
+}
+
+/*
+ * The size of one frame of output, in bytes.
+ */
+int
+_morse_audio_frame(struct morse *mp)
+{
+	return((int )(mp->format == MORSE_S16 ? sizeof(short) : sizeof(int)) * mp->channels);
+}
+
+#ifdef MORSE_FIXED
+/*
+ * Convert "n" samples to the output format, copying each one to all of
+ * the channels. There's no floating point output in the fixed-point
+ * build (see _morse_audio_buffer()).
+ */
+static void
+_audio_convert(struct morse *mp, void *out, const short *wp, int n)
+{
+	int i, c;
+	short *sp = (short *)out;
+	int *ip = (int *)out;
+
+	if (mp->format == MORSE_S16 && mp->channels == 1) {
+		memcpy(sp, wp, n * sizeof(short));
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		for (c = 0; c < mp->channels; c++) {
+			if (mp->format == MORSE_S16)
+				*sp++ = wp[i];
+			else
+				*ip++ = wp[i] * 65536;
+		}
+	}
+}
+#else
+/*
+ * Convert "n" samples to the output format, copying each one to all of
+ * the channels. The usual 16-bit mono goes through the vectorized kernel,
+ * and everything else is done the slow way. A 32-bit sample gets the
+ * extra precision the float has, beyond the 16-bit range.
+ */
+static void
+_audio_convert(struct morse *mp, void *out, const float *wp, int n)
+{
+	int i, c;
+	long v;
+	float f;
+	short *sp = (short *)out;
+	int *ip = (int *)out;
+	float *fp = (float *)out;
+
+	if (mp->format == MORSE_S16 && mp->channels == 1) {
+		mp->simd->convert(sp, wp, n);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		switch (mp->format) {
+		case MORSE_S16:
+			if ((v = lrintf(wp[i])) > 32767)
+				v = 32767;
+			else if (v < -32768)
+				v = -32768;
+			for (c = 0; c < mp->channels; c++)
+				*sp++ = (short )v;
+			break;
+
+		case MORSE_S32:
+			if ((f = wp[i] * 65536.0f) >= 2147483520.0f)
+				v = 2147483520L;
+			else if (f <= -2147483648.0f)
+				v = -2147483647L - 1;
+			else
+				v = lrintf(f);
+			for (c = 0; c < mp->channels; c++)
+				*ip++ = (int )v;
+			break;
+
+		default:
+			if ((f = wp[i] / 32768.0f) > 1.0f)
+				f = 1.0f;
+			else if (f < -1.0f)
+				f = -1.0f;
+			for (c = 0; c < mp->channels; c++)
+				*fp++ = f;
+			break;
+		}
+	}
+}
+#endif
+
+/*
+ * Set up the audio buffer. If the backend can give us its own memory to
+ * write into, use that and save a copy. Otherwise (or if it can't right
+ * now) use a buffer of our own. Returns -1 if we can't get any memory.
+ * In the fixed-point build, the buffer is part of the instance, and -1
+ * means the backend wants floating point samples.
+ */
+int
+_morse_audio_buffer(struct morse *mp)
+{
+	int n;
+	void *area;
+
+	if (mp->backend->begin != NULL && (n = mp->backend->begin(mp, &area)) > 0) {
+#ifndef MORSE_FIXED
+		if (!mp->mapped && mp->buffer != NULL)
+			free(mp->buffer);
+#endif
+		mp->buffer = area;
+		mp->buffer_size = n;
+		mp->mapped = 1;
+		return(0);
+	}
+	if (mp->mapped) {
+		mp->buffer = NULL;
+		mp->mapped = 0;
+	}
+#ifdef MORSE_FIXED
+	if (mp->format == MORSE_FLOAT)
+		return(-1);
+	mp->buffer = mp->fixed_buffer;
+	mp->buffer_size = sizeof(mp->fixed_buffer) / _morse_audio_frame(mp);
+#else
+	if (mp->buffer == NULL &&
+			(mp->buffer = malloc(AUDIO_BUFFER_SIZE * _morse_audio_frame(mp))) == NULL)
+		return(-1);
+	mp->buffer_size = AUDIO_BUFFER_SIZE;
+#endif
+	return(0);
+}
+
+#ifndef MORSE_FIXED
+/*
+ * The current time in seconds, for the statistics.
+ */
+static double
+_audio_clock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double )ts.tv_sec + (double )ts.tv_nsec / 1000000000.0);
+}
+#endif
+
+/*
+ * Start timing the generation of the next block from now. This is done
+ * when the output starts, and after waiting for it to drain, so that the
+ * wait isn't counted.
+ */
+void
+_morse_audio_mark(struct morse *mp)
+{
+#ifndef MORSE_FIXED
+	mp->stats_mark = _audio_clock();
+#endif
+}
+
+/*
+ * The audio buffer is full (or has to go now), so hand what's in it to
+ * the backend. If an asynchronous send has just been aborted, it's thrown
+ * away instead. If anything goes wrong, the error flag is set and the
+ * rest of the audio is dropped.
+ *
+ * The time taken to generate the block and to hand it over are kept in
+ * the statistics, along with how much the device has queued up. The
+ * fixed-point build has no asynchronous sending, and doesn't time
+ * anything, as there may be no clock to do it with.
+ */
+static void
+_audio_flush(struct morse *mp)
+{
+	int delay, aborted;
+	struct morse_stats *sp = &mp->stats;
+#ifndef MORSE_FIXED
+	int i;
+	double start, ms;
+#endif
+
+	if ((aborted = _audio_aborted(mp)) != 0)
+		_morse_audio_discard(mp);
+#ifndef MORSE_FIXED
+	start = _audio_clock();
+	ms = (start - mp->stats_mark) * 1000.0;
+	sp->render_time += ms;
+	if (ms > sp->render_max)
+		sp->render_max = ms;
+#endif
+	if (mp->mapped) {
+		if (mp->backend->commit(mp, mp->offset) < 0)
+			mp->error = 1;
+		mp->offset = 0;
+		if (_morse_audio_buffer(mp) < 0) {
+			perror("libmorse: malloc");
+			mp->error = 1;
+		}
+	} else {
+		if (!aborted && mp->backend->write(mp, mp->buffer, mp->offset) < 0)
+			mp->error = 1;
+		mp->offset = 0;
+	}
+	sp->blocks++;
+#ifndef MORSE_FIXED
+	mp->stats_mark = _audio_clock();
+	ms = (mp->stats_mark - start) * 1000.0;
+	sp->write_time += ms;
+	if (ms > sp->write_max)
+		sp->write_max = ms;
+	for (i = 0; i < MORSE_STATS_BUCKETS - 1 && ms * 1000.0 >= (double )(1 << i); i++)
+		;
+	sp->write_hist[i]++;
+#endif
+	if (mp->backend->delay != NULL && (delay = mp->backend->delay(mp, NULL)) >= 0)
+		sp->delay = delay;
+}
+
+/*
+ * Throw away whatever is in the audio buffer. It will never be heard, so
+ * it comes off the time stamp (and the sample count) again.
+ */
+void
+_morse_audio_discard(struct morse *mp)
+{
+	mp->time_stamp -= mp->offset;
+	mp->stats.samples -= mp->offset;
+	mp->offset = 0;
+}
+
+/*
+ * Hand whatever is in the audio buffer to the backend now, rather than
+ * waiting for it to fill. This is for live sending, where the audio is
+ * generated a period at a time and has to go straight out. Returns -1 if
+ * the audio output fails.
+ */
+int
+_morse_audio_push(struct morse *mp)
+{
+	if (mp->error)
+		return(-1);
+	if (mp->offset > 0)
+		_audio_flush(mp);
+	return(mp->error ? -1 : 0);
+}
+
+/*
+ * Append a block of samples to the audio buffer, converting them to the
+ * output format on the way, and hand the buffer to the audio backend
+ * each time it fills. The time stamp is advanced once for the whole block.
+ */
+static void
+_audio_append(struct morse *mp, const MORSE_SAMPLE *wp, int len)
+{
+	int n;
+
+	mp->time_stamp += len;
+	mp->stats.samples += len;
+	while (len > 0 && !mp->error) {
+		if ((n = mp->buffer_size - mp->offset) > len)
+			n = len;
+		_audio_convert(mp, (char *)mp->buffer + mp->offset * _morse_audio_frame(mp), wp, n);
+		wp += n;
+		len -= n;
+		if ((mp->offset += n) >= mp->buffer_size)
+			_audio_flush(mp);
+	}
+}
+
+/*
+ * Send a block of samples to the audio output. If there are channel
+ * impairments, they are applied to a copy on the way.
+ */
+void
+morse_audio_write(struct morse *mp, const MORSE_SAMPLE *wp, int len)
+{
+#ifndef MORSE_FIXED
+	int n;
+	float buf[AUDIO_CHUNK];
+#endif
+
+	if (mp->render) {
+		_morse_render_out(mp, wp, len);
+		return;
+	}
+#ifndef MORSE_FIXED
+	if (mp->impair != NULL) {
+		for (; len > 0; wp += n, len -= n) {
+			if ((n = len) > AUDIO_CHUNK)
+				n = AUDIO_CHUNK;
+			memcpy(buf, wp, n * sizeof(float));
+			_morse_impair_apply(mp, buf, n);
+			_audio_append(mp, buf, n);
+		}
+		return;
+	}
+#endif
+	_audio_append(mp, wp, len);
+}
+
+/*
+ * As above, but for a run of silence. No need for a source buffer, just
+ * zero out the relevant chunk of the audio buffer. With impairments, the
+ * silence is where the noise is heard on its own, so it is generated
+ * like anything else. As with a tone, an aborted send cuts it short.
+ */
+void
+morse_audio_zero(struct morse *mp, int len)
+{
+	int n;
+#ifndef MORSE_FIXED
+	float buf[AUDIO_CHUNK];
+#endif
+
+	if (mp->render) {
+		_morse_render_out(mp, NULL, len);
+		return;
+	}
+#ifndef MORSE_FIXED
+	if (mp->impair != NULL) {
+		for (; len > 0 && !_audio_aborted(mp); len -= n) {
+			if ((n = len) > AUDIO_CHUNK)
+				n = AUDIO_CHUNK;
+			memset(buf, 0, n * sizeof(float));
+			_morse_impair_apply(mp, buf, n);
+			_audio_append(mp, buf, n);
+		}
+		return;
+	}
+#endif
+	while (len > 0 && !mp->error && !_audio_aborted(mp)) {
+		if ((n = mp->buffer_size - mp->offset) > len)
+			n = len;
+		memset((char *)mp->buffer + mp->offset * _morse_audio_frame(mp), 0, n * _morse_audio_frame(mp));
+		mp->time_stamp += n;
+		mp->stats.samples += n;
+		len -= n;
+		if ((mp->offset += n) >= mp->buffer_size)
+			_audio_flush(mp);
 	}
 }
 
@@ -91,3 +774,52 @@ morse_timestamp(struct morse *mp)
 {
 	return((double )mp->time_stamp / (double )mp->sample_rate);
 }
+
+/*
+ * Work out which sample is coming out of the speaker. The sample clock
+ * (the time stamp, less whatever hasn't been heard yet) is returned in
+ * "clockp", along with the (CLOCK_MONOTONIC) time it applies to. With
+ * ALSA, this comes from snd_pcm_htimestamp(), so it's as good as the
+ * driver can manage. A backend which can't tell is assumed to have it all
+ * out already. Not to be used while an asynchronous send is in progress.
+ * Returns -1 if the audio output hasn't started (or has failed).
+ */
+int
+morse_position(struct morse *mp, unsigned long long *clockp, struct timespec *tsp)
+{
+	int delay = -1;
+	unsigned long long queued;
+
+	if (!mp->setup_done || mp->error)
+		return(-1);
+	if (mp->backend->delay != NULL)
+		delay = mp->backend->delay(mp, tsp);
+	if (delay < 0) {
+		clock_gettime(CLOCK_MONOTONIC, tsp);
+		if (mp->backend->delay == NULL || (delay = mp->backend->delay(mp, NULL)) < 0)
+			delay = 0;
+	}
+	queued = (unsigned long long )mp->offset + delay;
+	*clockp = mp->time_stamp > queued ? mp->time_stamp - queued : 0;
+	return(0);
+}
+
+/*
+ * Get the statistics for the audio output so far. In asynchronous mode,
+ * they may be a block out of date.
+ */
+void
+morse_stats(struct morse *mp, struct morse_stats *sp)
+{
+	*sp = mp->stats;
+}
+
+/*
+ * Start the statistics again from scratch.
+ */
+void
+morse_stats_reset(struct morse *mp)
+{
+	memset((char *)&mp->stats, 0, sizeof(struct morse_stats));
+	_morse_audio_mark(mp);
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Audio backend selection, plus the "null" backend which simply throws
+ * the audio away. The null backend is handy for measuring how fast the
+ * library can generate Morse, without any I/O getting in the way.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmorse.h"
+
+/*
+ * The list of known backends. The first one is the default, so without
+ * ALSA the default is to produce no sound at all.
+ */
+static const struct morse_backend *backends[] = {
+#ifdef ALSA
+	&morse_alsa_backend,
+#endif
+	&morse_null_backend,
+	&morse_wav_backend,
+	&morse_raw_backend,
+	NULL
+};
+
+/*
+ * Find a backend by name. A NULL name gets you the default.
+ */
+const struct morse_backend *
+morse_backend_lookup(const char *name)
+{
+	int i;
+
+	if (name == NULL)
+		return(backends[0]);
+	for (i = 0; backends[i] != NULL; i++)
+		if (strcmp(backends[i]->name, name) == 0)
+			return(backends[i]);
+	return(NULL);
+}
+
+/*
+ * Select and open an audio backend. Any previous backend is closed first.
+ * The argument is passed through to the backend (for example, the ALSA
+ * device name or the output file name). If this isn't called before the
+ * first character is sent, the default backend is opened with no
+ * argument.
+ */
+int
+morse_open(struct morse *mp, const char *name, const char *arg)
+{
+	const struct morse_backend *bp;
+
+	if ((bp = morse_backend_lookup(name)) == NULL) {
+		fprintf(stderr, "libmorse: unknown audio backend: %s\n", name);
+		return(-1);
+	}
+	if (mp->backend != NULL)
+		morse_close(mp);
+	mp->backend_data = NULL;
+	if (bp->open(mp, arg) < 0)
+		return(-1);
+	mp->backend = bp;
+	mp->error = 0;
+	return(0);
+}
+
+/*
+ * Called prior to close. This ensures that any buffered audio is written
+ * and we wait until the audio has actually been sent. Don't bother with
+ * this if you just want to exit or close down the library. In
+ * asynchronous mode, this waits for the queue to empty. Returns -1 if
+ * the audio output failed at any stage.
+ */
+int
+morse_drain(struct morse *mp)
+{
+#ifndef MORSE_FIXED
+	if (mp->async != NULL) {
+		morse_async_wait(mp);
+		return(mp->error ? -1 : 0);
+	}
+#endif
+	return(_morse_drain(mp));
+}
+
+/*
+ * The real work of the above. The audio thread calls this directly.
+ */
+int
+_morse_drain(struct morse *mp)
+{
+	if (mp->backend == NULL || !mp->setup_done || mp->error)
+		return(mp->error ? -1 : 0);
+	if (_morse_audio_push(mp) < 0 || mp->backend->drain(mp) < 0 ||
+			(mp->mapped && _morse_audio_buffer(mp) < 0)) {
+		mp->error = 1;
+		return(-1);
+	}
+	_morse_audio_mark(mp);
+	return(0);
+}
+
+/*
+ * Close the audio backend. The next character sent will reopen the
+ * default one. If the audio thread is running, it's stopped first (once
+ * it has finished whatever is queued).
+ */
+void
+morse_close(struct morse *mp)
+{
+#ifndef MORSE_FIXED
+	morse_async_stop(mp);
+#endif
+	if (mp->backend == NULL)
+		return;
+	mp->backend->close(mp);
+	mp->backend = NULL;
+	mp->backend_data = NULL;
+	if (mp->setup_done) {
+#ifndef MORSE_FIXED
+		if (!mp->mapped)
+			free(mp->buffer);
+#endif
+		mp->buffer = NULL;
+		mp->mapped = 0;
+		mp->setup_done = 0;
+	}
+}
+
+/*
+ * The null backend. Everything succeeds and nothing happens.
+ */
+static int
+null_open(struct morse *mp, const char *arg)
+{
+	return(0);
+}
+
+static int
+null_commence(struct morse *mp)
+{
+	return(0);
+}
+
+static int
+null_write(struct morse *mp, const void *bp, int len)
+{
+	return(0);
+}
+
+static int
+null_drain(struct morse *mp)
+{
+	return(0);
+}
+
+static void
+null_close(struct morse *mp)
+{
+}
+
+const struct morse_backend morse_null_backend = {
+	"null",
+	null_open,
+	null_commence,
+	null_write,
+	null_drain,
+	null_close,
+	NULL,
+	NULL,
+	NULL
+};
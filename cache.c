@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * A cache of rendered words. A trainer sends the same words (CQ, DE,
+ * callsigns and so on) over and over, at the same few speeds and
+ * pitches, so there's no point in synthesizing them every time. A
+ * message is put together from the rendered words, with runs of silence
+ * for the gaps in between, and only the words which aren't already in
+ * the cache are rendered.
+ *
+ * Each word is keyed by its text and every parameter which affects the
+ * audio. The least recently used words are thrown out to keep the cache
+ * under its size limit. The cache can be shared between threads, each
+ * with its own morse instance.
+ *
+ * Note that each word is rendered on its own, so the carrier phase
+ * starts afresh with each word rather than running on from the start of
+ * the message (see _morse_audio_carrier()). As the words are separated
+ * by silence, this makes no audible difference, and the timing is
+ * exactly the same as morse_render_string().
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "libmorse.h"
+
+#define NBUCKETS	4096
+
+/*
+ * Everything which affects the rendered audio, apart from the text.
+ */
+struct	cache_key	{
+	int				wpm;
+	int				farnsworth;
+	int				amplitude;
+	int				sample_rate;
+	double			tone_frequency;
+	double			ramp_time;
+};
+
+/*
+ * A cached word. The samples and then the text follow on in the same
+ * block of memory.
+ */
+struct	cache_entry	{
+	struct cache_entry *next;
+	struct cache_entry *newer;
+	struct cache_entry *older;
+	unsigned int	hash;
+	struct cache_key key;
+	int				nsamples;
+	size_t			size;
+	short			*samples;
+	char			*text;
+};
+
+struct	morse_cache	{
+	struct cache_entry *table[NBUCKETS];
+	struct cache_entry *newest;
+	struct cache_entry *oldest;
+	struct morse_cache_stats stats;
+	pthread_mutex_t	lock;
+};
+
+/*
+ * Create a cache which holds up to "size" bytes of words.
+ */
+struct morse_cache *
+morse_cache_init(unsigned long size)
+{
+	struct morse_cache *cp;
+
+	if ((cp = (struct morse_cache *)calloc(1, sizeof(struct morse_cache))) == NULL)
+		return(NULL);
+	cp->stats.max_bytes = size;
+	pthread_mutex_init(&cp->lock, NULL);
+	return(cp);
+}
+
+/*
+ * Throw away the cache and everything in it.
+ */
+void
+morse_cache_free(struct morse_cache *cp)
+{
+	struct cache_entry *ep, *np;
+
+	for (ep = cp->newest; ep != NULL; ep = np) {
+		np = ep->older;
+		free(ep);
+	}
+	pthread_mutex_destroy(&cp->lock);
+	free(cp);
+}
+
+/*
+ * Take a copy of the statistics.
+ */
+void
+morse_cache_stats(struct morse_cache *cp, struct morse_cache_stats *sp)
+{
+	pthread_mutex_lock(&cp->lock);
+	*sp = cp->stats;
+	pthread_mutex_unlock(&cp->lock);
+}
+
+/*
+ * A simple FNV-1a hash of the key and the text.
+ */
+static unsigned int
+_cache_hash(const struct cache_key *kp, const char *strp, int len)
+{
+	int i;
+	unsigned int hash = 2166136261u;
+	const unsigned char *cp = (const unsigned char *)kp;
+
+	for (i = 0; i < sizeof(struct cache_key); i++)
+		hash = (hash ^ cp[i]) * 16777619u;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char )strp[i]) * 16777619u;
+	return(hash);
+}
+
+/*
+ * Unhook an entry from the LRU list.
+ */
+static void
+_cache_unlink(struct morse_cache *cp, struct cache_entry *ep)
+{
+	if (ep->newer != NULL)
+		ep->newer->older = ep->older;
+	else
+		cp->newest = ep->older;
+	if (ep->older != NULL)
+		ep->older->newer = ep->newer;
+	else
+		cp->oldest = ep->newer;
+}
+
+/*
+ * Put an entry at the front of the LRU list.
+ */
+static void
+_cache_front(struct morse_cache *cp, struct cache_entry *ep)
+{
+	ep->newer = NULL;
+	if ((ep->older = cp->newest) != NULL)
+		cp->newest->newer = ep;
+	else
+		cp->oldest = ep;
+	cp->newest = ep;
+}
+
+/*
+ * Find a word, and mark it as just used. The lock must be held.
+ */
+static struct cache_entry *
+_cache_find(struct morse_cache *cp, const struct cache_key *kp, unsigned int hash,
+				const char *strp, int len)
+{
+	struct cache_entry *ep;
+
+	for (ep = cp->table[hash % NBUCKETS]; ep != NULL; ep = ep->next) {
+		if (ep->hash == hash && memcmp(&ep->key, kp, sizeof(struct cache_key)) == 0 &&
+				strcmp(ep->text, strp) == 0) {
+			_cache_unlink(cp, ep);
+			_cache_front(cp, ep);
+			return(ep);
+		}
+	}
+	return(NULL);
+}
+
+/*
+ * Throw out the least recently used word. The lock must be held.
+ */
+static void
+_cache_evict(struct morse_cache *cp)
+{
+	struct cache_entry *ep, **epp;
+
+	ep = cp->oldest;
+	for (epp = &cp->table[ep->hash % NBUCKETS]; *epp != ep; epp = &(*epp)->next)
+		;
+	*epp = ep->next;
+	_cache_unlink(cp, ep);
+	cp->stats.entries--;
+	cp->stats.bytes -= ep->size;
+	cp->stats.evictions++;
+	free(ep);
+}
+
+/*
+ * Render a word of "n" samples into a new entry. This is done without
+ * the lock held, so other threads can carry on using the cache in the
+ * meantime.
+ */
+static struct cache_entry *
+_cache_render(struct morse *mp, const struct cache_key *kp, unsigned int hash,
+				const char *strp, int len, int n)
+{
+	size_t size;
+	struct cache_entry *ep;
+
+	size = sizeof(struct cache_entry) + n * sizeof(short) + len + 1;
+	if ((ep = (struct cache_entry *)malloc(size)) == NULL)
+		return(NULL);
+	ep->next = ep->newer = ep->older = NULL;
+	ep->hash = hash;
+	ep->key = *kp;
+	ep->nsamples = n;
+	ep->size = size;
+	ep->samples = (short *)(ep + 1);
+	ep->text = (char *)(ep->samples + n);
+	memcpy(ep->text, strp, len);
+	ep->text[len] = '\0';
+	morse_render_string(mp, ep->text, ep->samples, n);
+	return(ep);
+}
+
+/*
+ * Copy a word of "n" samples into the output, from the cache if it's
+ * there, or by rendering it (and adding it to the cache) if not. Returns
+ * -1 if we ran out of memory.
+ */
+static int
+_cache_word(struct morse_cache *cp, struct morse *mp, const struct cache_key *kp,
+				const char *strp, int len, int n, short *out)
+{
+	unsigned int hash;
+	struct cache_entry *ep, *np;
+
+	hash = _cache_hash(kp, strp, len);
+	pthread_mutex_lock(&cp->lock);
+	if ((ep = _cache_find(cp, kp, hash, strp, len)) != NULL) {
+		cp->stats.hits++;
+		memcpy(out, ep->samples, n * sizeof(short));
+		pthread_mutex_unlock(&cp->lock);
+		return(0);
+	}
+	cp->stats.misses++;
+	pthread_mutex_unlock(&cp->lock);
+	if ((np = _cache_render(mp, kp, hash, strp, len, n)) == NULL)
+		return(-1);
+	memcpy(out, np->samples, n * sizeof(short));
+	pthread_mutex_lock(&cp->lock);
+	/*
+	 * Someone else may have got there first. Also, don't let one huge
+	 * word flush out everything else.
+	 */
+	if ((ep = _cache_find(cp, kp, hash, strp, len)) != NULL ||
+			np->size > cp->stats.max_bytes / 2) {
+		pthread_mutex_unlock(&cp->lock);
+		free(np);
+		return(0);
+	}
+	while (cp->stats.bytes + np->size > cp->stats.max_bytes)
+		_cache_evict(cp);
+	np->next = cp->table[hash % NBUCKETS];
+	cp->table[hash % NBUCKETS] = np;
+	_cache_front(cp, np);
+	cp->stats.entries++;
+	cp->stats.bytes += np->size;
+	pthread_mutex_unlock(&cp->lock);
+	return(0);
+}
+
+/*
+ * Render a string, using the cache for the words. The buffer is allocated
+ * by the library, and the caller is responsible for freeing it. As with
+ * morse_render_alloc(), the parameters are not recomputed here, so call
+ * morse_calc_params() after changing them. Each word is rendered on its
+ * own, so the timing can't be kept exact, and the exact_render flag is
+ * ignored. Returns the number of samples, or -1 if we ran out of memory
+ * (or the text would take too long).
+ */
+int
+morse_cache_render(struct morse_cache *cp, struct morse *mp, const char *strp, short **bufp)
+{
+	int n, len, total, pos, gap, exact, size = 0;
+	unsigned long long duration;
+	char *word = NULL;
+	const char *np;
+	short *buf;
+	struct cache_key key;
+
+	memset(&key, 0, sizeof(key));
+	key.wpm = mp->wpm;
+	key.farnsworth = mp->farnsworth;
+	key.amplitude = mp->amplitude;
+	key.sample_rate = mp->sample_rate;
+	key.tone_frequency = mp->tone_frequency;
+	key.ramp_time = mp->ramp_time;
+	*bufp = NULL;
+	exact = mp->exact_render;
+	mp->exact_render = 0;
+	duration = morse_duration(mp, strp);
+	total = (int )duration;
+	if (duration > 0x7fffffff ||
+			(buf = (short *)malloc((total > 0 ? total : 1) * sizeof(short))) == NULL) {
+		mp->exact_render = exact;
+		return(-1);
+	}
+	/*
+	 * Split the text into words just as morse_send_text() does. Each
+	 * word which sends anything is preceded by the gap left by the one
+	 * before it.
+	 */
+	for (pos = gap = 0; strp != NULL && *strp != '\0'; strp = np) {
+		if ((np = strpbrk(strp, " \t")) != NULL) {
+			len = np++ - strp;
+			while (isspace(*np))
+				np++;
+		} else
+			len = strlen(strp);
+		if (len == 0)
+			continue;
+		if (len >= size) {
+			size = len + 64;
+			free(word);
+			if ((word = (char *)malloc(size)) == NULL) {
+				mp->exact_render = exact;
+				free(buf);
+				return(-1);
+			}
+		}
+		memcpy(word, strp, len);
+		word[len] = '\0';
+		if ((n = morse_duration(mp, word)) > 0) {
+			if (pos + gap + n > total ||
+					_cache_word(cp, mp, &key, word, len, n, buf + pos + gap) < 0) {
+				mp->exact_render = exact;
+				free(word);
+				free(buf);
+				return(-1);
+			}
+			memset(buf + pos, 0, gap * sizeof(short));
+			pos += gap + n;
+		}
+		gap = mp->word_delay;
+	}
+	mp->exact_render = exact;
+	free(word);
+	*bufp = buf;
+	return(pos);
+}
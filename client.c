@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * The client side of the render service. The server (see morse_server.c)
+ * keeps a cache of rendered words, so a client which sends the same
+ * words over and over gets them back at memory-copy speed. The
+ * parameters for each request are taken from a morse instance, which is
+ * never used to generate anything itself.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libmorse.h"
+
+/*
+ * Read exactly "len" bytes, or return -1.
+ */
+int
+_morse_read_all(int fd, void *buf, int len)
+{
+	int n;
+	char *cp = (char *)buf;
+
+	while (len > 0) {
+		if ((n = read(fd, cp, len)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return(-1);
+		cp += n;
+		len -= n;
+	}
+	return(0);
+}
+
+/*
+ * Write exactly "len" bytes, or return -1.
+ */
+int
+_morse_write_all(int fd, const void *buf, int len)
+{
+	int n;
+	const char *cp = (const char *)buf;
+
+	while (len > 0) {
+		if ((n = send(fd, cp, len, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return(-1);
+		cp += n;
+		len -= n;
+	}
+	return(0);
+}
+
+/*
+ * Connect to the server. A NULL path gets the default socket.
+ */
+struct morse_client *
+morse_client_open(const char *path)
+{
+	struct morse_client *cp;
+	struct sockaddr_un sun;
+
+	if (path == NULL)
+		path = MORSE_SOCKET;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "libmorse: socket path too long: %s\n", path);
+		return(NULL);
+	}
+	if ((cp = (struct morse_client *)malloc(sizeof(struct morse_client))) == NULL)
+		return(NULL);
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if ((cp->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+			connect(cp->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		perror(path);
+		if (cp->fd >= 0)
+			close(cp->fd);
+		free(cp);
+		return(NULL);
+	}
+	return(cp);
+}
+
+/*
+ * Send a request, with the parameters from "mp".
+ */
+static int
+_client_request(struct morse_client *cp, int op, struct morse *mp, const char *strp, int len)
+{
+	struct morse_request req;
+
+	memset(&req, 0, sizeof(req));
+	req.op = op;
+	if (mp != NULL) {
+		req.wpm = mp->wpm;
+		req.farnsworth = mp->farnsworth;
+		req.amplitude = mp->amplitude;
+		req.sample_rate = mp->sample_rate;
+		req.tone_frequency = mp->tone_frequency;
+		req.ramp_time = mp->ramp_time;
+	}
+	req.len = len;
+	if (_morse_write_all(cp->fd, &req, sizeof(req)) < 0 ||
+			(len > 0 && _morse_write_all(cp->fd, strp, len) < 0))
+		return(-1);
+	return(0);
+}
+
+/*
+ * Have the server render a string, using the parameters in "mp". The
+ * buffer is allocated by the library, and the caller is responsible for
+ * freeing it. Returns the number of samples, or -1 on failure.
+ */
+int
+morse_client_render(struct morse_client *cp, struct morse *mp, const char *strp, short **bufp)
+{
+	int len;
+	short *buf;
+	struct morse_reply rep;
+
+	*bufp = NULL;
+	if ((len = strlen(strp)) > MORSE_MAX_TEXT)
+		return(-1);
+	if (_client_request(cp, MORSE_REQ_RENDER, mp, strp, len) < 0 ||
+			_morse_read_all(cp->fd, &rep, sizeof(rep)) < 0 || rep.status < 0)
+		return(-1);
+	if ((buf = (short *)malloc((rep.nsamples > 0 ? rep.nsamples : 1) * sizeof(short))) == NULL)
+		return(-1);
+	if (_morse_read_all(cp->fd, buf, rep.nsamples * sizeof(short)) < 0) {
+		free(buf);
+		return(-1);
+	}
+	*bufp = buf;
+	return(rep.nsamples);
+}
+
+/*
+ * Get the server's cache statistics.
+ */
+int
+morse_client_stats(struct morse_client *cp, struct morse_cache_stats *sp)
+{
+	struct morse_reply rep;
+
+	if (_client_request(cp, MORSE_REQ_STATS, NULL, NULL, 0) < 0 ||
+			_morse_read_all(cp->fd, &rep, sizeof(rep)) < 0 || rep.status < 0 ||
+			_morse_read_all(cp->fd, sp, sizeof(struct morse_cache_stats)) < 0)
+		return(-1);
+	return(0);
+}
+
+/*
+ * Disconnect from the server.
+ */
+void
+morse_client_close(struct morse_client *cp)
+{
+	close(cp->fd);
+	free(cp);
+}
@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Decode a stream of Morse Code audio back into text. The audio is split
+ * into short blocks (about 5ms each) and a Goertzel filter is used to
+ * measure the strength of the tone in each block. An adaptive threshold
+ * turns that into a key-up/key-down signal, and the lengths of the marks
+ * and spaces are then sorted into dits and dahs, and element, character
+ * and word gaps.
+ *
+ * The timing unit (the length of a dit) is taken from the shortest recent
+ * mark and the shortest recent space. Using both cancels out the way the
+ * attack and decay of each element make marks look a little short and
+ * spaces a little long. The character gap is taken from the shortest
+ * recent gap between characters, so that Farnsworth spacing is handled.
+ * Until at least one gap between characters has been seen, there's no
+ * telling how long the character gap is, so no word space is put out
+ * unless the speed is known.
+ * The elements of each character are only sorted into dits and dahs once
+ * the character is complete, so a change of speed is picked up from the
+ * character's own element gaps. Finally, the elements are turned back
+ * into characters using the inverse of morse_table[].
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libmorse.h"
+
+#define MIN_LEVEL	50.0
+#define SLOW		0.005
+
+/*
+ * Create a decoder for audio at the given sample rate, listening for a
+ * tone at the given frequency.
+ */
+struct morse_decoder *
+morse_decode_init(int sample_rate, double tone_frequency)
+{
+	struct morse_decoder *dp;
+
+	if ((dp = (struct morse_decoder *)malloc(sizeof(struct morse_decoder))) == NULL)
+		return(NULL);
+	_morse_decode_setup(dp, sample_rate, sample_rate / 200);
+	dp->tone_frequency = tone_frequency;
+	dp->coeff = 2.0 * cos(2.0 * M_PI * tone_frequency / (double )sample_rate);
+	return(dp);
+}
+
+/*
+ * Set up the timing side of a decoder, where the tone level is measured
+ * every "block" samples. The skimmer uses this directly, with its own
+ * filterbank in place of the Goertzel filter.
+ */
+void
+_morse_decode_setup(struct morse_decoder *dp, int sample_rate, int block)
+{
+	int i, code;
+
+	dp->sample_rate = sample_rate;
+	dp->tone_frequency = 0.0;
+	dp->coeff = 0.0;
+	dp->block = block;
+	dp->bps = (double )sample_rate / (double )block;
+	/*
+	 * Build the reverse lookup table. Only the printable characters go in
+	 * (lower case would just duplicate upper case). Anything else decodes
+	 * as an asterisk.
+	 */
+	memset(dp->reverse, '*', sizeof(dp->reverse));
+	for (i = 0x5f; i > 0x20; i--)
+		if ((code = morse_table[i]) != 0)
+			dp->reverse[code] = i;
+	morse_decode_reset(dp);
+}
+
+/*
+ * Reset the decoder to a known state. The speed estimate starts at
+ * 20 WPM and adapts from there.
+ */
+void
+morse_decode_reset(struct morse_decoder *dp)
+{
+	dp->q1 = dp->q2 = 0.0;
+	dp->count = 0;
+	dp->peak = dp->noise = dp->level = dp->strength = 0.0;
+	dp->key = 0;
+	dp->run = 0;
+	dp->nsyms = 0;
+	dp->gap_state = 2;
+	morse_decode_speed(dp, 0);
+}
+
+/*
+ * Give the decoder a hint as to the speed, if it's known (or zero if it
+ * isn't, in which case we start from 20 WPM). This makes the first
+ * character more reliable, and means the first word gap can be told from
+ * a character gap before any have been seen (see _decode_unit()). The
+ * timing history is cleared.
+ */
+void
+morse_decode_speed(struct morse_decoder *dp, int wpm)
+{
+	if (wpm > 0 && wpm < 5)
+		wpm = 5;
+	dp->hint = wpm;
+	dp->unit = 1.2 * dp->bps / (double )(wpm > 0 ? wpm : 20);
+	dp->cgap = dp->unit * 3.0;
+	dp->nmarks = dp->nspaces = dp->ngaps = 0;
+}
+
+/*
+ * Release the decoder.
+ */
+void
+morse_decode_free(struct morse_decoder *dp)
+{
+	free(dp);
+}
+
+/*
+ * Return the current speed estimate in words per minute. With Farnsworth
+ * spacing, this is the character speed.
+ */
+double
+morse_decode_wpm(struct morse_decoder *dp)
+{
+	return(1.2 * dp->bps / dp->unit);
+}
+
+/*
+ * Add a character to the output, as long as there is room.
+ */
+static void
+_decode_put(char **cpp, char *end, int ch)
+{
+	if (*cpp < end)
+		*(*cpp)++ = ch;
+}
+
+/*
+ * Find the shortest value in a timing history. A single value of less
+ * than half a unit is most likely a glitch (from noise or a neighbouring
+ * signal) so it is skipped. Two or more mean the speed has gone up.
+ */
+static int
+_decode_low(int *hp, int n, double unit)
+{
+	int i, lo0, lo1;
+
+	if (n > MORSE_DECODE_HISTORY)
+		n = MORSE_DECODE_HISTORY;
+	lo0 = lo1 = hp[0];
+	for (i = 1; i < n; i++) {
+		if (hp[i] < lo0) {
+			lo1 = lo0;
+			lo0 = hp[i];
+		} else if (hp[i] < lo1 || lo1 == lo0)
+			lo1 = hp[i];
+	}
+	if (n > 1 && (double )lo0 < unit / 2.0 && (double )lo1 >= unit / 2.0)
+		return(lo1);
+	return(lo0);
+}
+
+/*
+ * Recompute the timing unit from the mark and space histories. A run of
+ * a single block is most likely a glitch, so those don't count. The
+ * character gap is the shortest of the recent gaps between characters or
+ * words (with Farnsworth spacing it's longer than usual) but it can never
+ * be less than three units.
+ *
+ * Until there are any gaps, the character gap comes from the speed hint,
+ * if there is one. If the elements are going faster than the hint, it's
+ * Farnsworth spacing, and the gaps make up the difference. PARIS is 31
+ * units of elements and 19 of gaps, so from the ARRL paper, a character
+ * gap is 3/19 of what's left of the 50 units at the hinted speed.
+ */
+static void
+_decode_unit(struct morse_decoder *dp)
+{
+	double m, s;
+
+	if (dp->nmarks == 0)
+		return;
+	m = (double )_decode_low(dp->marks, dp->nmarks, dp->unit);
+	if (dp->nspaces > 0) {
+		s = (double )_decode_low(dp->spaces, dp->nspaces, dp->unit);
+		dp->unit = (m + s) / 2.0;
+	} else if (m < dp->unit)
+		dp->unit = m;
+	else if (m > dp->unit * 4.5)
+		dp->unit = m / 3.0;
+	dp->cgap = dp->unit * 3.0;
+	if (dp->ngaps > 0 && (s = (double )_decode_low(dp->gaps, dp->ngaps, dp->cgap)) > dp->cgap)
+		dp->cgap = s;
+	else if (dp->ngaps == 0 && dp->hint > 0) {
+		s = (50.0 * 1.2 * dp->bps / (double )dp->hint - 31.0 * dp->unit) * 3.0 / 19.0;
+		if (s > dp->cgap)
+			dp->cgap = s;
+	}
+}
+
+/*
+ * The character is complete. Sort the marks into dits and dahs and emit
+ * the corresponding character.
+ */
+static void
+_decode_char(struct morse_decoder *dp, char **cpp, char *end)
+{
+	int i, bitreg;
+
+	if (dp->nsyms == 0)
+		return;
+	_decode_unit(dp);
+	if (dp->nsyms > 6)
+		_decode_put(cpp, end, '*');
+	else {
+		for (bitreg = i = 0; i < dp->nsyms; i++)
+			if ((double )dp->elem[i] >= dp->unit * 2.0)
+				bitreg |= 1 << i;
+		_decode_put(cpp, end, dp->reverse[(dp->nsyms << 6) | bitreg]);
+	}
+	dp->nsyms = 0;
+}
+
+/*
+ * A mark (key down) of "len" blocks has just ended. Save it for
+ * classification at the end of the character.
+ */
+static void
+_decode_mark(struct morse_decoder *dp, int len)
+{
+	if (len > 1)
+		dp->marks[dp->nmarks++ % MORSE_DECODE_HISTORY] = len;
+	if (dp->nsyms < 7)
+		dp->elem[dp->nsyms] = len;
+	dp->nsyms++;
+	_decode_unit(dp);
+}
+
+/*
+ * A space (key up) of "len" blocks has just ended. Anything longer than
+ * an element gap goes into the gap history, which is used to work out
+ * the character gap.
+ */
+static void
+_decode_space(struct morse_decoder *dp, int len)
+{
+	if (len > 1)
+		dp->spaces[dp->nspaces++ % MORSE_DECODE_HISTORY] = len;
+	if ((double )len >= dp->unit * 2.0)
+		dp->gaps[dp->ngaps++ % MORSE_DECODE_HISTORY] = len;
+	_decode_unit(dp);
+}
+
+/*
+ * Process one block's worth of tone magnitude (the amplitude of the tone,
+ * on the same scale as the samples).
+ */
+static void
+_decode_block(struct morse_decoder *dp, double mag, char **cpp, char *end)
+{
+	int key;
+	double lo, hi;
+
+	/*
+	 * Track the noise floor (fast to fall, slow to rise, and only in the
+	 * gaps) and the signal peak (fast to rise, slow to fall), and set the
+	 * threshold in between with a bit of hysteresis.
+	 */
+	if (mag < dp->noise)
+		dp->noise = mag;
+	else if (mag < (dp->noise + dp->peak) / 2.0)
+		dp->noise += (mag - dp->noise) * SLOW;
+	if (dp->key && mag > dp->level)
+		dp->level = mag;
+	if (mag > dp->peak)
+		dp->peak = mag;
+	else
+		dp->peak += (mag - dp->peak) * SLOW;
+	if (dp->peak < MIN_LEVEL || dp->peak < dp->noise * 4.0)
+		key = 0;
+	else {
+		lo = dp->noise + (dp->peak - dp->noise) * 0.4;
+		hi = dp->noise + (dp->peak - dp->noise) * 0.6;
+		key = dp->key ? (mag > lo) : (mag > hi);
+	}
+	if (key == dp->key) {
+		dp->run++;
+		/*
+		 * Don't wait for the next mark to finish off a character or a
+		 * word. Do it as soon as the gap is long enough. With no gaps
+		 * in the history yet (and no hint), the first one might be a
+		 * stretched (Farnsworth) character gap, so it can't end a word.
+		 */
+		if (!key && dp->gap_state == 0 && dp->run >= dp->unit * 2.0) {
+			_decode_char(dp, cpp, end);
+			dp->gap_state = 1;
+		}
+		if (!key && dp->gap_state == 1 && (dp->ngaps > 0 || dp->hint > 0) &&
+						dp->run >= dp->cgap * 5.0 / 3.0) {
+			_decode_put(cpp, end, ' ');
+			dp->gap_state = 2;
+		}
+		return;
+	}
+	if (key) {
+		if (dp->nmarks > 0)
+			_decode_space(dp, dp->run);
+		dp->gap_state = 0;
+	} else {
+		if (dp->level > dp->strength * 4.0) {
+			/*
+			 * That mark was much stronger than anything before it.
+			 * Whatever we were timing up to now was probably noise
+			 * (or some other signal leaking in), so start again.
+			 */
+			morse_decode_speed(dp, dp->hint);
+			dp->nsyms = 0;
+		}
+		if (dp->level > dp->strength)
+			dp->strength = dp->level;
+		dp->level = 0.0;
+		_decode_mark(dp, dp->run);
+	}
+	dp->key = key;
+	dp->run = 1;
+}
+
+/*
+ * Feed a block of 16-bit samples into the decoder. Any characters decoded
+ * are written to the output buffer (up to "size" of them) and the number
+ * written is returned. A word gap comes out as a single space. The output
+ * isn't NUL terminated. At most one character and one space can come out
+ * of every 10ms of audio, so the output buffer can be quite small.
+ */
+int
+morse_decode(struct morse_decoder *dp, const short *sp, int len, char *out, int size)
+{
+	double q0, mag;
+	char *cp = out, *end = out + size;
+
+	while (len-- > 0) {
+		q0 = dp->coeff * dp->q1 - dp->q2 + (double )*sp++;
+		dp->q2 = dp->q1;
+		dp->q1 = q0;
+		if (++dp->count < dp->block)
+			continue;
+		mag = dp->q1 * dp->q1 + dp->q2 * dp->q2 - dp->coeff * dp->q1 * dp->q2;
+		mag = 2.0 * sqrt(mag > 0.0 ? mag : 0.0) / (double )dp->block;
+		_decode_block(dp, mag, &cp, end);
+		dp->q1 = dp->q2 = 0.0;
+		dp->count = 0;
+	}
+	return(cp - out);
+}
+
+/*
+ * Feed a single block's tone magnitude into the decoder, for callers that
+ * measure the tone themselves. Returns the number of characters written.
+ */
+int
+_morse_decode_level(struct morse_decoder *dp, double mag, char *out, int size)
+{
+	char *cp = out;
+
+	_decode_block(dp, mag, &cp, out + size);
+	return(cp - out);
+}
+
+/*
+ * At the end of the stream, flush out any partial character.
+ */
+int
+morse_decode_flush(struct morse_decoder *dp, char *out, int size)
+{
+	char *cp = out, *end = out + size;
+
+	if (dp->key)
+		_decode_mark(dp, dp->run);
+	else if (dp->run > 1)
+		dp->spaces[dp->nspaces++ % MORSE_DECODE_HISTORY] = dp->run;
+	_decode_char(dp, &cp, end);
+	dp->key = 0;
+	dp->run = 0;
+	dp->gap_state = 2;
+	return(cp - out);
+}
@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * File audio backends. The "wav" backend writes a standard RIFF/WAVE file
+ * and the "raw" backend writes bare 16-bit little-endian PCM. Either one
+ * will write to the standard output if the file name is "-", which makes
+ * it easy to pipe the audio into an encoder. The samples are swapped into
+ * little-endian order on the way out, if need be, so the files are the
+ * same on any machine.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "libmorse.h"
+
+#define WAV_HEADER_SIZE		44
+
+struct	file	{
+	int				fd;
+	int				wav;
+	int				header;
+	unsigned int	nbytes;
+};
+
+/*
+ * Write a block of data, coping with short writes and interrupts.
+ */
+static int
+_file_put(struct file *fp, const void *bp, int len)
+{
+	int n;
+	const char *cp = (const char *)bp;
+
+	while (len > 0) {
+		if ((n = write(fp->fd, cp, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("libmorse: write");
+			return(-1);
+		}
+		cp += n;
+		len -= n;
+	}
+	return(0);
+}
+
+/*
+ * Swap a block of samples between little-endian and native byte order (in
+ * either direction, as it's the same thing). On a little-endian machine,
+ * there's nothing to do. Use this on samples read back from a file.
+ */
+void
+morse_le16(short *bp, int len)
+{
+	unsigned short one = 1, s;
+
+	if (*(unsigned char *)&one)
+		return;
+	while (len-- > 0) {
+		s = (unsigned short )*bp;
+		*bp++ = (short )((s >> 8) | (s << 8));
+	}
+}
+
+/*
+ * Write out a block of samples in little-endian order. If they need to be
+ * swapped, it's done a chunk at a time in a copy.
+ */
+static int
+_file_samples(struct file *fp, const short *bp, int len)
+{
+	int n;
+	unsigned short one = 1;
+	short buf[AUDIO_CHUNK];
+
+	if (*(unsigned char *)&one)
+		return(_file_put(fp, bp, len * sizeof(short)));
+	for (; len > 0; bp += n, len -= n) {
+		if ((n = len) > AUDIO_CHUNK)
+			n = AUDIO_CHUNK;
+		memcpy(buf, bp, n * sizeof(short));
+		morse_le16(buf, n);
+		if (_file_put(fp, buf, n * sizeof(short)) < 0)
+			return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Fill out a WAV header for a file with "nbytes" bytes of mono 16-bit
+ * sample data.
+ */
+static void
+_file_wav_header(unsigned char *hp, int sample_rate, unsigned int nbytes)
+{
+	int i;
+	unsigned int val[7];
+
+	memcpy(hp, "RIFF....WAVEfmt ", 16);
+	memcpy(hp + 36, "data", 4);
+	val[0] = nbytes + WAV_HEADER_SIZE - 8;
+	val[1] = 16;
+	val[2] = 1 | (1 << 16);
+	val[3] = sample_rate;
+	val[4] = sample_rate * 2;
+	val[5] = 2 | (16 << 16);
+	val[6] = nbytes;
+	for (i = 0; i < 4; i++) {
+		hp[4 + i] = (val[0] >> (i * 8)) & 0xff;
+		hp[16 + i] = (val[1] >> (i * 8)) & 0xff;
+		hp[20 + i] = (val[2] >> (i * 8)) & 0xff;
+		hp[24 + i] = (val[3] >> (i * 8)) & 0xff;
+		hp[28 + i] = (val[4] >> (i * 8)) & 0xff;
+		hp[32 + i] = (val[5] >> (i * 8)) & 0xff;
+		hp[40 + i] = (val[6] >> (i * 8)) & 0xff;
+	}
+}
+
+/*
+ * Open the output file, or use the standard output.
+ */
+static int
+_file_open(struct morse *mp, const char *name, int wav)
+{
+	struct file *fp;
+
+	if (name == NULL) {
+		fprintf(stderr, "libmorse: no output file specified.\n");
+		return(-1);
+	}
+	if ((fp = (struct file *)malloc(sizeof(struct file))) == NULL) {
+		perror("libmorse: malloc");
+		return(-1);
+	}
+	if (strcmp(name, "-") == 0)
+		fp->fd = 1;
+	else if ((fp->fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		perror(name);
+		free(fp);
+		return(-1);
+	}
+	fp->wav = wav;
+	fp->header = 0;
+	fp->nbytes = 0;
+	mp->backend_data = (void *)fp;
+	return(0);
+}
+
+static int
+wav_open(struct morse *mp, const char *name)
+{
+	return(_file_open(mp, name, 1));
+}
+
+static int
+raw_open(struct morse *mp, const char *name)
+{
+	return(_file_open(mp, name, 0));
+}
+
+/*
+ * The sample rate is now known, so write the WAV header. We don't know the
+ * length yet, so use the maximum. This is what most tools expect when
+ * reading a WAV from a pipe. If the file is seekable, the header is fixed
+ * up when we drain or close.
+ */
+static int
+file_commence(struct morse *mp)
+{
+	unsigned char hdr[WAV_HEADER_SIZE];
+	struct file *fp = (struct file *)mp->backend_data;
+
+	if (!fp->wav || fp->header)
+		return(0);
+	fp->header = 1;
+	_file_wav_header(hdr, mp->sample_rate, 0xffffffff - WAV_HEADER_SIZE);
+	return(_file_put(fp, hdr, WAV_HEADER_SIZE));
+}
+
+static int
+file_write(struct morse *mp, const void *bp, int len)
+{
+	struct file *fp = (struct file *)mp->backend_data;
+
+	fp->nbytes += len * sizeof(short);
+	return(_file_samples(fp, (const short *)bp, len));
+}
+
+/*
+ * Rewrite the WAV header with the correct length, if we can.
+ */
+static int
+file_drain(struct morse *mp)
+{
+	off_t here;
+	unsigned char hdr[WAV_HEADER_SIZE];
+	struct file *fp = (struct file *)mp->backend_data;
+
+	if (!fp->header || (here = lseek(fp->fd, 0, SEEK_CUR)) < 0)
+		return(0);
+	_file_wav_header(hdr, mp->sample_rate, fp->nbytes);
+	if (lseek(fp->fd, 0, SEEK_SET) < 0 || _file_put(fp, hdr, WAV_HEADER_SIZE) < 0)
+		return(-1);
+	if (lseek(fp->fd, here, SEEK_SET) < 0)
+		return(-1);
+	return(0);
+}
+
+static void
+file_close(struct morse *mp)
+{
+	struct file *fp = (struct file *)mp->backend_data;
+
+	file_drain(mp);
+	if (fp->fd != 1)
+		close(fp->fd);
+	free(fp);
+}
+
+const struct morse_backend morse_wav_backend = {
+	"wav",
+	wav_open,
+	file_commence,
+	file_write,
+	file_drain,
+	file_close,
+	NULL,
+	NULL,
+	NULL
+};
+
+const struct morse_backend morse_raw_backend = {
+	"raw",
+	raw_open,
+	file_commence,
+	file_write,
+	file_drain,
+	file_close,
+	NULL,
+	NULL,
+	NULL
+};
+
+/*
+ * Write a block of samples out as a complete WAV file (or to the standard
+ * output, if the name is "-"). This is a convenience for programs which
+ * render into memory.
+ */
+int
+morse_wav_write(const char *name, const short *bp, int len, int sample_rate)
+{
+	int err;
+	unsigned char hdr[WAV_HEADER_SIZE];
+	struct file f;
+
+	if (strcmp(name, "-") == 0)
+		f.fd = 1;
+	else if ((f.fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		perror(name);
+		return(-1);
+	}
+	_file_wav_header(hdr, sample_rate, len * sizeof(short));
+	if ((err = _file_put(&f, hdr, WAV_HEADER_SIZE)) == 0)
+		err = _file_samples(&f, bp, len);
+	if (f.fd != 1)
+		close(f.fd);
+	return(err);
+}
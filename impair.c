@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Channel impairments, to make a clean synthetic signal sound as if it
+ * came off the air: band-limited noise at a given signal to noise ratio,
+ * fading (QSB), static crashes (QRN), and a transmitter which chirps at
+ * key-down and drifts in frequency.
+ *
+ * Fading, noise and crashes are applied to the audio on its way out of
+ * a morse instance (see morse_audio_write()), so that silence gets its
+ * share of noise too. The chirp and drift are part of the signal itself,
+ * so they are put into the carrier when it is generated (see
+ * _morse_audio_carrier()). Rendered audio is left clean of all of them,
+ * so it is the same whether or not there are impairments, and whether
+ * it is rendered in one piece or in parallel.
+ *
+ * The noise comes from the vectorized generator in simd.c, a block at a
+ * time, and goes through a band-pass filter centred on the tone, much
+ * like the receiver's filter. The rest of the random numbers (for the
+ * fading and the crashes) come from a separate generator, so turning
+ * them on or off doesn't change the noise. Everything is driven from the
+ * seed and counted in samples, so the same seed and the same settings
+ * always give exactly the same audio, however it is split into blocks.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libmorse.h"
+
+/*
+ * The fading is worked out every FADE_STEP samples, and interpolated in
+ * between.
+ */
+#define FADE_STEP		64
+
+/*
+ * The -3dB bandwidth of two identical resonators in a row, as a fraction
+ * of that of one of them.
+ */
+#define CASCADE_BW		0.6436
+
+/*
+ * Once this little of the chirp is left to come (in radians), it makes
+ * no difference.
+ */
+#define CHIRP_SETTLED	1e-4
+
+/*
+ * Create a set of impairments, all turned off, starting from the given
+ * seed. Hand it to a morse instance by setting mp->impair. Each morse
+ * instance needs its own.
+ */
+struct morse_impair *
+morse_impair_init(unsigned int seed)
+{
+	struct morse_impair *ip;
+
+	if ((ip = (struct morse_impair *)malloc(sizeof(struct morse_impair))) == NULL)
+		return(NULL);
+	ip->seed = seed;
+	ip->noise = 0;
+	ip->snr = 10.0;
+	ip->bandwidth = 500.0;
+	ip->fade = MORSE_FADE_NONE;
+	ip->fade_rate = 0.2;
+	ip->fade_depth = 20.0;
+	ip->qrn = 0.0;
+	ip->qrn_level = 10.0;
+	ip->chirp = 0.0;
+	ip->chirp_time = 10.0;
+	ip->wander = 0.0;
+	ip->wander_period = 30.0;
+	ip->simd = morse_simd_select();
+	morse_impair_reset(ip);
+	return(ip);
+}
+
+/*
+ * Release the impairments. Make sure no morse instance still uses them.
+ */
+void
+morse_impair_free(struct morse_impair *ip)
+{
+	free(ip);
+}
+
+/*
+ * The next number from the control generator (xoshiro128++, the same as
+ * each lane of the noise generator).
+ */
+static unsigned int
+_impair_next(struct morse_impair *ip)
+{
+	unsigned int r, t, *s = ip->ctl;
+
+	r = s[0] + s[3];
+	r = ((r << 7) | (r >> 25)) + s[0];
+	t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 11) | (s[3] >> 21);
+	return(r);
+}
+
+/*
+ * A uniform random number, from 0 up to (but not including) 1.
+ */
+static double
+_impair_uniform(struct morse_impair *ip)
+{
+	return((double )(_impair_next(ip) >> 8) / 16777216.0);
+}
+
+/*
+ * A Gaussian random number, with a variance of one, made the same way
+ * as the noise (see simd.c).
+ */
+static double
+_impair_gauss(struct morse_impair *ip)
+{
+	unsigned int a, b;
+
+	a = _impair_next(ip);
+	b = _impair_next(ip);
+	a = (a >> 16) + (a & 0xffff) + (b >> 16) + (b & 0xffff);
+	return(((double )a - 131070.0) / 37837.23);
+}
+
+/*
+ * Turn a 64-bit counter into a well-mixed 32-bit number (the splitmix64
+ * generator), for filling in the state of the generators from the seed.
+ */
+static unsigned int
+_impair_mix(unsigned long long *xp)
+{
+	unsigned long long z;
+
+	z = (*xp += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return((unsigned int )((z ^ (z >> 31)) >> 32));
+}
+
+/*
+ * Start again from the seed, as if nothing had been generated yet. The
+ * audio from here on is exactly the same as it was the first time.
+ */
+void
+morse_impair_reset(struct morse_impair *ip)
+{
+	int i;
+	unsigned long long x = ip->seed;
+
+	for (i = 0; i < 4 * MORSE_NOISE_LANES; i++)
+		ip->state[i] = _impair_mix(&x);
+	for (i = 0; i < 4; i++)
+		ip->ctl[i] = _impair_mix(&x);
+	ip->sample_rate = 0;
+	ip->frequency = ip->level = ip->filter_bw = 0.0;
+	for (i = 0; i < 4; i++)
+		ip->z[i] = 0.0;
+	ip->crash_env = 0.0;
+	ip->crash_decay = 0.0;
+	ip->crash_wait = -1.0;
+	ip->fade_i = ip->fade_q = 0.0;
+	ip->fade_from = 1.0;
+	ip->fade_to = -1.0;
+	ip->clock = 0;
+	ip->key_start = ip->key_next = 0;
+	ip->pool_left = 0;
+}
+
+/*
+ * Work out the band-pass filter: two identical resonators in a row, for
+ * a reasonably flat top and steep sides. The power gain for white noise
+ * is the energy in the impulse response, which sets how loud the noise
+ * has to be going in to give the right level coming out.
+ */
+static void
+_impair_filter(struct morse_impair *ip)
+{
+	int i;
+	double w0, q, alpha, a0, x, y, z[4], energy;
+
+	w0 = 2.0 * M_PI * ip->frequency / (double )ip->sample_rate;
+	if ((q = ip->frequency * CASCADE_BW / ip->bandwidth) < 0.1)
+		q = 0.1;
+	alpha = sin(w0) / (2.0 * q);
+	a0 = 1.0 + alpha;
+	ip->coeff[0] = alpha / a0;
+	ip->coeff[1] = -2.0 * cos(w0) / a0;
+	ip->coeff[2] = (1.0 - alpha) / a0;
+	z[0] = z[1] = z[2] = z[3] = 0.0;
+	energy = 0.0;
+	for (i = 0; i < ip->sample_rate; i++) {
+		x = (i == 0) ? 1.0 : 0.0;
+		y = ip->coeff[0] * x + z[0];
+		z[0] = z[1] - ip->coeff[1] * y;
+		z[1] = -ip->coeff[0] * x - ip->coeff[2] * y;
+		x = y;
+		y = ip->coeff[0] * x + z[2];
+		z[2] = z[3] - ip->coeff[1] * y;
+		z[3] = -ip->coeff[0] * x - ip->coeff[2] * y;
+		energy += y * y;
+	}
+	ip->filter_gain = energy;
+	ip->filter_bw = ip->bandwidth;
+}
+
+/*
+ * The gain of a sinusoidal fade at sample "clock". It starts at full
+ * strength and swings down by the depth and back, once per cycle.
+ */
+static double
+_impair_sine(struct morse_impair *ip, unsigned long long clock)
+{
+	double t, db;
+
+	t = (double )clock / (double )ip->sample_rate;
+	db = ip->fade_depth * (1.0 - cos(2.0 * M_PI * ip->fade_rate * fmod(t, 1.0 / ip->fade_rate))) / 2.0;
+	return(pow(10.0, -db / 20.0));
+}
+
+/*
+ * The gain of a Rayleigh fade, one step on. The signal is scattered
+ * into a random mix of paths, so its in-phase and quadrature parts are
+ * each low-pass filtered Gaussian noise, and the gain is the magnitude
+ * of the two. It is scaled so that the average power is unchanged. The
+ * filter is started off somewhere typical, rather than at zero.
+ */
+static double
+_impair_rayleigh(struct morse_impair *ip, int start)
+{
+	double a, var;
+
+	a = 1.0 - exp(-2.0 * M_PI * ip->fade_rate * FADE_STEP / (double )ip->sample_rate);
+	var = a / (2.0 - a);
+	if (start) {
+		ip->fade_i = _impair_gauss(ip) * sqrt(var);
+		ip->fade_q = _impair_gauss(ip) * sqrt(var);
+	} else {
+		ip->fade_i += a * (_impair_gauss(ip) - ip->fade_i);
+		ip->fade_q += a * (_impair_gauss(ip) - ip->fade_q);
+	}
+	return(sqrt((ip->fade_i * ip->fade_i + ip->fade_q * ip->fade_q) / (2.0 * var)));
+}
+
+/*
+ * The gain of the fading for the control point at sample "clock".
+ */
+static double
+_impair_fade(struct morse_impair *ip, unsigned long long clock, int start)
+{
+	if (ip->fade == MORSE_FADE_SINE)
+		return(_impair_sine(ip, clock));
+	return(_impair_rayleigh(ip, start));
+}
+
+/*
+ * Start a static crash: how loud it is (mostly about the typical level,
+ * sometimes much louder), and how long it takes to die away (5 to 50ms).
+ * Then work out how long until the next one.
+ */
+static void
+_impair_crash(struct morse_impair *ip)
+{
+	double tau;
+
+	ip->crash_env = ip->crash * -log(1.0 - _impair_uniform(ip));
+	tau = 0.005 * pow(10.0, _impair_uniform(ip));
+	ip->crash_decay = exp(-1.0 / (tau * (double )ip->sample_rate));
+	ip->crash_wait = -log(1.0 - _impair_uniform(ip)) * (double )ip->sample_rate / ip->qrn;
+}
+
+/*
+ * Apply the fading, noise and crashes to "n" samples of the output of a
+ * morse instance. The signal to noise ratio is measured against a steady
+ * tone at the instance's amplitude, and the filter is tuned to its tone.
+ */
+void
+_morse_impair_apply(struct morse *mp, float *wp, int n)
+{
+	int k;
+	double gain, amp, x, y, sig;
+	struct morse_impair *ip = mp->impair;
+
+	if (ip->sample_rate != mp->sample_rate || ip->frequency != mp->tone_frequency ||
+						ip->filter_bw != ip->bandwidth) {
+		ip->sample_rate = mp->sample_rate;
+		ip->frequency = mp->tone_frequency;
+		_impair_filter(ip);
+	}
+	ip->level = (double )mp->word;
+	sig = ip->level * ip->level / 2.0;
+	ip->sigma = ip->noise ? sqrt(sig / pow(10.0, ip->snr / 10.0) / ip->filter_gain) : 0.0;
+	ip->crash = sqrt(sig * pow(10.0, ip->qrn_level / 10.0) / ip->filter_gain);
+	if (ip->fade == MORSE_FADE_NONE)
+		ip->fade_to = -1.0;
+	for (k = 0; k < n; k++, ip->clock++) {
+		if (ip->fade != MORSE_FADE_NONE) {
+			if (ip->clock % FADE_STEP == 0) {
+				if (ip->fade_to < 0.0)
+					ip->fade_to = _impair_fade(ip, ip->clock, 1);
+				ip->fade_from = ip->fade_to;
+				ip->fade_to = _impair_fade(ip, ip->clock + FADE_STEP, 0);
+			}
+			if (ip->fade_to >= 0.0) {
+				gain = ip->fade_from + (ip->fade_to - ip->fade_from) *
+						(double )(ip->clock % FADE_STEP) / (double )FADE_STEP;
+				wp[k] *= (float )gain;
+			}
+		}
+		if (!ip->noise && ip->qrn <= 0.0)
+			continue;
+		amp = ip->sigma;
+		if (ip->qrn > 0.0) {
+			if (ip->crash_wait < 0.0)
+				ip->crash_wait = -log(1.0 - _impair_uniform(ip)) *
+							(double )ip->sample_rate / ip->qrn;
+			else if ((ip->crash_wait -= 1.0) < 0.0)
+				_impair_crash(ip);
+			amp += ip->crash_env;
+			ip->crash_env *= ip->crash_decay;
+		}
+		if (ip->pool_left == 0) {
+			ip->simd->noise(ip->pool, ip->state, MORSE_IMPAIR_POOL);
+			ip->pool_left = MORSE_IMPAIR_POOL;
+		}
+		x = amp * (double )ip->pool[MORSE_IMPAIR_POOL - ip->pool_left--];
+		y = ip->coeff[0] * x + ip->z[0];
+		ip->z[0] = ip->z[1] - ip->coeff[1] * y;
+		ip->z[1] = -ip->coeff[0] * x - ip->coeff[2] * y;
+		x = y;
+		y = ip->coeff[0] * x + ip->z[2];
+		ip->z[2] = ip->z[3] - ip->coeff[1] * y;
+		ip->z[3] = -ip->coeff[0] * x - ip->coeff[2] * y;
+		wp[k] += (float )y;
+	}
+}
+
+/*
+ * Generate "n" samples of a carrier which chirps and drifts, shaped by
+ * the envelope "ep", where the first sample is number "clock" on the
+ * sample clock (see _morse_audio_carrier()).
+ *
+ * The chirp is an offset in frequency at key-down which dies away
+ * exponentially, and the drift a slow swing back and forth. Both are
+ * added to the phase of the steady carrier, as the integral of the
+ * offset, so the tone never jumps. The phase is worked out exactly at
+ * the start of each call. From there, a phasor is rotated by the carrier
+ * step plus whatever the chirp adds for each sample, until the chirp has
+ * settled, and the rest is left to the usual tone kernel. The drift
+ * barely changes over a chunk, so it is taken as steady. A key-down is
+ * spotted by the clock not carrying on from where the last call left
+ * off, as the silence in between is never generated here.
+ */
+void
+_morse_impair_carrier(struct morse *mp, float *out, const float *ep, unsigned long long clock, int n)
+{
+	int k;
+	double rate, phase, step, chirp, e, decay, t, w, c, s, d, rc, rs, zr, zi;
+	struct morse_impair *ip = mp->impair;
+
+	if (clock != ip->key_next)
+		ip->key_start = clock;
+	ip->key_next = clock + n;
+	rate = (double )mp->sample_rate;
+	phase = fmod((double )clock * mp->tone_frequency, rate) * 2.0 * M_PI / rate;
+	step = 2.0 * M_PI * mp->tone_frequency / rate;
+	if (ip->wander != 0.0 && ip->wander_period > 0.0) {
+		t = fmod((double )clock / rate, ip->wander_period);
+		w = 2.0 * M_PI * t / ip->wander_period;
+		phase += ip->wander * ip->wander_period * (1.0 - cos(w));
+		step += 2.0 * M_PI * ip->wander * sin(w) / rate;
+	}
+	chirp = e = decay = 0.0;
+	if (ip->chirp != 0.0 && ip->chirp_time > 0.0) {
+		t = ip->chirp_time * rate / 1000.0;
+		chirp = 2.0 * M_PI * ip->chirp * ip->chirp_time / 1000.0;
+		e = exp(-(double )(clock - ip->key_start) / t);
+		decay = exp(-1.0 / t);
+		phase += chirp * (1.0 - e);
+	}
+	zr = (double )mp->word * cos(phase);
+	zi = (double )mp->word * sin(phase);
+	c = cos(step);
+	s = sin(step);
+	for (k = 0; k < n && fabs(chirp * e) >= CHIRP_SETTLED; k++, e *= decay) {
+		out[k] = ep[k] * (float )zi;
+		d = chirp * e * (1.0 - decay);
+		rc = c * (1.0 - d * d / 2.0) - s * (d - d * d * d / 6.0);
+		rs = s * (1.0 - d * d / 2.0) + c * (d - d * d * d / 6.0);
+		t = zr * rc - zi * rs;
+		zi = zr * rs + zi * rc;
+		zr = t;
+	}
+	if (k < n)
+		mp->simd->tone(out + k, ep + k, (float )zr, (float )zi, (float )c, (float )s, n - k);
+}
@@ -32,36 +32,100 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  * ABSTRACT
- * Initialize the library. Also the close and drain functions.
+ * Initialize the library, and free it again.
  */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "libmorse.h"
 
+#ifdef MORSE_FIXED
+/*
+ * The fixed-point build doesn't allocate anything, so the instances come
+ * from here.
+ */
+static struct morse	pool[MORSE_INSTANCES];
+static char			pool_used[MORSE_INSTANCES];
+#endif
+
 /*
  * Initialize the Morse Code library. Called with the desired words per
- * minute (an integer in the range of 5 <= wpm <= 60).
+ * minute (an integer in the range of 5 <= wpm <= 60). The sound device
+ * isn't opened until the first character is sent, so an instance which is
+ * only used with morse_render_string() never needs one. Returns NULL if
+ * there's no memory (or, in the fixed-point build, no free instance).
  */
 struct morse *
 morse_init(int wpm)
 {
 	struct morse *mp;
+#ifdef MORSE_FIXED
+	int i;
+
+	for (i = 0; i < MORSE_INSTANCES && pool_used[i]; i++)
+		;
+	if (i == MORSE_INSTANCES)
+		return(NULL);
+	pool_used[i] = 1;
+	mp = &pool[i];
+#else
 
 	/*
 	 * Initialize the basic elements.
 	 */
 	if ((mp = (struct morse *)malloc(sizeof(struct morse))) == NULL)
 		return(NULL);
+#endif
 	mp->wpm = wpm;
 	mp->setup_done = 0;
+	mp->error = 0;
+	mp->format = MORSE_S16;
+	mp->channels = 1;
+	memset((char *)&mp->stats, 0, sizeof(struct morse_stats));
+	mp->stats_mark = 0.0;
 	mp->farnsworth = 0;
 	mp->prosign = 0;
 	mp->amplitude = 85;
 	mp->sample_rate = 44100;
-	mp->tone_frequency = 800.0;
+	mp->tone_frequency = 800;
+	mp->ramp_time = 5;
+	mp->buffer_time = 500.0;
+	mp->period_time = 0.0;
+	mp->impair = NULL;
+	mp->exact_render = 0;
+#ifndef MORSE_FIXED
+	mp->dit_env = mp->dah_env = NULL;
+	mp->simd = morse_simd_select();
+#endif
+	mp->render = MORSE_RENDER_NONE;
+	mp->render_buf = NULL;
+	mp->keys = NULL;
+	mp->backend = NULL;
+	mp->backend_data = NULL;
+	mp->async = NULL;
 	morse_calc_params(mp);
-	sound_open(mp);
 	return(mp);
 }
+
+/*
+ * Finished with an instance. The audio is closed down (without waiting
+ * for it to drain, so call morse_drain() first if that matters) and all
+ * of the memory is released. Each instance is completely separate, so
+ * this has no effect on any others.
+ */
+void
+morse_free(struct morse *mp)
+{
+	if (mp == NULL)
+		return;
+	morse_close(mp);
+#ifdef MORSE_FIXED
+	pool_used[mp - pool] = 0;
+#else
+	free(mp->dit_env);
+	free(mp->dah_env);
+	free(mp);
+#endif
+}
@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * An iambic keyer, for sending live from a pair of paddles (or from the
+ * keyboard, a character at a time). The rest of the library turns a
+ * whole string into audio as fast as the backend will take it. The keyer
+ * is different: the caller drives it a period at a time, and each call
+ * to morse_keyer_run() generates a few milliseconds of audio, depending
+ * on what the paddles are doing right now, and pushes it straight out.
+ * With a small sound card buffer, the write blocks until there's room
+ * for the next period, which paces the whole thing. The time from a
+ * paddle going down to the tone being heard is then never much more than
+ * a period plus the buffer, and the keyer measures it each time to be
+ * sure.
+ *
+ * Everything is timed in samples, so the elements and spaces come out
+ * exact whatever the period. The paddles are looked at each time an
+ * element (and the space after it) ends, or at the start of the next
+ * period if the keyer is idle. They should be set from the same thread
+ * which runs the keyer.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "libmorse.h"
+
+#define KEYER_IDLE		0
+#define KEYER_TONE		1
+#define KEYER_SPACE		2
+
+#define DIT				01
+#define DAH				02
+
+/*
+ * The paddles (and the element remembered from them) are bit masks of
+ * DIT and DAH. A character of typed text is sent from "bits", as in
+ * _morse_send_char(). "idle" counts the samples since the last tone, so
+ * that typed characters and words get their proper gaps however slowly
+ * they're typed. "event" is when a paddle was pressed (or a key typed)
+ * while the keyer was idle, for measuring the latency.
+ */
+struct	morse_keyer	{
+	struct morse	*mp;
+	int				mode;
+	int				paddle;
+	int				memory;
+	int				state;
+	int				last;
+	int				len;
+	int				left;
+	unsigned int	idle;
+	int				bits;
+	int				nsyms;
+	int				word;
+	double			event;
+	int				head;
+	int				tail;
+	char			queue[MORSE_KEYER_QUEUE];
+	struct morse_keyer_stats stats;
+};
+
+/*
+ * Create a keyer which sends through the given morse instance, using its
+ * speed, tone and audio backend.
+ */
+struct morse_keyer *
+morse_keyer_init(struct morse *mp, int mode)
+{
+	struct morse_keyer *kp;
+
+	if ((kp = (struct morse_keyer *)malloc(sizeof(struct morse_keyer))) == NULL)
+		return(NULL);
+	memset((char *)kp, 0, sizeof(struct morse_keyer));
+	kp->mp = mp;
+	kp->mode = mode;
+	kp->state = KEYER_IDLE;
+	kp->idle = 0x7fffffff;
+	kp->event = 0.0;
+	return(kp);
+}
+
+/*
+ * The current time, in seconds, on the same clock as the paddle events.
+ */
+double
+morse_keyer_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double )ts.tv_sec + (double )ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ * The paddles have changed. "when" is the time of the change (from
+ * morse_keyer_now(), or the input event), or zero for right now.
+ *
+ * A paddle pressed while the keyer is idle always gets its element,
+ * however quickly it's let go. In mode B, so does the opposite paddle
+ * pressed while an element is being sent.
+ */
+void
+morse_keyer_paddle(struct morse_keyer *kp, int dit, int dah, double when)
+{
+	int paddle, pressed;
+
+	paddle = (dit ? DIT : 0) | (dah ? DAH : 0);
+	pressed = paddle & ~kp->paddle;
+	kp->paddle = paddle;
+	if (pressed == 0)
+		return;
+	if (kp->state == KEYER_IDLE) {
+		if (kp->memory == 0)
+			kp->memory = (pressed & DIT) ? DIT : DAH;
+		if (kp->event == 0.0)
+			kp->event = when > 0.0 ? when : morse_keyer_now();
+	} else if (kp->mode == MORSE_KEYER_B && (pressed & ~kp->last) != 0)
+		kp->memory |= pressed & ~kp->last;
+}
+
+/*
+ * Queue up some typed text. Returns the number of characters which fit
+ * in the queue.
+ */
+int
+morse_keyer_send(struct morse_keyer *kp, const char *strp, int len, double when)
+{
+	int i, next;
+
+	for (i = 0; i < len; i++) {
+		if ((next = (kp->tail + 1) % MORSE_KEYER_QUEUE) == kp->head)
+			break;
+		kp->queue[kp->tail] = strp[i];
+		kp->tail = next;
+	}
+	if (i > 0 && kp->state == KEYER_IDLE && kp->event == 0.0)
+		kp->event = when > 0.0 ? when : morse_keyer_now();
+	return(i);
+}
+
+/*
+ * Is the keyer still sending (or does it have something to send)?
+ */
+int
+morse_keyer_busy(struct morse_keyer *kp)
+{
+	return(kp->state != KEYER_IDLE || kp->memory != 0 ||
+				kp->nsyms > 0 || kp->head != kp->tail);
+}
+
+/*
+ * Pick the next element from the paddles. With both held, the elements
+ * alternate. Returns zero if there isn't one.
+ */
+static int
+_keyer_paddles(struct morse_keyer *kp)
+{
+	int el, paddle = kp->paddle | kp->memory;
+
+	kp->memory = 0;
+	if (paddle == 0)
+		el = 0;
+	else if (kp->last == DIT)
+		el = (paddle & DAH) ? DAH : DIT;
+	else if (kp->last == DAH)
+		el = (paddle & DIT) ? DIT : DAH;
+	else
+		el = (paddle & DIT) ? DIT : DAH;
+	return(el);
+}
+
+/*
+ * Take the next character of typed text off the queue. Any white space
+ * before it means a word gap is due. Returns zero if there's nothing to
+ * send.
+ */
+static int
+_keyer_char(struct morse_keyer *kp)
+{
+	int ch;
+
+	while (kp->head != kp->tail) {
+		ch = kp->queue[kp->head] & 0x7f;
+		kp->head = (kp->head + 1) % MORSE_KEYER_QUEUE;
+		if (isspace(ch)) {
+			kp->word = 1;
+			continue;
+		}
+		if (!isprint(ch))
+			continue;
+		kp->bits = morse_table[ch];
+		if ((kp->nsyms = (kp->bits >> 6) & 07) == 0)
+			kp->nsyms = 8;
+		kp->bits &= 077;
+		return(1);
+	}
+	return(0);
+}
+
+/*
+ * Work out what comes next, now that the current element or space (or
+ * the idle period) has finished. Every element is followed by a one-bit
+ * space. After that, the paddles come first, unless a typed character
+ * is only part sent. A new typed character waits until it's a character
+ * (or word) gap since the last tone. Returns 1 if a tone has started.
+ */
+static int
+_keyer_next(struct morse_keyer *kp)
+{
+	int el, gap;
+	struct morse *mp = kp->mp;
+
+	if (kp->state == KEYER_TONE) {
+		kp->state = KEYER_SPACE;
+		kp->len = kp->left = mp->bit_time;
+		return(0);
+	}
+	el = 0;
+	if (kp->nsyms == 0 && (el = _keyer_paddles(kp)) == 0 && _keyer_char(kp)) {
+		gap = kp->word ? mp->word_delay : mp->char_delay;
+		kp->word = 0;
+		if (kp->idle < gap) {
+			kp->state = KEYER_SPACE;
+			kp->len = kp->left = gap - kp->idle;
+			return(0);
+		}
+	}
+	if (el == 0 && kp->nsyms > 0) {
+		el = (kp->bits & 01) ? DAH : DIT;
+		kp->bits >>= 1;
+		kp->nsyms--;
+	} else if (el != 0 && kp->mode == MORSE_KEYER_B)
+		kp->memory = kp->paddle & ~el;
+	if (el == 0) {
+		kp->state = KEYER_IDLE;
+		kp->last = 0;
+		kp->len = kp->left = 0;
+		return(0);
+	}
+	kp->state = KEYER_TONE;
+	kp->last = el;
+	kp->len = kp->left = el == DAH ? mp->bit_time * 3 : mp->bit_time;
+	kp->idle = 0;
+	return(1);
+}
+
+/*
+ * A tone has just started, "frames" after the time "now". If the keyer
+ * was woken from idle, note how long it took.
+ */
+static void
+_keyer_latency(struct morse_keyer *kp, double now, int frames)
+{
+	double ms;
+	struct morse_keyer_stats *sp = &kp->stats;
+
+	if (kp->event == 0.0)
+		return;
+	ms = (now - kp->event + (double )frames / (double )kp->mp->sample_rate) * 1000.0;
+	kp->event = 0.0;
+	if (sp->count == 0 || ms < sp->min)
+		sp->min = ms;
+	if (sp->count == 0 || ms > sp->max)
+		sp->max = ms;
+	sp->count++;
+	sp->total += ms;
+	if (ms > sp->bound)
+		sp->late++;
+}
+
+/*
+ * Generate the next "len" frames of audio and send them straight out.
+ * The latency should be no more than this period plus the sound card
+ * buffer (the one the device gave us, which morse_setup() fills in). If
+ * the backend can't say how much it has queued, the latency only covers
+ * getting the tone generated. The audio is split into chunks which line
+ * up with the sample clock, as in morse_audio_tone(), so that the carrier
+ * comes out the same however the periods fall. Returns -1 if the audio
+ * output fails.
+ */
+int
+morse_keyer_run(struct morse_keyer *kp, int len)
+{
+	int n, done, delay;
+	double now, bound;
+	float env[AUDIO_CHUNK], out[AUDIO_CHUNK];
+	struct morse *mp = kp->mp;
+
+	if (morse_setup(mp) < 0)
+		return(-1);
+	bound = mp->buffer_time + (double )len * 1000.0 / (double )mp->sample_rate;
+	if (bound > kp->stats.bound)
+		kp->stats.bound = bound;
+	now = morse_keyer_now();
+	if (mp->backend->delay == NULL || (delay = mp->backend->delay(mp, NULL)) < 0)
+		delay = 0;
+	for (done = 0; done < len && !mp->error; done += n) {
+		if (kp->left == 0 && _keyer_next(kp))
+			_keyer_latency(kp, now, delay + done);
+		if ((n = AUDIO_CHUNK - mp->time_stamp % AUDIO_CHUNK) > len - done)
+			n = len - done;
+		if (kp->state != KEYER_IDLE && n > kp->left)
+			n = kp->left;
+		if (kp->state == KEYER_TONE) {
+			_morse_audio_carrier(mp, out,
+					_morse_audio_envelope(mp, env, kp->len - kp->left, kp->len, n),
+					mp->time_stamp, n);
+			morse_audio_write(mp, out, n);
+		} else {
+			morse_audio_zero(mp, n);
+			if (kp->idle < 0x7fffffff)
+				kp->idle += n;
+		}
+		if (kp->state != KEYER_IDLE)
+			kp->left -= n;
+	}
+	return(_morse_audio_push(mp));
+}
+
+/*
+ * Get the latency figures so far.
+ */
+void
+morse_keyer_stats(struct morse_keyer *kp, struct morse_keyer_stats *sp)
+{
+	*sp = kp->stats;
+}
+
+/*
+ * Free up the keyer. The morse instance is left alone.
+ */
+void
+morse_keyer_free(struct morse_keyer *kp)
+{
+	free(kp);
+}
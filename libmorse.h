@@ -38,6 +38,134 @@
  * fun!
  */
 #define AUDIO_BUFFER_SIZE	16*1024
+#define AUDIO_CHUNK			256
+
+/*
+ * The fixed-point build (-DMORSE_FIXED) is for small processors with no
+ * floating point unit. The synthesis works in 16-bit integers rather than
+ * floats, the exact element and gap lengths are in 32.32 fixed point
+ * rather than doubles, and nothing is allocated: the instances come from
+ * a static pool and each one has a small audio buffer of its own. See
+ * audio.c for the details, and the Makefile for what's included.
+ */
+#ifdef MORSE_FIXED
+#define MORSE_SAMPLE		short
+#define MORSE_EXACT			long long
+#define MORSE_EXACT_ONE		(1LL << 32)
+#define MORSE_INSTANCES		2
+#define MORSE_FIXED_BUFFER	1024
+#else
+#define MORSE_SAMPLE		float
+#define MORSE_EXACT			double
+#define MORSE_EXACT_ONE		1.0
+#endif
+
+struct	morse;
+struct	morse_async;
+struct	morse_cache;
+struct	timespec;
+
+/*
+ * A key-down period (see morse_render_keys). The key goes down "start"
+ * samples after the start of the text, and comes back up "len" samples
+ * later. Divide by the sample rate for seconds.
+ */
+struct	morse_key	{
+	unsigned long long start;
+	int				len;
+};
+
+/*
+ * An audio backend. Each one provides a set of functions for opening the
+ * output (the argument is backend-specific, such as an ALSA device name or
+ * a file name), setting it up once the parameters are known, writing a
+ * block of samples, draining and closing. The first four return zero on
+ * success or -1 on failure. Commence can change the sample rate, format
+ * and channel count to suit the output, and the samples are written in
+ * whatever it picked. Lengths are always in frames (one sample for each
+ * channel).
+ *
+ * A backend which can hand out its own memory (such as an mmap'd sound
+ * card buffer) can also provide begin and commit. Begin returns a
+ * pointer to some free space and how many samples will fit (or zero if
+ * it can't do that right now), and commit says how many were filled in.
+ * Either can be NULL. So can delay, which says how many frames have been
+ * handed over but not yet heard (or -1 if it can't tell). If it's given
+ * a timespec, that is filled in with the (CLOCK_MONOTONIC) time at which
+ * the figure was true.
+ */
+struct	morse_backend	{
+	const char		*name;
+	int				(*open)(struct morse *, const char *);
+	int				(*commence)(struct morse *);
+	int				(*write)(struct morse *, const void *, int);
+	int				(*drain)(struct morse *);
+	void			(*close)(struct morse *);
+	int				(*begin)(struct morse *, void **);
+	int				(*commit)(struct morse *, int);
+	int				(*delay)(struct morse *, struct timespec *);
+};
+
+/*
+ * A set of vectorized kernels (see simd.c). The noise kernel keeps the
+ * state of one random number generator for each of MORSE_NOISE_LANES
+ * lanes.
+ */
+#define MORSE_NOISE_LANES	8
+
+struct	morse_simd	{
+	const char		*name;
+	void			(*magnitude)(const float *, const float *, float *, int);
+	void			(*envelope)(float *, const float *, float, int);
+	void			(*tone)(float *, const float *, float, float, float, float, int);
+	void			(*convert)(short *, const float *, int);
+	void			(*mix)(float *, const float *, int);
+	void			(*noise)(float *, unsigned int *, int);
+};
+
+/*
+ * Statistics for the audio output of a morse instance. The samples are
+ * those generated for the backend (not rendered into memory), and the
+ * blocks are the hand-offs to the backend. Each is timed, along with
+ * the time spent generating the audio for it. The times are in ms.
+ * write_hist[i] counts the writes which took less than 2^i microseconds
+ * (and at least half that), and the last one gets all of the slower
+ * ones. The delay is the number of frames the device had queued at the
+ * last write, if it can say. An xrun is the device running dry (or being
+ * suspended), after which it is recovered and the audio carries on.
+ */
+#define MORSE_STATS_BUCKETS	20
+
+struct	morse_stats	{
+	unsigned long long samples;
+	unsigned long	blocks;
+	unsigned long	xruns;
+	unsigned long	short_writes;
+	int				delay;
+	double			write_time;
+	double			write_max;
+	double			render_time;
+	double			render_max;
+	unsigned long	write_hist[MORSE_STATS_BUCKETS];
+};
+
+/*
+ * Sample formats for the audio output. The samples are in native byte
+ * order, and floating point samples run from -1.0 to 1.0.
+ */
+#define MORSE_S16		0
+#define MORSE_S32		1
+#define MORSE_FLOAT		2
+
+/*
+ * Where the audio goes when it's rendered rather than sent (see render.c):
+ * into a buffer of a fixed size, into one which grows as needed, or
+ * nowhere, with only the keying noted down.
+ */
+#define MORSE_RENDER_NONE	0
+#define MORSE_RENDER_FIXED	1
+#define MORSE_RENDER_GROW	2
+#define MORSE_RENDER_KEYS	3
 
 struct  morse	{
 	/*
@@ -49,44 +177,510 @@ struct  morse	{
 	 *    amplitude:      Signal amplitude (0->100.0)
 	 *    sample_rate:    Audio sample rate (usually 44.1kHz)
 	 *    tone_frequency: Audio tone - 800Hz is a good value
+	 *    ramp_time:      Raised-cosine attack/decay time in ms (5ms)
+	 *    buffer_time:    Audio output buffering in ms (500ms)
+	 *    period_time:    Audio period in ms, or zero to let the device
+	 *                    decide (0)
+	 *    impair:         Channel impairments for the audio output (see
+	 *                    impair.c), or NULL for a clean signal
+	 *    exact_render:   Set to non-zero to keep the timing exact when
+	 *                    rendering, as it is for the audio output (see
+	 *                    render.c)
+	 *
+	 * In the fixed-point build, the tone frequency and ramp time are
+	 * whole numbers (of Hz and ms), and there are no impairments.
 	 */
 	int				wpm;
 	int				farnsworth;
 	int				amplitude;
 	int				sample_rate;
+#ifdef MORSE_FIXED
+	int				tone_frequency;
+	int				ramp_time;
+#else
 	double			tone_frequency;
+	double			ramp_time;
+#endif
+	double			buffer_time;
+	double			period_time;
+	struct morse_impair *impair;
+	int				exact_render;
 	/*
-	 * Do not modify any of the following parameters.
+	 * Do not modify any of the following parameters. The error flag
+	 * is set if the audio output fails, after which nothing more is
+	 * sent until morse_open() is called again. The sample rate can be
+	 * changed when the audio output starts, if the device doesn't
+	 * support the one asked for (as can the buffer and period times,
+	 * which are set to what the device gave us), and the format and channel count are
+	 * whatever the device does best. Each sample is copied to all of the
+	 * channels. The time stamp counts the samples since the output
+	 * started. The element and gap lengths are kept exact (in fractions
+	 * of a sample) as well as rounded, and the difference builds up in
+	 * "drift" and is made up in the gaps, so that the speed is exact in
+	 * the long run. In the fixed-point build, the carrier is a phase
+	 * accumulator, and there are no envelope templates.
 	 */
 	int				setup_done;
-	unsigned int	time_stamp;
+	int				error;
+	int				format;
+	int				channels;
+	unsigned long long time_stamp;
 	unsigned int	bit_time;
 	unsigned int	char_delay;
 	unsigned int	word_delay;
 	unsigned int	sym_delay;
+	MORSE_EXACT		bit_exact;
+	MORSE_EXACT		char_exact;
+	MORSE_EXACT		word_exact;
+	MORSE_EXACT		sym_exact;
+	MORSE_EXACT		drift;
+	struct morse_stats stats;
+	double			stats_mark;
 	int				prosign;
 	unsigned short	word;
 	int				offset;
-	void			*audio;
-	unsigned short	*buffer;
+	const struct morse_backend *backend;
+	void			*backend_data;
+	void			*buffer;
+	int				buffer_size;
+	int				mapped;
+#ifdef MORSE_FIXED
+	short			fixed_buffer[MORSE_FIXED_BUFFER];
+	unsigned int	phase_step;
+	int				ramp;
+#else
+	float			*dit_env;
+	float			*dah_env;
+	const struct morse_simd *simd;
+	float			carrier_c;
+	float			carrier_s;
+#endif
+	int				render;
+	short			*render_buf;
+	int				render_size;
+	unsigned long long render_count;
+	struct morse_key *keys;
+	int				nkeys;
+	int				keys_size;
+	struct morse_async *async;
+};
+
+extern unsigned short	morse_table[128];
+
+/*
+ * A Morse Code decoder. See decode.c for the gory details.
+ */
+#define MORSE_DECODE_HISTORY	16
+
+struct	morse_decoder	{
+	int				sample_rate;
+	double			tone_frequency;
+	int				block;
+	double			bps;
+	double			coeff;
+	double			q1;
+	double			q2;
+	int				count;
+	double			peak;
+	double			level;
+	double			strength;
+	double			noise;
+	int				key;
+	int				run;
+	int				hint;
+	double			unit;
+	double			cgap;
+	int				marks[MORSE_DECODE_HISTORY];
+	int				spaces[MORSE_DECODE_HISTORY];
+	int				gaps[MORSE_DECODE_HISTORY];
+	int				nmarks;
+	int				nspaces;
+	int				ngaps;
+	int				elem[7];
+	int				nsyms;
+	int				gap_state;
+	char			reverse[512];
+};
+
+
+/*
+ * A wideband skimmer - a filterbank with a decoder for each channel.
+ */
+#define MORSE_SKIM_TEXT		64
+
+struct	morse_skim_channel	{
+	double			frequency;
+	int				ntext;
+	char			text[MORSE_SKIM_TEXT];
+	struct morse_decoder decoder;
+};
+
+struct	morse_skimmer	{
+	int				sample_rate;
+	int				fft_size;
+	int				hop;
+	int				first_bin;
+	int				nchannels;
+	int				fill;
+	float			*input;
+	float			*window;
+	float			*re;
+	float			*im;
+	float			*cosine;
+	float			*sine;
+	int				*bitrev;
+	float			*mag;
+	float			*env;
+	float			*level;
+	float			*sorted;
+	float			*skirt;
+	float			decay;
+	const struct morse_simd *simd;
+	struct morse_skim_channel *channel;
+};
+
+/*
+ * A multi-station mixer (see mixer.c). The gain and the limit (the peak
+ * level of the output, on a 16-bit scale) can be changed at any time.
+ */
+struct	morse_voice	{
+	struct morse	*mp;
+	unsigned long long start;
+	unsigned long long end;
+	struct morse_key *keys;
+	int				nkeys;
+	int				next;
+};
+
+struct	morse_mixer	{
+	double			gain;
+	double			limit;
+	/*
+	 * Do not modify any of the following parameters.
+	 */
+	int				sample_rate;
+	int				nvoices;
+	int				size;
+	unsigned long long clock;
+	unsigned long long end;
+	float			level;
+	const struct morse_simd *simd;
+	struct morse_voice *voice;
+};
+
+/*
+ * Channel impairments (see impair.c), to make a signal sound as if it
+ * came off the air. Any of these can be changed at any time, and take
+ * effect from the next block of audio.
+ *    seed:          Where the random numbers start (see
+ *                   morse_impair_reset())
+ *    noise:         Set to non-zero to add noise
+ *    snr:           Signal to noise ratio in dB, in the bandwidth (10)
+ *    bandwidth:     Receiver filter bandwidth in Hz, centred on the
+ *                   tone (500)
+ *    fade:          MORSE_FADE_NONE, MORSE_FADE_SINE for a steady swing
+ *                   in the signal strength, or MORSE_FADE_RAYLEIGH for
+ *                   random fading
+ *    fade_rate:     How fast the fading goes, in Hz (0.2)
+ *    fade_depth:    How deep a sinusoidal fade goes, in dB (20)
+ *    qrn:           Static crashes per second, or zero for none
+ *    qrn_level:     Strength of a typical crash, in dB relative to the
+ *                   signal (10)
+ *    chirp:         How far off the tone is at key-down, in Hz, or zero
+ *                   for none
+ *    chirp_time:    How long the chirp takes to settle, in ms (10)
+ *    wander:        How far the tone drifts, in Hz, or zero for none
+ *    wander_period: How long a drift back and forth takes, in seconds (30)
+ */
+#define MORSE_FADE_NONE		0
+#define MORSE_FADE_SINE		1
+#define MORSE_FADE_RAYLEIGH	2
+
+#define MORSE_IMPAIR_POOL	256
+
+struct	morse_impair	{
+	unsigned int	seed;
+	int				noise;
+	double			snr;
+	double			bandwidth;
+	int				fade;
+	double			fade_rate;
+	double			fade_depth;
+	double			qrn;
+	double			qrn_level;
+	double			chirp;
+	double			chirp_time;
+	double			wander;
+	double			wander_period;
+	/*
+	 * Do not modify any of the following parameters.
+	 */
+	int				sample_rate;
+	double			frequency;
+	double			level;
+	double			filter_bw;
+	double			filter_gain;
+	double			coeff[3];
+	double			z[4];
+	double			sigma;
+	double			crash;
+	double			crash_env;
+	double			crash_decay;
+	double			crash_wait;
+	double			fade_i;
+	double			fade_q;
+	double			fade_from;
+	double			fade_to;
+	unsigned long long clock;
+	unsigned long long key_start;
+	unsigned long long key_next;
+	unsigned int	ctl[4];
+	unsigned int	state[4 * MORSE_NOISE_LANES];
+	int				pool_left;
+	float			pool[MORSE_IMPAIR_POOL];
+	const struct morse_simd *simd;
+};
+
+/*
+ * A word list for exercises (see words.c). A character set is a mask
+ * with a bit for each character which can be sent (see morse_charset()).
+ * The index has a group for each combination of word length and
+ * character set, and a selection is the words which pass a filter.
+ * MORSE_KOCH_ORDER is the order in which the Koch method teaches the
+ * characters.
+ */
+#define MORSE_KOCH_ORDER	"KMURESNAPTLWI.JZ=FOY,VG5/Q92H38B?47C1D60X"
+
+#define MORSE_CHARSET_ALL	(~0ULL)
+
+struct	morse_word	{
+	unsigned int	offset;
+	unsigned int	len;
+};
+
+struct	morse_wordgroup	{
+	unsigned long long mask;
+	unsigned int	len;
+	unsigned int	start;
+	unsigned int	count;
+	unsigned int	pad;
+};
+
+struct	morse_words	{
+	int				nwords;
+	int				ngroups;
+	int				cached;
+	const char		*text;
+	unsigned long	size;
+	const struct morse_wordgroup *group;
+	const struct morse_word *word;
+	void			*map;
+	unsigned long	map_size;
+};
+
+struct	morse_wordsel	{
+	struct morse_words *wp;
+	int				nwords;
+	struct morse_word *word;
+};
+
+/*
+ * An iambic keyer for live sending (see keyer.c). In mode A, the keyer
+ * stops as soon as the paddles are released. In mode B, it remembers a
+ * paddle pressed during an element and sends that element next, even if
+ * it has been released since. The latencies, from a paddle being pressed
+ * (or a key being typed) to the tone starting to come out, are in ms.
+ */
+#define MORSE_KEYER_A		0
+#define MORSE_KEYER_B		1
+
+#define MORSE_KEYER_QUEUE	256
+
+struct morse_keyer;
+
+struct	morse_keyer_stats	{
+	unsigned long	count;
+	unsigned long	late;
+	double			min;
+	double			max;
+	double			total;
+	double			bound;
+};
+
+/*
+ * Statistics for the cache of rendered words (see cache.c). The hits and
+ * misses are counted in words.
+ */
+struct	morse_cache_stats	{
+	unsigned long	hits;
+	unsigned long	misses;
+	unsigned long	evictions;
+	unsigned long	entries;
+	unsigned long	bytes;
+	unsigned long	max_bytes;
+};
+
+/*
+ * The render service protocol (see morse_server.c and client.c). Each
+ * request is followed by "len" bytes of text, and each reply to a render
+ * request by "nsamples" 16-bit samples. A stats request gets a struct
+ * morse_cache_stats back instead.
+ */
+#define MORSE_SOCKET		"/tmp/morse.sock"
+#define MORSE_MAX_TEXT		65536
+
+#define MORSE_REQ_RENDER	1
+#define MORSE_REQ_STATS		2
+
+struct	morse_request	{
+	int				op;
+	int				wpm;
+	int				farnsworth;
+	int				amplitude;
+	int				sample_rate;
+	double			tone_frequency;
+	double			ramp_time;
+	int				len;
+};
+
+struct	morse_reply	{
+	int				status;
+	int				nsamples;
+};
+
+struct	morse_client	{
+	int				fd;
 };
 
 /*
  * Prototypes...
  */
 struct morse	*morse_init(int);
-void			morse_send_char(struct morse *, int);
-void			morse_send_word(struct morse *, char *);
-void			morse_send_string(struct morse *, char *);
+void			morse_free(struct morse *);
+int				morse_send_char(struct morse *, int);
+int				_morse_send_char(struct morse *, int);
+int				morse_send_word(struct morse *, const char *);
+int				morse_send_string(struct morse *, const char *);
+int				morse_send_text(struct morse *, const char *, int);
 double			morse_timestamp(struct morse *);
+int				morse_position(struct morse *, unsigned long long *, struct timespec *);
+void			morse_stats(struct morse *, struct morse_stats *);
+void			morse_stats_reset(struct morse *);
+int				morse_render_string(struct morse *, const char *, short *, int);
+int				morse_render_alloc(struct morse *, const char *, short **);
+int				morse_render_keys(struct morse *, const char *, struct morse_key **);
+int				morse_render_parallel(struct morse *, const char *, int, short **, int);
+unsigned long long morse_duration(struct morse *, const char *);
+int				morse_wav_write(const char *, const short *, int, int);
+void			morse_le16(short *, int);
+struct morse_decoder *morse_decode_init(int, double);
+void			morse_decode_reset(struct morse_decoder *);
+void			morse_decode_speed(struct morse_decoder *, int);
+int				morse_decode(struct morse_decoder *, const short *, int, char *, int);
+int				morse_decode_flush(struct morse_decoder *, char *, int);
+double			morse_decode_wpm(struct morse_decoder *);
+void			morse_decode_free(struct morse_decoder *);
+void			_morse_decode_setup(struct morse_decoder *, int, int);
+int				_morse_decode_level(struct morse_decoder *, double, char *, int);
+struct morse_skimmer *morse_skim_init(int, double, double);
+int				morse_skim(struct morse_skimmer *, const short *, int);
+int				morse_skim_read(struct morse_skimmer *, int, char *, int);
+void			morse_skim_free(struct morse_skimmer *);
+const struct morse_simd *morse_simd_select();
 void			morse_calc_params(struct morse *);
+int				morse_setup(struct morse *);
+void			morse_audio_setup(struct morse *);
+void			morse_audio_element(struct morse *, int);
 void			morse_audio_tone(struct morse *, int);
 void			morse_audio_silence(struct morse *);
+void			morse_audio_write(struct morse *, const MORSE_SAMPLE *, int);
+void			morse_audio_zero(struct morse *, int);
+int				_morse_audio_buffer(struct morse *);
+int				_morse_audio_push(struct morse *);
+int				_morse_audio_frame(struct morse *);
+void			_morse_audio_mark(struct morse *);
+void			_morse_audio_discard(struct morse *);
+void			_morse_render_out(struct morse *, const MORSE_SAMPLE *, int);
+void			_morse_render_key(struct morse *, int);
+int				_morse_audio_gap(MORSE_EXACT *, int, MORSE_EXACT);
+const MORSE_SAMPLE *_morse_audio_envelope(struct morse *, MORSE_SAMPLE *, int, int, int);
+void			_morse_audio_carrier(struct morse *, MORSE_SAMPLE *, const MORSE_SAMPLE *, unsigned long long, int);
+/*
+ * The cache of rendered words, and the client side of the render service.
+ */
+struct morse_cache *morse_cache_init(unsigned long);
+int				morse_cache_render(struct morse_cache *, struct morse *, const char *, short **);
+void			morse_cache_stats(struct morse_cache *, struct morse_cache_stats *);
+void			morse_cache_free(struct morse_cache *);
+struct morse_client *morse_client_open(const char *);
+int				morse_client_render(struct morse_client *, struct morse *, const char *, short **);
+int				morse_client_stats(struct morse_client *, struct morse_cache_stats *);
+void			morse_client_close(struct morse_client *);
+int				_morse_read_all(int, void *, int);
+int				_morse_write_all(int, const void *, int);
+/*
+ * The mixer.
+ */
+struct morse_mixer *morse_mix_init(int);
+int				morse_mix_add(struct morse_mixer *, struct morse *, const char *, double);
+int				morse_mix_render(struct morse_mixer *, float *, int);
+int				morse_mix_play(struct morse_mixer *, struct morse *);
+void			morse_mix_free(struct morse_mixer *);
+/*
+ * The keyer.
+ */
+struct morse_keyer *morse_keyer_init(struct morse *, int);
+void			morse_keyer_paddle(struct morse_keyer *, int, int, double);
+int				morse_keyer_send(struct morse_keyer *, const char *, int, double);
+int				morse_keyer_busy(struct morse_keyer *);
+int				morse_keyer_run(struct morse_keyer *, int);
+void			morse_keyer_stats(struct morse_keyer *, struct morse_keyer_stats *);
+void			morse_keyer_free(struct morse_keyer *);
+double			morse_keyer_now();
+/*
+ * Channel impairments.
+ */
+struct morse_impair *morse_impair_init(unsigned int);
+void			morse_impair_reset(struct morse_impair *);
+void			morse_impair_free(struct morse_impair *);
+void			_morse_impair_apply(struct morse *, float *, int);
+void			_morse_impair_carrier(struct morse *, float *, const float *, unsigned long long, int);
+/*
+ * The word list.
+ */
+struct morse_words *morse_words_open(const char *, const char *);
+void			morse_words_close(struct morse_words *);
+struct morse_wordsel *morse_words_select(struct morse_words *, int, int, unsigned long long);
+const char		*morse_words_get(struct morse_wordsel *, int, int *);
+const char		*morse_words_random(struct morse_wordsel *, int *);
+void			morse_words_free(struct morse_wordsel *);
+unsigned long long morse_charset(const char *);
+unsigned long long morse_koch_charset(int);
+/*
+ * Asynchronous output (see async.c).
+ */
+int				morse_async_start(struct morse *, int);
+void			morse_async_stop(struct morse *);
+int				morse_async_pending(struct morse *);
+int				morse_async_busy(struct morse *);
+void			morse_async_abort(struct morse *);
+void			morse_async_wait(struct morse *);
+void			_morse_async_put(struct morse *, int, int);
+int				_morse_async_aborted(struct morse *);
+/*
+ * Audio backend selection and control.
+ */
+const struct morse_backend *morse_backend_lookup(const char *);
+int				morse_open(struct morse *, const char *, const char *);
+int				morse_drain(struct morse *);
+int				_morse_drain(struct morse *);
+void			morse_close(struct morse *);
 /*
- * Platform-specific soundcard functions.
+ * The built-in backends.
  */
-void			sound_open(struct morse *);
-void			sound_commence(struct morse *);
-void			sound_out(struct morse *, int);
-void			sound_drain(struct morse *);
-void			sound_close(struct morse *);
+#ifdef ALSA
+extern const struct morse_backend morse_alsa_backend;
+#endif
+extern const struct morse_backend morse_wav_backend;
+extern const struct morse_backend morse_raw_backend;
+extern const struct morse_backend morse_null_backend;
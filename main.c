@@ -34,23 +34,52 @@
  * ABSTRACT
  * This is a simple test program for the morse library. It takes as
  * arguments an option Words/Minute value (in the range between 5 and
- * 60 WPM) as well as some text to be translated into morse code.
+ * 60 WPM) as well as some text to be translated into morse code. With
+ * no text, or with the -i option, it reads the text from a file (or the
+ * standard input) instead, and plays it as it goes.
  *
  * The command-line options are as follows:
  *   -a NN      Set the output volume (0 -> 100)
+ *   -c HZ      Chirp by this much at key-down
+ *   -d HZ      Drift up and down by this much
  *   -f WPM     Invoke "Farnsworth" mode - see the params.c file for info
+ *   -i FILE    Read the text from a file ("-" for the standard input)
+ *   -j NN      Render the whole text with this many threads (zero for one
+ *              per processor) and write it to the -o file in one go (with
+ *              no impairments)
+ *   -N SNR     Add noise, for this signal to noise ratio (in dB)
+ *   -n         No audio output (useful for timing)
+ *   -o FILE    Write to a file (.wav or raw PCM) rather than the soundcard
+ *   -Q RATE    Fade up and down (QSB) this many times a second
+ *   -q RATE    Fade at random (Rayleigh fading), at about this rate
+ *   -R RATE    Ask for this sample rate (the soundcard may pick the
+ *              nearest one it can do)
+ *   -S SEED    Seed for the noise, fading and static
  *   -s WPM     Set the WPM (a number between 5 and 60)
+ *   -t         Print the keying timeline (in milliseconds) rather than
+ *              sending anything
+ *   -v         Print the audio output statistics at the end
+ *   -X NN      Add this many static crashes (QRN) per second
  *
  * Try:
  *   ./morse_play -f 5 CQ CQ CQ DE EI4HRB
+ *   fortune | ./morse_play -s 25
+ *   ./morse_play -N 0 -q 0.3 -X 2 -c 30 -S 42 CQ CQ DE EI4HRB
  */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "libmorse.h"
 
+int		read_line(FILE *, char **, size_t *);
+char	*read_text(FILE *, char **, int, int, int *);
+void	show_keys(struct morse *, const char *);
+void	show_stats(FILE *, struct morse *);
+void	render_text(struct morse *, FILE *, char **, int, int, int, char *, char *);
+struct morse_impair *impairment(struct morse_impair *);
 void	usage();
 
 /*
@@ -59,15 +88,21 @@ void	usage();
 int
 main(int argc, char *argv[])
 {
-	int i, len, wpm, ampl, fw, repeat;
-	char *str;
+	int i, len, wpm, ampl, fw, repeat, timeline, rate, verbose, jobs;
+	size_t size;
+	char *line, *text, *backend, *outfile, *infile;
+	FILE *fp, *in;
 	struct morse *mp;
+	struct morse_impair *ip;
 
 	wpm = 18;
-	opterr = fw = 0;
+	opterr = fw = timeline = verbose = 0;
 	repeat = 1;
-	ampl = -1;
-	while ((i = getopt(argc, argv, "a:f:s:r:")) != EOF) {
+	ampl = rate = jobs = -1;
+	backend = outfile = infile = NULL;
+	in = NULL;
+	ip = NULL;
+	while ((i = getopt(argc, argv, "a:c:d:f:i:j:N:no:Q:q:R:S:s:r:tvX:")) != EOF) {
 		switch (i) {
 		case 'a':
 			if ((ampl = atoi(optarg)) < 0 || ampl > 100) {
@@ -76,6 +111,16 @@ main(int argc, char *argv[])
 			}
 			break;
 
+		case 'c':
+			ip = impairment(ip);
+			ip->chirp = atof(optarg);
+			break;
+
+		case 'd':
+			ip = impairment(ip);
+			ip->wander = atof(optarg);
+			break;
+
 		case 'f':
 			fw = 1;
 			if ((wpm = atoi(optarg)) < 5 || wpm > 60) {
@@ -84,6 +129,60 @@ main(int argc, char *argv[])
 			}
 			break;
 
+		case 'i':
+			infile = optarg;
+			break;
+
+		case 'j':
+			if ((jobs = atoi(optarg)) < 0) {
+				fprintf(stderr, "Number of threads can't be negative.\n");
+				usage();
+			}
+			break;
+
+		case 'N':
+			ip = impairment(ip);
+			ip->noise = 1;
+			ip->snr = atof(optarg);
+			break;
+
+		case 'n':
+			backend = "null";
+			outfile = NULL;
+			break;
+
+		case 'o':
+			outfile = optarg;
+			len = strlen(outfile);
+			if (len > 4 && strcmp(outfile + len - 4, ".wav") == 0)
+				backend = "wav";
+			else
+				backend = "raw";
+			break;
+
+		case 'Q':
+		case 'q':
+			ip = impairment(ip);
+			ip->fade = (i == 'Q') ? MORSE_FADE_SINE : MORSE_FADE_RAYLEIGH;
+			if ((ip->fade_rate = atof(optarg)) <= 0.0 || ip->fade_rate > 10.0) {
+				fprintf(stderr, "Fading rate should be between 0 and 10Hz.\n");
+				usage();
+			}
+			break;
+
+		case 'R':
+			if ((rate = atoi(optarg)) < 8000 || rate > 192000) {
+				fprintf(stderr, "Sample rate should be between 8000 and 192000.\n");
+				usage();
+			}
+			break;
+
+		case 'S':
+			ip = impairment(ip);
+			ip->seed = (unsigned int )strtoul(optarg, NULL, 0);
+			morse_impair_reset(ip);
+			break;
+
 		case 's':
 			fw = 0;
 			if ((wpm = atoi(optarg)) < 5 || wpm > 60) {
@@ -99,51 +198,324 @@ main(int argc, char *argv[])
 			}
 			break;
 
+		case 't':
+			timeline = 1;
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case 'X':
+			ip = impairment(ip);
+			if ((ip->qrn = atof(optarg)) < 0.0) {
+				fprintf(stderr, "Static crashes should be a positive number per second.\n");
+				usage();
+			}
+			break;
+
 		default:
 			usage();
 			break;
 		}
 	}
-	if ((argc - optind) < 1)
+	if (infile != NULL && optind < argc)
+		usage();
+	if (infile == NULL && optind == argc)
+		infile = "-";
+	if (infile != NULL && repeat > 1) {
+		fprintf(stderr, "Repeating (-r) needs the text on the command line.\n");
 		usage();
+	}
+	if (infile != NULL) {
+		if (strcmp(infile, "-") == 0)
+			in = stdin;
+		else if ((in = fopen(infile, "r")) == NULL) {
+			perror(infile);
+			exit(1);
+		}
+	}
 	if ((mp = morse_init(wpm)) == NULL) {
 		fprintf(stderr, "?Error - morse_init failed.\n");
 		exit(1);
 	}
 	if (ampl >= 0)
 		mp->amplitude = ampl;
+	if (rate > 0)
+		mp->sample_rate = rate;
 	if (fw)
 		mp->farnsworth = 1;
-	for (i = len = optind; i < argc; i++)
-		len += strlen(argv[i]) + 1;
-	if ((str = (char *)malloc(len)) == NULL) {
-		perror("morse_play: malloc");
+	mp->impair = ip;
+	if (jobs >= 0) {
+		if (outfile == NULL || strcmp(backend, "null") == 0) {
+			fprintf(stderr, "Rendering with -j needs an output file (-o).\n");
+			usage();
+		}
+		if (ip != NULL) {
+			fprintf(stderr, "Rendered audio is always clean, so -j can't have impairments.\n");
+			usage();
+		}
+		render_text(mp, in, argv + optind, argc - optind, repeat, jobs, backend, outfile);
+		exit(0);
+	}
+	if (backend != NULL && morse_open(mp, backend, outfile) < 0)
 		exit(1);
+	line = NULL;
+	size = 0;
+	if (timeline) {
+		text = read_text(in, argv + optind, argc - optind, repeat, &len);
+		show_keys(mp, text);
+		free(text);
+		exit(0);
+	}
+	if (in != NULL) {
+		/*
+		 * The audio thread sends the text while we read ahead, a line
+		 * at a time, so there's never more than a line of it in
+		 * memory, and typed input is heard straight away.
+		 */
+		if (morse_async_start(mp, 0) < 0) {
+			fprintf(stderr, "?Error - morse_async_start failed.\n");
+			exit(1);
+		}
+		while ((len = read_line(in, &line, &size)) >= 0)
+			morse_send_text(mp, line, len);
+		free(line);
+	} else {
+		for (i = 0; i < repeat; i++) {
+			for (len = optind; len < argc; len++)
+				morse_send_string(mp, argv[len]);
+			morse_audio_silence(mp);
+		}
 	}
-	strcpy(str, argv[optind++]);
-	for (; optind < argc; optind++) {
-		strcat(str, " ");
-		strcat(str, argv[optind]);
+	if (morse_drain(mp) < 0) {
+		fprintf(stderr, "?Error - audio output failed.\n");
+		exit(1);
 	}
-	for (i = 0; i < repeat; i++) {
-		morse_send_string(mp, str);
-		morse_audio_silence(mp);
+	/*
+	 * Don't mix the report in with the audio if that's going to stdout.
+	 */
+	fp = (outfile != NULL && strcmp(outfile, "-") == 0) ? stderr : stdout;
+	fprintf(fp, "Total time: %.2f seconds.\n", morse_timestamp(mp));
+	if (verbose) {
+		if (ip != NULL)
+			fprintf(fp, "Seed: %u\n", ip->seed);
+		show_stats(fp, mp);
 	}
-	sound_drain(mp);
-	printf("Total time: %.2f seconds.\n", morse_timestamp(mp));
-	sound_close(mp);
+	morse_free(mp);
+	if (ip != NULL)
+		morse_impair_free(ip);
 	exit(0);
 }
 
+/*
+ * Get the channel impairments ready, the first time one is asked for.
+ * Unless a seed is given, it's different every time.
+ */
+struct morse_impair *
+impairment(struct morse_impair *ip)
+{
+	if (ip != NULL)
+		return(ip);
+	if ((ip = morse_impair_init((unsigned int )time(NULL))) == NULL) {
+		fprintf(stderr, "?Error - morse_impair_init failed.\n");
+		exit(1);
+	}
+	return(ip);
+}
+
+/*
+ * Read a line of the text. The end of a line just separates words (a
+ * newline character would otherwise be sent as the prosign AA), so it's
+ * trimmed off. Returns the length, or -1 at the end of the file.
+ */
+int
+read_line(FILE *fp, char **linep, size_t *sizep)
+{
+	int len;
+
+	if ((len = getline(linep, sizep, fp)) < 0)
+		return(-1);
+	while (len > 0 && ((*linep)[len - 1] == '\n' || (*linep)[len - 1] == '\r'))
+		len--;
+	(*linep)[len] = '\0';
+	return(len);
+}
+
+/*
+ * Read the whole text from the file, or else put together the words on
+ * the command line. The lines of a file are joined up with spaces, just
+ * as they'd be sent one at a time. The text is NUL-terminated, and the
+ * length is returned in "lenp".
+ */
+char *
+read_text(FILE *in, char **words, int nwords, int repeat, int *lenp)
+{
+	int k, n, len, size;
+	char *text, *cp;
+
+	len = size = 0;
+	text = NULL;
+	if (in == NULL) {
+		for (k = 0; k < nwords; k++)
+			size += strlen(words[k]) + 1;
+		size = size * repeat + 1;
+		if ((text = (char *)malloc(size)) == NULL) {
+			perror("morse_play: malloc");
+			exit(1);
+		}
+		text[0] = '\0';
+		while (repeat-- > 0)
+			for (k = 0; k < nwords; k++)
+				len += sprintf(text + len, "%s ", words[k]);
+	} else {
+		for (;;) {
+			if (len + BUFSIZ + 1 > size) {
+				size = size > 0 ? size * 2 : BUFSIZ * 4;
+				if ((cp = (char *)realloc(text, size)) == NULL) {
+					perror("morse_play: realloc");
+					exit(1);
+				}
+				text = cp;
+			}
+			if ((n = fread(text + len, 1, BUFSIZ, in)) <= 0)
+				break;
+			len += n;
+		}
+		text[len] = '\0';
+	}
+	for (cp = text; cp < text + len; cp++)
+		if (*cp == '\n' || *cp == '\r')
+			*cp = ' ';
+	*lenp = len;
+	return(text);
+}
+
+/*
+ * Print the keying for the text, in milliseconds from the start, and
+ * how long it all takes. The timing is kept exact, so it's just what
+ * would have been sent.
+ */
+void
+show_keys(struct morse *mp, const char *strp)
+{
+	int i, n;
+	struct morse_key *keys;
+
+	mp->exact_render = 1;
+	morse_calc_params(mp);
+	if ((n = morse_render_keys(mp, strp, &keys)) < 0) {
+		fprintf(stderr, "?Error - morse_render_keys failed.\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		printf("%10.2f %7.2f\n", keys[i].start * 1000.0 / mp->sample_rate,
+						keys[i].len * 1000.0 / mp->sample_rate);
+	free(keys);
+	printf("Total time: %.2f seconds.\n",
+				(double )morse_duration(mp, strp) / (double )mp->sample_rate);
+}
+
+/*
+ * Render the whole text at once, in parallel, and write it to the output
+ * file.
+ */
+void
+render_text(struct morse *mp, FILE *in, char **words, int nwords, int repeat,
+							int jobs, char *backend, char *outfile)
+{
+	int i, n, len;
+	char *text;
+	short *buf;
+	FILE *fp;
+
+	text = read_text(in, words, nwords, repeat, &len);
+	/*
+	 * Keep the timing exact, so the render is just what would have
+	 * been sent.
+	 */
+	mp->exact_render = 1;
+	morse_calc_params(mp);
+	if ((n = morse_render_parallel(mp, text, len, &buf, jobs)) < 0) {
+		fprintf(stderr, "?Error - morse_render_parallel failed.\n");
+		exit(1);
+	}
+	if (strcmp(backend, "wav") == 0)
+		i = morse_wav_write(outfile, buf, n, mp->sample_rate);
+	else if (strcmp(outfile, "-") == 0)
+		i = fwrite(buf, sizeof(short), n, stdout) == n ? 0 : -1;
+	else if ((fp = fopen(outfile, "w")) == NULL) {
+		perror(outfile);
+		i = -1;
+	} else {
+		i = fwrite(buf, sizeof(short), n, fp) == n ? 0 : -1;
+		if (fclose(fp) != 0)
+			i = -1;
+	}
+	if (i < 0) {
+		fprintf(stderr, "?Error - can't write %s.\n", outfile);
+		exit(1);
+	}
+	fp = strcmp(outfile, "-") == 0 ? stderr : stdout;
+	fprintf(fp, "Total time: %.2f seconds.\n", (double )n / (double )mp->sample_rate);
+	free(buf);
+	free(text);
+}
+
+/*
+ * Print the audio output statistics, with a histogram of how long each
+ * block took to write.
+ */
+void
+show_stats(FILE *fp, struct morse *mp)
+{
+	int i;
+	struct morse_stats st;
+
+	morse_stats(mp, &st);
+	fprintf(fp, "Samples: %llu in %lu blocks, %lu xruns, %lu short writes, %d frames queued.\n",
+					st.samples, st.blocks, st.xruns, st.short_writes, st.delay);
+	if (st.blocks == 0)
+		return;
+	fprintf(fp, "Render: %.3fms per block (%.3fms max).\n",
+					st.render_time / st.blocks, st.render_max);
+	fprintf(fp, "Write: %.3fms per block (%.3fms max).\n",
+					st.write_time / st.blocks, st.write_max);
+	for (i = 0; i < MORSE_STATS_BUCKETS; i++) {
+		if (st.write_hist[i] == 0)
+			continue;
+		if (i == MORSE_STATS_BUCKETS - 1)
+			fprintf(fp, "      >= %7luus: %lu\n", 1UL << (i - 1), st.write_hist[i]);
+		else
+			fprintf(fp, "       < %7luus: %lu\n", 1UL << i, st.write_hist[i]);
+	}
+}
+
 /*
  * Print a brief usage message and quit.
  */
 void
 usage()
 {
-	fprintf(stderr, "Usage: morse_play [-a AMPL][-f WPM][-s WPM] <word> [<word> ...]\n");
+	fprintf(stderr, "Usage: morse_play [-a AMPL][-f WPM][-s WPM][-n][-o FILE][-j NN][-R RATE][-r NN][-t][-v]\n");
+	fprintf(stderr, "\t\t[-N SNR][-Q RATE|-q RATE][-X NN][-c HZ][-d HZ][-S SEED][-i FILE | <word> [<word> ...]]\n");
 	fprintf(stderr, "\t-s WPM\tSet the rate in words per minute.\n");
 	fprintf(stderr, "\t-f WPM\tInvoke 'Farnsworth' mode for easier learning.\n");
 	fprintf(stderr, "\t-a AMPL\tAmplification - a number between 0 and 100.\n");
+	fprintf(stderr, "\t-i FILE\tRead the text from a file. Use '-' for stdin.\n");
+	fprintf(stderr, "\t-j NN\tRender the whole text with NN threads, to the -o file.\n");
+	fprintf(stderr, "\t-n\tNo audio output.\n");
+	fprintf(stderr, "\t-o FILE\tWrite a .wav (or raw PCM) file. Use '-' for stdout.\n");
+	fprintf(stderr, "\t-R RATE\tAsk for this sample rate.\n");
+	fprintf(stderr, "\t-r NN\tSend the words NN times (not with -i).\n");
+	fprintf(stderr, "\t-t\tPrint the keying timeline instead.\n");
+	fprintf(stderr, "\t-v\tPrint the audio output statistics.\n");
+	fprintf(stderr, "\t-N SNR\tAdd noise, for this signal to noise ratio in dB.\n");
+	fprintf(stderr, "\t-Q RATE\tFade up and down this many times a second.\n");
+	fprintf(stderr, "\t-q RATE\tFade at random, at about this rate.\n");
+	fprintf(stderr, "\t-X NN\tAdd this many static crashes per second.\n");
+	fprintf(stderr, "\t-c HZ\tChirp by this much at key-down.\n");
+	fprintf(stderr, "\t-d HZ\tDrift up and down by this much.\n");
+	fprintf(stderr, "\t-S SEED\tSeed for the noise, fading and static.\n");
 	exit(2);
 }
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * A mixer for running lots of Morse signals at once, each with its own
+ * text, speed, pitch, amplitude and start time, such as a contest
+ * pileup. Each signal (a "voice") has its own morse instance for the
+ * parameters.
+ *
+ * When a voice is added, its text is turned into a list of key-down
+ * periods, which is cheap. The audio is only generated as the output is
+ * asked for, a chunk at a time: for each voice, any key-down periods
+ * which overlap the chunk are synthesized and added in. Silence costs
+ * nothing, so a voice only costs anything while its key is down.
+ *
+ * The sum is scaled by the master gain and then run through a simple
+ * peak limiter, which turns the level down (smoothly) whenever the mix
+ * would go over the limit, and lets it back up slowly afterwards.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libmorse.h"
+
+/*
+ * How quickly the limiter lets the level back up, per chunk.
+ */
+#define RELEASE		0.02f
+
+/*
+ * Create a mixer for the given sample rate. Every voice has to use the
+ * same rate.
+ */
+struct morse_mixer *
+morse_mix_init(int sample_rate)
+{
+	struct morse_mixer *xp;
+
+	if ((xp = (struct morse_mixer *)malloc(sizeof(struct morse_mixer))) == NULL)
+		return(NULL);
+	xp->sample_rate = sample_rate;
+	xp->gain = 1.0;
+	xp->limit = 32000.0;
+	xp->nvoices = xp->size = 0;
+	xp->clock = xp->end = 0;
+	xp->level = 1.0f;
+	xp->simd = morse_simd_select();
+	xp->voice = NULL;
+	return(xp);
+}
+
+/*
+ * Release the mixer. The morse instances belong to the caller, so they
+ * are left alone.
+ */
+void
+morse_mix_free(struct morse_mixer *xp)
+{
+	int i;
+
+	for (i = 0; i < xp->nvoices; i++)
+		free(xp->voice[i].keys);
+	free(xp->voice);
+	free(xp);
+}
+
+/*
+ * Add a voice, which sends "text" using the parameters in "mp", starting
+ * "start" seconds after the beginning. The morse instance can be shared
+ * between voices, but it must stay around (and unchanged) until the
+ * mixer is finished with. Returns the voice number, or -1 on failure.
+ */
+int
+morse_mix_add(struct morse_mixer *xp, struct morse *mp, const char *text, double start)
+{
+	int n, size;
+	struct morse_key *keys;
+	struct morse_voice *vp;
+
+	if (mp->sample_rate != xp->sample_rate || start < 0.0)
+		return(-1);
+	if (xp->nvoices >= xp->size) {
+		size = xp->size > 0 ? xp->size * 2 : 16;
+		if ((vp = (struct morse_voice *)realloc(xp->voice, size * sizeof(struct morse_voice))) == NULL)
+			return(-1);
+		xp->voice = vp;
+		xp->size = size;
+	}
+	if ((n = morse_render_keys(mp, text, &keys)) < 0)
+		return(-1);
+	vp = &xp->voice[xp->nvoices];
+	vp->mp = mp;
+	vp->keys = keys;
+	vp->nkeys = n;
+	vp->next = 0;
+	vp->start = (unsigned long long )(start * (double )xp->sample_rate + 0.5);
+	vp->end = vp->start;
+	if (n > 0)
+		vp->end += keys[n - 1].start + keys[n - 1].len;
+	if (vp->end > xp->end)
+		xp->end = vp->end;
+	return(xp->nvoices++);
+}
+
+/*
+ * Add one voice's contribution to a chunk of the output. Each piece of
+ * key-down time in the chunk is synthesized in one go.
+ */
+static void
+_mix_voice(struct morse_mixer *xp, struct morse_voice *vp, float *out, int n)
+{
+	int k;
+	unsigned long long t0, t1, ks, ke, a, b;
+	float env[AUDIO_CHUNK], tone[AUDIO_CHUNK];
+	const float *ep;
+	struct morse_key *kp;
+
+	t0 = xp->clock;
+	t1 = t0 + n;
+	if (t1 <= vp->start || t0 >= vp->end)
+		return;
+	while (vp->next < vp->nkeys &&
+			vp->start + vp->keys[vp->next].start + vp->keys[vp->next].len <= t0)
+		vp->next++;
+	for (k = vp->next; k < vp->nkeys; k++) {
+		kp = &vp->keys[k];
+		if ((ks = vp->start + kp->start) >= t1)
+			break;
+		ke = ks + kp->len;
+		a = ks > t0 ? ks : t0;
+		b = ke < t1 ? ke : t1;
+		ep = _morse_audio_envelope(vp->mp, env, a - ks, kp->len, b - a);
+		_morse_audio_carrier(vp->mp, tone, ep, a, b - a);
+		xp->simd->mix(out + (a - t0), tone, b - a);
+	}
+}
+
+/*
+ * Apply the master gain and the limiter to a chunk. The gain is moved
+ * smoothly from where it was to where it needs to be over the chunk, so
+ * it doesn't click. Anything that still gets over is clipped when it's
+ * converted to 16-bit.
+ */
+static void
+_mix_limit(struct morse_mixer *xp, float *out, int n)
+{
+	int i;
+	float peak, g0, g1, v;
+
+	for (peak = 0.0f, i = 0; i < n; i++)
+		if ((v = fabsf(out[i])) > peak)
+			peak = v;
+	peak *= (float )xp->gain;
+	g0 = xp->level;
+	if ((g1 = g0 + (1.0f - g0) * RELEASE) * peak > (float )xp->limit)
+		g1 = (float )xp->limit / peak;
+	for (i = 0; i < n; i++)
+		out[i] *= (float )xp->gain * (g0 + (g1 - g0) * (float )(i + 1) / (float )n);
+	xp->level = g1;
+}
+
+/*
+ * Generate the next "len" samples of the mix. Returns the number of
+ * samples generated, which is less than asked for when the last voice
+ * finishes, and zero after that.
+ */
+int
+morse_mix_render(struct morse_mixer *xp, float *out, int len)
+{
+	int i, n, v;
+
+	if (xp->clock >= xp->end)
+		return(0);
+	if ((unsigned long long )len > xp->end - xp->clock)
+		len = xp->end - xp->clock;
+	for (i = 0; i < len; i += n) {
+		if ((n = AUDIO_CHUNK - xp->clock % AUDIO_CHUNK) > len - i)
+			n = len - i;
+		memset(out + i, 0, n * sizeof(float));
+		for (v = 0; v < xp->nvoices; v++)
+			_mix_voice(xp, &xp->voice[v], out + i, n);
+		_mix_limit(xp, out + i, n);
+		xp->clock += n;
+	}
+	return(len);
+}
+
+/*
+ * Play the whole mix out through the audio backend of "mp", which must
+ * use the same sample rate as the mixer. The backend can change the rate
+ * when it starts, so use morse_setup() to find out what it will be before
+ * creating the mixer. Returns -1 if the audio output fails.
+ */
+int
+morse_mix_play(struct morse_mixer *xp, struct morse *mp)
+{
+	int n;
+	float block[AUDIO_CHUNK];
+
+	if (morse_setup(mp) < 0)
+		return(-1);
+	if (mp->sample_rate != xp->sample_rate) {
+		fprintf(stderr, "libmorse: audio output is at %dHz, not %dHz.\n",
+						mp->sample_rate, xp->sample_rate);
+		return(-1);
+	}
+	while (!mp->error && (n = morse_mix_render(xp, block, AUDIO_CHUNK)) > 0)
+		morse_audio_write(mp, block, n);
+	return(mp->error ? -1 : 0);
+}
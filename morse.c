@@ -70,15 +70,15 @@ unsigned short	morse_table[128] = {
 /*78*/	0411,0415,0403,0000,0000,0000,0000,0000
 };
 
-void	_morse_commence(struct morse *);
+int		_morse_commence(struct morse *);
 
 /*
  * Transmit one character of text as Morse Code. Use the above table to
  * figure out how many elements or symbols and the remaining bits for the
- * actual data.
+ * actual data. Returns -1 if the audio output has failed.
  */
-void
-morse_send_char(struct morse *mp, int ch)
+int
+_morse_send_char(struct morse *mp, int ch)
 {
 	int nsyms, bitreg;
 
@@ -86,66 +86,132 @@ morse_send_char(struct morse *mp, int ch)
 	 * First time through? Then do some last-minute config, including
 	 * configuring the audio channel.
 	 */
-	if (!mp->setup_done)
-		_morse_commence(mp);
+	if (!mp->setup_done && _morse_commence(mp) < 0)
+		return(-1);
+	if (mp->error && !mp->render)
+		return(-1);
 	bitreg = morse_table[ch & 0x7f];
 	if ((nsyms = (bitreg >> 6) & 07) == 0)
 		nsyms = 8;
 	bitreg &= 077;
 	while (nsyms-- > 0) {
 		morse_audio_silence(mp);
-		if (bitreg & 01)
-			morse_audio_tone(mp, mp->bit_time * 3);
-		else
-			morse_audio_tone(mp, mp->bit_time);
+		morse_audio_element(mp, bitreg & 01);
 		bitreg >>= 1;
 		mp->sym_delay = mp->bit_time;
+		mp->sym_exact = mp->bit_exact;
 	}
-	if (!mp->prosign)
+	if (!mp->prosign) {
 		mp->sym_delay = mp->char_delay;
+		mp->sym_exact = mp->char_exact;
+	}
+	return(mp->error && !mp->render ? -1 : 0);
 }
 
 /*
- * Send a word by sending each character in turn and then waiting for the
- * word delay.
+ * The public version of the above. In asynchronous mode, the character is
+ * just queued for the audio thread, so only an earlier failure is
+ * reported.
  */
-void
-morse_send_word(struct morse *mp, char *strp)
+int
+morse_send_char(struct morse *mp, int ch)
 {
-	if (strp == NULL || *strp == '\0')
-		return;
-	if (*strp == '<') {
-		char *cp;
+#ifndef MORSE_FIXED
+	if (mp->async != NULL && !mp->render) {
+		_morse_async_put(mp, ch, 0);
+		return(mp->error ? -1 : 0);
+	}
+#endif
+	return(_morse_send_char(mp, ch));
+}
 
+/*
+ * Send the word which runs from "strp" up to (but not including) "endp",
+ * by sending each character in turn and then waiting for the word delay.
+ * A word in angle brackets is a prosign, and is sent without any gaps
+ * between the characters. In asynchronous mode, the audio thread does all
+ * of this. The text is never modified. Returns -1 if the audio output
+ * has failed.
+ */
+static int
+_send_word(struct morse *mp, const char *strp, const char *endp)
+{
+	const char *cp;
+
+	if (strp == endp)
+		return(0);
+#ifndef MORSE_FIXED
+	if (mp->async != NULL && !mp->render) {
+		while (strp < endp)
+			_morse_async_put(mp, *strp++, 1);
+		_morse_async_put(mp, ' ', 1);
+		return(mp->error ? -1 : 0);
+	}
+#endif
+	if (*strp == '<') {
 		strp++;
-		if ((cp = strchr(strp, '>')) != NULL)
-			*cp = '\0';
+		if ((cp = memchr(strp, '>', endp - strp)) != NULL)
+			endp = cp;
 		mp->prosign = 1;
 	} else
 		mp->prosign = 0;
-	while (*strp != '\0')
-		morse_send_char(mp, *strp++);
+	while (strp < endp)
+		if (_morse_send_char(mp, *strp++) < 0) {
+			mp->prosign = 0;
+			return(-1);
+		}
 	mp->prosign = 0;
 	mp->sym_delay = mp->word_delay;
+	mp->sym_exact = mp->word_exact;
+	return(0);
 }
 
 /*
- * Send a string of characters/words as Morse code. Really the work is
- * done in the previous two functions. This code just splits the string
- * into words.
+ * Send a single word.
  */
-void
-morse_send_string(struct morse *mp, char *strp)
+int
+morse_send_word(struct morse *mp, const char *strp)
 {
-	char *cp;
+	if (strp == NULL)
+		return(0);
+	return(_send_word(mp, strp, strp + strlen(strp)));
+}
 
-	while (strp != NULL && *strp != '\0') {
-		if ((cp = strpbrk(strp, " \t")) != NULL) {
-			*cp++ = '\0';
-			while (isspace(*cp))
-				cp++;
-		}
-		morse_send_word(mp, strp);
-		strp = cp;
+/*
+ * Send "len" bytes of text as Morse code. Really the work is done in the
+ * functions above. This code just splits the text into words, which are
+ * separated by spaces or tabs (and any other white space following
+ * those). The text doesn't need to be NUL-terminated, and is sent where
+ * it lies, so a large text doesn't need to be copied first. Returns -1
+ * (having stopped) if the audio output fails.
+ */
+int
+morse_send_text(struct morse *mp, const char *strp, int len)
+{
+	const char *cp, *endp, *wp;
+
+	if (strp == NULL)
+		return(0);
+	for (endp = strp + len; strp < endp; strp = cp) {
+		for (wp = strp; wp < endp && *wp != ' ' && *wp != '\t' && *wp != '\0'; wp++)
+			;
+		if (wp < endp && *wp == '\0')
+			endp = wp;
+		if (_send_word(mp, strp, wp) < 0)
+			return(-1);
+		for (cp = wp; cp < endp && (cp == wp || isspace(*cp)); cp++)
+			;
 	}
+	return(0);
+}
+
+/*
+ * Send a string of characters/words as Morse code.
+ */
+int
+morse_send_string(struct morse *mp, const char *strp)
+{
+	if (strp == NULL)
+		return(0);
+	return(morse_send_text(mp, strp, strlen(strp)));
 }
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Bulk practice clip generator. This takes a word list and a range of
+ * speeds and renders every word at every speed (optionally with and
+ * without Farnsworth spacing) as a separate clip, using all of the
+ * available processors.
+ *
+ * The jobs are split evenly between a set of worker threads, each of
+ * which has its own morse instance and output buffer. A worker which runs
+ * out of jobs steals half of the remaining jobs from one of the others,
+ * so the load stays balanced even though the clips vary in length.
+ *
+ * The command-line options are as follows:
+ *   -a NN      Set the output volume (0 -> 100)
+ *   -d DIR     Write each clip to DIR as a .wav file
+ *   -F         Render each clip both with and without Farnsworth spacing
+ *   -l LEN     Only use words of this length
+ *   -s MIN-MAX Set the range of speeds (default 5-60 WPM)
+ *   -t NN      Number of threads (default is one per processor)
+ *   -w FILE    The word list (default /usr/share/dict/words)
+ *
+ * Try:
+ *   ./morse_batch -l 5 -s 15-25 -F
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libmorse.h"
+
+struct	worker	{
+	pthread_t		tid;
+	pthread_mutex_t	lock;
+	int				id;
+	int				lo;
+	int				hi;
+	long			clips;
+	long			steals;
+	double			samples;
+	short			*buf;
+	int				size;
+	struct morse	*mp;
+};
+
+int				nwords, nworkers, min_wpm, max_wpm, nfw, ampl;
+char			**words, *outdir;
+struct worker	*workers;
+
+void	*worker(void *);
+int		steal(struct worker *);
+void	render(struct worker *, int);
+int		load_words(char *, int);
+double	now();
+void	usage();
+
+/*
+ * All life begins here...
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, len, njobs;
+	long clips;
+	char *wordfile, *cp;
+	double start, elapsed, samples;
+
+	opterr = 0;
+	len = 0;
+	nfw = 1;
+	ampl = -1;
+	min_wpm = 5;
+	max_wpm = 60;
+	outdir = NULL;
+	wordfile = "/usr/share/dict/words";
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((i = getopt(argc, argv, "a:d:Fl:s:t:w:")) != EOF) {
+		switch (i) {
+		case 'a':
+			if ((ampl = atoi(optarg)) < 0 || ampl > 100) {
+				fprintf(stderr, "Amplitude between 0 and 100.\n");
+				usage();
+			}
+			break;
+
+		case 'd':
+			outdir = optarg;
+			break;
+
+		case 'F':
+			nfw = 2;
+			break;
+
+		case 'l':
+			if ((len = atoi(optarg)) < 1) {
+				fprintf(stderr, "Word length should be at least one.\n");
+				usage();
+			}
+			break;
+
+		case 's':
+			min_wpm = max_wpm = atoi(optarg);
+			if ((cp = strchr(optarg, '-')) != NULL)
+				max_wpm = atoi(cp + 1);
+			if (min_wpm < 5 || max_wpm > 60 || min_wpm > max_wpm) {
+				fprintf(stderr, "WPM values should be between 5 and 60.\n");
+				usage();
+			}
+			break;
+
+		case 't':
+			if ((nworkers = atoi(optarg)) < 1) {
+				fprintf(stderr, "Need at least one thread.\n");
+				usage();
+			}
+			break;
+
+		case 'w':
+			wordfile = optarg;
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	}
+	if (optind != argc)
+		usage();
+	if (nworkers < 1)
+		nworkers = 1;
+	if (load_words(wordfile, len) < 0)
+		exit(1);
+	if (nwords == 0) {
+		fprintf(stderr, "morse_batch: no suitable words in %s.\n", wordfile);
+		exit(1);
+	}
+	/*
+	 * The jobs are numbered so that consecutive jobs share the same
+	 * speed, which means a worker only has to recompute the parameters
+	 * when it moves on to a new speed (or steals some work).
+	 */
+	njobs = nwords * (max_wpm - min_wpm + 1) * nfw;
+	if ((workers = (struct worker *)calloc(nworkers, sizeof(struct worker))) == NULL) {
+		perror("morse_batch: calloc");
+		exit(1);
+	}
+	for (i = 0; i < nworkers; i++) {
+		workers[i].id = i;
+		workers[i].lo = (int )((long )njobs * i / nworkers);
+		workers[i].hi = (int )((long )njobs * (i + 1) / nworkers);
+		pthread_mutex_init(&workers[i].lock, NULL);
+		if ((workers[i].mp = morse_init(min_wpm)) == NULL) {
+			fprintf(stderr, "?Error - morse_init failed.\n");
+			exit(1);
+		}
+	}
+	start = now();
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&workers[i].tid, NULL, worker, &workers[i]) != 0) {
+			perror("morse_batch: pthread_create");
+			exit(1);
+		}
+	}
+	clips = 0;
+	samples = 0.0;
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].tid, NULL);
+		clips += workers[i].clips;
+		samples += workers[i].samples;
+	}
+	elapsed = now() - start;
+	samples /= (double )workers[0].mp->sample_rate;
+	printf("%ld clips (%.1f seconds of audio) in %.2f seconds using %d threads.\n",
+				clips, samples, elapsed, nworkers);
+	printf("%.1f clips/sec, %.1fx realtime.\n", (double )clips / elapsed, samples / elapsed);
+	for (i = 0; i < nworkers; i++) {
+		printf("Thread %d: %ld clips, %ld steals.\n", i, workers[i].clips, workers[i].steals);
+		morse_free(workers[i].mp);
+	}
+	exit(0);
+}
+
+/*
+ * Worker thread. Take jobs from the bottom of our own range until there
+ * are none left, then try to steal some more.
+ */
+void *
+worker(void *arg)
+{
+	int job;
+	struct worker *wp = (struct worker *)arg;
+
+	while (1) {
+		pthread_mutex_lock(&wp->lock);
+		if (wp->lo < wp->hi)
+			job = wp->lo++;
+		else
+			job = -1;
+		pthread_mutex_unlock(&wp->lock);
+		if (job < 0 && (job = steal(wp)) < 0)
+			break;
+		render(wp, job);
+	}
+	return(NULL);
+}
+
+/*
+ * Steal the top half of the jobs from the first worker (after us) which
+ * has any left. We get the first job of the stolen range to do straight
+ * away and the rest become our new range. Returns -1 if everyone is done.
+ */
+int
+steal(struct worker *wp)
+{
+	int i, n, lo, hi;
+	struct worker *vp;
+
+	for (i = 1; i < nworkers; i++) {
+		vp = &workers[(wp->id + i) % nworkers];
+		pthread_mutex_lock(&vp->lock);
+		if ((n = vp->hi - vp->lo) > 0) {
+			hi = vp->hi;
+			lo = vp->hi -= (n + 1) / 2;
+			pthread_mutex_unlock(&vp->lock);
+			pthread_mutex_lock(&wp->lock);
+			wp->lo = lo + 1;
+			wp->hi = hi;
+			wp->steals++;
+			pthread_mutex_unlock(&wp->lock);
+			return(lo);
+		}
+		pthread_mutex_unlock(&vp->lock);
+	}
+	return(-1);
+}
+
+/*
+ * Render one clip into the worker's buffer, growing it if necessary, and
+ * then (optionally) write it out.
+ */
+void
+render(struct worker *wp, int job)
+{
+	int n, wpm, fw, word;
+	char fname[1024];
+	struct morse *mp = wp->mp;
+
+	word = job % nwords;
+	job /= nwords;
+	fw = job % nfw;
+	wpm = min_wpm + job / nfw;
+	if (wpm != mp->wpm || fw != mp->farnsworth || (ampl >= 0 && ampl != mp->amplitude)) {
+		mp->wpm = wpm;
+		mp->farnsworth = fw;
+		if (ampl >= 0)
+			mp->amplitude = ampl;
+		morse_calc_params(mp);
+	}
+	while ((n = morse_render_string(mp, words[word], wp->buf, wp->size)) > wp->size) {
+		free(wp->buf);
+		if ((wp->buf = (short *)malloc(n * sizeof(short))) == NULL) {
+			perror("morse_batch: malloc");
+			exit(1);
+		}
+		wp->size = n;
+	}
+	wp->clips++;
+	wp->samples += (double )n;
+	if (outdir != NULL) {
+		snprintf(fname, sizeof(fname), "%s/%s-%02d%s.wav",
+					outdir, words[word], wpm, fw ? "f" : "");
+		if (morse_wav_write(fname, wp->buf, n, mp->sample_rate) < 0)
+			exit(1);
+	}
+}
+
+/*
+ * Load the word list (see words.c) and pick out the words of the right
+ * length. Words with a '/' are left out, as they'd upset the file names.
+ * Words are converted to upper case so the file names are consistent.
+ */
+int
+load_words(char *fname, int len)
+{
+	int i, n;
+	const char *cp;
+	struct morse_words *wp;
+	struct morse_wordsel *sp;
+
+	if ((wp = morse_words_open(fname, NULL)) == NULL)
+		return(-1);
+	if ((sp = morse_words_select(wp, len, len, MORSE_CHARSET_ALL & ~morse_charset("/"))) == NULL ||
+				(words = (char **)malloc((sp->nwords + 1) * sizeof(char *))) == NULL) {
+		perror("morse_batch: malloc");
+		return(-1);
+	}
+	for (nwords = 0; nwords < sp->nwords; nwords++) {
+		cp = morse_words_get(sp, nwords, &n);
+		if ((words[nwords] = (char *)malloc(n + 1)) == NULL) {
+			perror("morse_batch: malloc");
+			return(-1);
+		}
+		for (i = 0; i < n; i++)
+			words[nwords][i] = toupper(cp[i]);
+		words[nwords][n] = '\0';
+	}
+	morse_words_free(sp);
+	morse_words_close(wp);
+	return(0);
+}
+
+/*
+ * Return the current (monotonic) time in seconds.
+ */
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double )ts.tv_sec + (double )ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ * Print a brief usage message and quit.
+ */
+void
+usage()
+{
+	fprintf(stderr, "Usage: morse_batch [-a AMPL][-d DIR][-F][-l LEN][-s MIN-MAX][-t NN][-w FILE]\n");
+	fprintf(stderr, "\t-a AMPL\tAmplification - a number between 0 and 100.\n");
+	fprintf(stderr, "\t-d DIR\tWrite each clip to DIR as a .wav file.\n");
+	fprintf(stderr, "\t-F\tRender with and without Farnsworth spacing.\n");
+	fprintf(stderr, "\t-l LEN\tOnly use words of this length.\n");
+	fprintf(stderr, "\t-s MIN-MAX\tRange of speeds in words per minute.\n");
+	fprintf(stderr, "\t-t NN\tNumber of threads.\n");
+	fprintf(stderr, "\t-w FILE\tWord list.\n");
+	exit(2);
+}
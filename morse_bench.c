@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Benchmarks for the audio generation. Each case sends text to the null
+ * backend (so all of the audio is generated and converted, but goes
+ * nowhere) until a given amount of audio has been produced, and reports
+ * how many samples per second that took and how many times faster than
+ * real time it was. There are three groups of cases:
+ *   unit       Single characters, the word PARIS, and a long text
+ *   wpm        PARIS at every speed from 5 to 60 WPM, with and without
+ *              Farnsworth spacing
+ *   rate       PARIS at a range of sample rates
+ *
+ * The results are written as tab-separated columns, with a header line,
+ * so they can be kept and compared. Given the results of an earlier run
+ * (with -b), the change in speed for each case is added as a last column.
+ * Each case is run a few times and the best time is used, which takes
+ * out most of the noise.
+ *
+ * The command-line options are as follows:
+ *   -b FILE    Compare against an earlier set of results
+ *   -g GROUP   Only run this group of cases
+ *   -r NN      How many times to run each case (default 5)
+ *   -t SECS    Seconds of audio to generate for each case (default 600)
+ *
+ * Try:
+ *   make bench > before.tsv
+ *   (change something)
+ *   make bench BENCH_FLAGS="-b before.tsv"
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libmorse.h"
+
+#define BENCH_CHAR		0
+#define BENCH_WORD		1
+#define BENCH_TEXT		2
+
+#define MAX_BASELINE	1024
+
+struct	baseline	{
+	char			key[64];
+	double			rate;
+};
+
+void	run(const char *, int, int, int, int);
+double	generate(int, int, int, int);
+void	load(const char *);
+double	now();
+void	usage();
+
+const char *kinds[] = {"char", "word", "text"};
+
+const char *chars = "ETIANMSURWDKGOHVFLPJBXCYZQ0123456789";
+
+const char *text = "The quick brown fox jumps over the lazy dog. "
+				"Now is the time for all good men to come to the aid of the party. "
+				"CQ CQ CQ DE EI4HRB EI4HRB K. 73 ES GL OM, HPE CUAGN. ";
+
+int				nbase = 0;
+int				repeat = 5;
+double			seconds = 600.0;
+struct baseline	base[MAX_BASELINE];
+
+/*
+ * All life begins here...
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, wpm, fw;
+	char *group, *basefile;
+	static int rates[] = {8000, 16000, 22050, 44100, 48000, 96000, 0};
+
+	opterr = 0;
+	group = basefile = NULL;
+	while ((i = getopt(argc, argv, "b:g:r:t:")) != EOF) {
+		switch (i) {
+		case 'b':
+			basefile = optarg;
+			break;
+
+		case 'g':
+			group = optarg;
+			if (strcmp(group, "unit") != 0 && strcmp(group, "wpm") != 0 &&
+							strcmp(group, "rate") != 0) {
+				fprintf(stderr, "Group should be unit, wpm or rate.\n");
+				usage();
+			}
+			break;
+
+		case 'r':
+			if ((repeat = atoi(optarg)) < 1 || repeat > 100) {
+				fprintf(stderr, "Repeat count should be between 1 and 100.\n");
+				usage();
+			}
+			break;
+
+		case 't':
+			if ((seconds = atof(optarg)) <= 0.0) {
+				fprintf(stderr, "Need a positive number of seconds.\n");
+				usage();
+			}
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	}
+	if (optind != argc)
+		usage();
+	if (basefile != NULL)
+		load(basefile);
+	printf("# libmorse benchmark, %s kernels, %.0fs of audio per case, best of %d\n",
+					morse_simd_select()->name, seconds, repeat);
+	printf("case\twpm\tfw\trate\tsamples\tseconds\tsamples_per_sec\trealtime%s\n",
+					basefile != NULL ? "\tchange" : "");
+	if (group == NULL || strcmp(group, "unit") == 0) {
+		run("unit", BENCH_CHAR, 18, 0, 44100);
+		run("unit", BENCH_WORD, 18, 0, 44100);
+		run("unit", BENCH_TEXT, 18, 0, 44100);
+	}
+	if (group == NULL || strcmp(group, "wpm") == 0) {
+		for (fw = 0; fw < 2; fw++)
+			for (wpm = 5; wpm <= 60; wpm++)
+				run("wpm", BENCH_WORD, wpm, fw, 44100);
+	}
+	if (group == NULL || strcmp(group, "rate") == 0) {
+		for (i = 0; rates[i] != 0; i++)
+			run("rate", BENCH_WORD, 18, 0, rates[i]);
+	}
+	exit(0);
+}
+
+/*
+ * Run one case (several times over) and print the result. If there's a
+ * baseline, look the case up in it and show the change.
+ */
+void
+run(const char *group, int kind, int wpm, int fw, int rate)
+{
+	int i;
+	double t, best, samples;
+	char key[64];
+
+	samples = seconds * (double )rate;
+	for (best = 0.0, i = 0; i < repeat; i++)
+		if ((t = generate(kind, wpm, fw, rate)) < best || i == 0)
+			best = t;
+	snprintf(key, sizeof(key), "%s-%s\t%d\t%d\t%d", group, kinds[kind], wpm, fw, rate);
+	printf("%s\t%.0f\t%.6f\t%.0f\t%.1f", key, samples, best,
+					samples / best, seconds / best);
+	for (i = 0; i < nbase; i++)
+		if (strcmp(base[i].key, key) == 0)
+			break;
+	if (nbase > 0 && i < nbase)
+		printf("\t%+.1f%%", ((samples / best) / base[i].rate - 1.0) * 100.0);
+	else if (nbase > 0)
+		printf("\t-");
+	printf("\n");
+	fflush(stdout);
+}
+
+/*
+ * Generate the audio for one run of a case, and return how long it took.
+ */
+double
+generate(int kind, int wpm, int fw, int rate)
+{
+	int i;
+	double start;
+	unsigned long long target;
+	struct morse *mp;
+
+	if ((mp = morse_init(wpm)) == NULL) {
+		fprintf(stderr, "?Error - morse_init failed.\n");
+		exit(1);
+	}
+	mp->farnsworth = fw;
+	mp->sample_rate = rate;
+	morse_calc_params(mp);
+	if (morse_open(mp, "null", NULL) < 0 || morse_setup(mp) < 0) {
+		fprintf(stderr, "?Error - audio setup failed.\n");
+		exit(1);
+	}
+	target = (unsigned long long )(seconds * (double )rate);
+	start = now();
+	for (i = 0; mp->time_stamp < target; i++) {
+		switch (kind) {
+		case BENCH_CHAR:
+			morse_send_char(mp, chars[i % strlen(chars)]);
+			break;
+
+		case BENCH_WORD:
+			morse_send_string(mp, "PARIS");
+			break;
+
+		default:
+			morse_send_text(mp, text, strlen(text));
+			break;
+		}
+	}
+	morse_drain(mp);
+	start = now() - start;
+	morse_free(mp);
+	return(start);
+}
+
+/*
+ * Load the results of an earlier run. Only the case and the samples per
+ * second are needed.
+ */
+void
+load(const char *file)
+{
+	int i, tabs;
+	char line[256], *cp;
+	FILE *fp;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		perror(file);
+		exit(1);
+	}
+	while (nbase < MAX_BASELINE && fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || strncmp(line, "case\t", 5) == 0)
+			continue;
+		base[nbase].key[0] = '\0';
+		/*
+		 * The key is the first four columns, and the samples per
+		 * second is the seventh.
+		 */
+		for (tabs = 0, cp = line; *cp != '\0'; cp++) {
+			if (*cp != '\t')
+				continue;
+			if (++tabs == 4 && cp - line < sizeof(base[0].key)) {
+				memcpy(base[nbase].key, line, cp - line);
+				base[nbase].key[cp - line] = '\0';
+			} else if (tabs == 6)
+				break;
+		}
+		if (tabs < 6)
+			continue;
+		base[nbase++].rate = atof(cp + 1);
+	}
+	fclose(fp);
+	for (i = 0; i < nbase; i++)
+		if (base[i].rate <= 0.0)
+			base[i--] = base[--nbase];
+}
+
+/*
+ * The current time in seconds.
+ */
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double )ts.tv_sec + (double )ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ * Print a brief usage message and quit.
+ */
+void
+usage()
+{
+	fprintf(stderr, "Usage: morse_bench [-b FILE][-g GROUP][-r NN][-t SECS]\n");
+	fprintf(stderr, "\t-b FILE\tCompare against an earlier set of results.\n");
+	fprintf(stderr, "\t-g GROUP\tOnly run this group of cases (unit, wpm or rate).\n");
+	fprintf(stderr, "\t-r NN\tHow many times to run each case.\n");
+	fprintf(stderr, "\t-t SECS\tSeconds of audio to generate for each case.\n");
+	exit(2);
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * A simple client for the render service (see morse_server.c). It asks
+ * the server to render some text, and writes the result to a file. It
+ * can ask for the same text many times over, to see how fast the
+ * server's cache is, and report the server's cache statistics.
+ *
+ * The command-line options are as follows:
+ *   -a NN      Set the output volume (0 -> 100)
+ *   -f FREQ    Set the tone frequency (default 800Hz)
+ *   -n NN      Ask for the text this many times
+ *   -o FILE    Write the audio to a file (.wav or raw PCM, "-" for stdout)
+ *   -S PATH    The server's socket (default /tmp/morse.sock)
+ *   -s WPM     Set the WPM (a number between 5 and 60)
+ *   -v         Report the timing and the server's cache statistics
+ *
+ * Try:
+ *   ./morse_client -o - CQ CQ CQ DE EI4HRB | ./morse_decode
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libmorse.h"
+
+double	now();
+void	usage();
+
+/*
+ * All life begins here...
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, n, len, count, verbose;
+	char *str, *path, *outfile;
+	short *buf;
+	double start, elapsed;
+	FILE *fp;
+	struct morse *mp;
+	struct morse_client *cp;
+	struct morse_cache_stats stats;
+
+	opterr = verbose = 0;
+	count = 1;
+	path = outfile = NULL;
+	if ((mp = morse_init(18)) == NULL) {
+		fprintf(stderr, "?Error - morse_init failed.\n");
+		exit(1);
+	}
+	while ((i = getopt(argc, argv, "a:f:n:o:S:s:v")) != EOF) {
+		switch (i) {
+		case 'a':
+			if ((mp->amplitude = atoi(optarg)) < 0 || mp->amplitude > 100) {
+				fprintf(stderr, "Amplitude between 0 and 100.\n");
+				usage();
+			}
+			break;
+
+		case 'f':
+			if ((mp->tone_frequency = atof(optarg)) < 100.0) {
+				fprintf(stderr, "Tone frequency should be at least 100Hz.\n");
+				usage();
+			}
+			break;
+
+		case 'n':
+			if ((count = atoi(optarg)) < 1) {
+				fprintf(stderr, "Count should be at least 1.\n");
+				usage();
+			}
+			break;
+
+		case 'o':
+			outfile = optarg;
+			break;
+
+		case 'S':
+			path = optarg;
+			break;
+
+		case 's':
+			if ((mp->wpm = atoi(optarg)) < 5 || mp->wpm > 60) {
+				fprintf(stderr, "WPM value should be between 5 and 60.\n");
+				usage();
+			}
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	}
+	if ((argc - optind) < 1)
+		usage();
+	for (i = len = optind; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if ((str = (char *)malloc(len)) == NULL) {
+		perror("morse_client: malloc");
+		exit(1);
+	}
+	strcpy(str, argv[optind++]);
+	for (; optind < argc; optind++) {
+		strcat(str, " ");
+		strcat(str, argv[optind]);
+	}
+	if ((cp = morse_client_open(path)) == NULL)
+		exit(1);
+	buf = NULL;
+	n = 0;
+	start = now();
+	for (i = 0; i < count; i++) {
+		free(buf);
+		if ((n = morse_client_render(cp, mp, str, &buf)) < 0) {
+			fprintf(stderr, "?Error - morse_client_render failed.\n");
+			exit(1);
+		}
+	}
+	elapsed = now() - start;
+	if (outfile != NULL) {
+		len = strlen(outfile);
+		if (len > 4 && strcmp(outfile + len - 4, ".wav") == 0) {
+			if (morse_wav_write(outfile, buf, n, mp->sample_rate) < 0)
+				exit(1);
+		} else {
+			fp = strcmp(outfile, "-") == 0 ? stdout : fopen(outfile, "w");
+			if (fp == NULL || fwrite(buf, sizeof(short), n, fp) != n) {
+				perror(outfile);
+				exit(1);
+			}
+			fflush(fp);
+		}
+	}
+	if (verbose) {
+		fp = (outfile != NULL && strcmp(outfile, "-") == 0) ? stderr : stdout;
+		fprintf(fp, "%d requests of %.2f seconds in %.3f seconds (%.0fx realtime).\n",
+					count, (double )n / mp->sample_rate, elapsed,
+					(double )n * count / mp->sample_rate / elapsed);
+		if (morse_client_stats(cp, &stats) == 0)
+			fprintf(fp, "Server: %lu hits, %lu misses (%.1f%% hit rate), %lu words cached.\n",
+						stats.hits, stats.misses,
+						stats.hits + stats.misses > 0 ?
+							100.0 * stats.hits / (stats.hits + stats.misses) : 0.0,
+						stats.entries);
+	}
+	free(buf);
+	morse_client_close(cp);
+	morse_free(mp);
+	exit(0);
+}
+
+/*
+ * Return the current (monotonic) time in seconds.
+ */
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double )ts.tv_sec + (double )ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ * Print a brief usage message and quit.
+ */
+void
+usage()
+{
+	fprintf(stderr, "Usage: morse_client [-a AMPL][-f FREQ][-n NN][-o FILE][-S PATH][-s WPM][-v] <word> [<word> ...]\n");
+	fprintf(stderr, "\t-a AMPL\tAmplification - a number between 0 and 100.\n");
+	fprintf(stderr, "\t-f FREQ\tThe tone frequency in Hz.\n");
+	fprintf(stderr, "\t-n NN\tAsk for the text this many times.\n");
+	fprintf(stderr, "\t-o FILE\tWrite a .wav (or raw PCM) file. Use '-' for stdout.\n");
+	fprintf(stderr, "\t-S PATH\tThe server's socket.\n");
+	fprintf(stderr, "\t-s WPM\tSet the rate in words per minute.\n");
+	fprintf(stderr, "\t-v\tReport the timing and the cache statistics.\n");
+	exit(2);
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Decode Morse Code audio back into text. The input is a WAV file or raw
+ * 16-bit mono PCM, from a file or the standard input, so the output of
+ * morse_play can be piped straight in for a self-check.
+ *
+ * With the -k option, it runs as a "skimmer" instead, decoding every
+ * signal in a band of frequencies at once, and prints what was decoded on
+ * each frequency at the end.
+ *
+ * The command-line options are as follows:
+ *   -b LO-HI   The band to skim (default 300-3300Hz)
+ *   -f FREQ    The tone frequency to listen for (default 800Hz)
+ *   -k         Skim the whole band
+ *   -r RATE    The sample rate of raw input (default 44100)
+ *   -s WPM     A hint as to the expected speed
+ *   -v         Report the speed at the end
+ *
+ * Try:
+ *   ./morse_play -o - CQ CQ CQ DE EI4HRB | ./morse_decode
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "libmorse.h"
+
+int		read_header(FILE *, int *);
+void	skim(FILE *, int, double, double, int);
+void	usage();
+
+/*
+ * All life begins here...
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, n, rate, wpm, verbose, skimmer;
+	short buffer[4096];
+	char text[256], *cp;
+	double freq, lo, hi;
+	FILE *fp;
+	struct morse_decoder *dp;
+
+	opterr = verbose = wpm = skimmer = 0;
+	rate = 44100;
+	freq = 800.0;
+	lo = 300.0;
+	hi = 3300.0;
+	while ((i = getopt(argc, argv, "b:f:kr:s:v")) != EOF) {
+		switch (i) {
+		case 'b':
+			lo = atof(optarg);
+			if ((cp = strchr(optarg, '-')) == NULL || (hi = atof(cp + 1)) <= lo) {
+				fprintf(stderr, "Band should be LO-HI in Hz.\n");
+				usage();
+			}
+			break;
+
+		case 'f':
+			if ((freq = atof(optarg)) < 100.0) {
+				fprintf(stderr, "Tone frequency should be at least 100Hz.\n");
+				usage();
+			}
+			break;
+
+		case 'k':
+			skimmer = 1;
+			break;
+
+		case 'r':
+			if ((rate = atoi(optarg)) < 4000) {
+				fprintf(stderr, "Sample rate should be at least 4000.\n");
+				usage();
+			}
+			break;
+
+		case 's':
+			if ((wpm = atoi(optarg)) < 5 || wpm > 60) {
+				fprintf(stderr, "WPM value should be between 5 and 60.\n");
+				usage();
+			}
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	}
+	if ((argc - optind) > 1)
+		usage();
+	if (optind < argc) {
+		if ((fp = fopen(argv[optind], "r")) == NULL) {
+			perror(argv[optind]);
+			exit(1);
+		}
+	} else
+		fp = stdin;
+	if (read_header(fp, &rate) < 0)
+		exit(1);
+	if (skimmer) {
+		skim(fp, rate, lo, hi, verbose);
+		exit(0);
+	}
+	if ((dp = morse_decode_init(rate, freq)) == NULL) {
+		fprintf(stderr, "?Error - morse_decode_init failed.\n");
+		exit(1);
+	}
+	if (wpm > 0)
+		morse_decode_speed(dp, wpm);
+	while ((n = fread(buffer, sizeof(short), 4096, fp)) > 0) {
+		morse_le16(buffer, n);
+		if ((n = morse_decode(dp, buffer, n, text, sizeof(text))) > 0) {
+			fwrite(text, 1, n, stdout);
+			fflush(stdout);
+		}
+	}
+	n = morse_decode_flush(dp, text, sizeof(text));
+	fwrite(text, 1, n, stdout);
+	putchar('\n');
+	if (verbose)
+		fprintf(stderr, "Speed: %.1f WPM.\n", morse_decode_wpm(dp));
+	morse_decode_free(dp);
+	exit(0);
+}
+
+/*
+ * Skim the whole band, and report what was found on each frequency.
+ */
+void
+skim(FILE *fp, int rate, double lo, double hi, int verbose)
+{
+	int i, n, *len;
+	short buffer[4096];
+	char **text;
+	struct morse_skimmer *sp;
+
+	if ((sp = morse_skim_init(rate, lo, hi)) == NULL) {
+		fprintf(stderr, "?Error - morse_skim_init failed.\n");
+		exit(1);
+	}
+	text = (char **)calloc(sp->nchannels, sizeof(char *));
+	len = (int *)calloc(sp->nchannels, sizeof(int));
+	if (text == NULL || len == NULL) {
+		perror("morse_decode: calloc");
+		exit(1);
+	}
+	while ((n = fread(buffer, sizeof(short), 4096, fp)) > 0) {
+		morse_le16(buffer, n);
+		if (morse_skim(sp, buffer, n) == 0)
+			continue;
+		for (i = 0; i < sp->nchannels; i++) {
+			if (sp->channel[i].ntext == 0)
+				continue;
+			if ((text[i] = (char *)realloc(text[i], len[i] + MORSE_SKIM_TEXT + 1)) == NULL) {
+				perror("morse_decode: realloc");
+				exit(1);
+			}
+			len[i] += morse_skim_read(sp, i, text[i] + len[i], MORSE_SKIM_TEXT);
+			text[i][len[i]] = '\0';
+		}
+	}
+	for (i = 0; i < sp->nchannels; i++) {
+		if (len[i] == 0)
+			continue;
+		printf("%7.1f: %s", sp->channel[i].frequency, text[i]);
+		if (verbose)
+			printf(" (%.1f WPM)", morse_decode_wpm(&sp->channel[i].decoder));
+		putchar('\n');
+	}
+	if (verbose)
+		fprintf(stderr, "%d channels, %s kernels.\n", sp->nchannels, sp->simd->name);
+	morse_skim_free(sp);
+}
+
+/*
+ * If the input is a WAV file, pick up the sample rate from the header
+ * and skip to the start of the data. Only 16-bit mono is supported.
+ * Otherwise, put back what we've read and treat it as raw PCM.
+ */
+int
+read_header(FILE *fp, int *ratep)
+{
+	int c;
+	unsigned char hdr[8], fmt[16];
+	unsigned int len;
+
+	if ((c = getc(fp)) == EOF)
+		return(0);
+	ungetc(c, fp);
+	if (c != 'R')
+		return(0);
+	if (fread(hdr, 1, 4, fp) != 4 || memcmp(hdr, "RIFF", 4) != 0 ||
+				fread(hdr, 1, 8, fp) != 8 || memcmp(hdr + 4, "WAVE", 4) != 0) {
+		fprintf(stderr, "morse_decode: not a WAV file.\n");
+		return(-1);
+	}
+	while (fread(hdr, 1, 8, fp) == 8) {
+		len = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) | (hdr[7] << 24);
+		if (memcmp(hdr, "data", 4) == 0)
+			return(0);
+		if (memcmp(hdr, "fmt ", 4) == 0 && len >= 16) {
+			if (fread(fmt, 1, 16, fp) != 16)
+				break;
+			if (fmt[2] != 1 || fmt[3] != 0 || fmt[14] != 16) {
+				fprintf(stderr, "morse_decode: only 16-bit mono is supported.\n");
+				return(-1);
+			}
+			*ratep = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | (fmt[7] << 24);
+			len -= 16;
+		}
+		while (len-- > 0)
+			if (getc(fp) == EOF)
+				break;
+	}
+	fprintf(stderr, "morse_decode: no data in WAV file.\n");
+	return(-1);
+}
+
+/*
+ * Print a brief usage message and quit.
+ */
+void
+usage()
+{
+	fprintf(stderr, "Usage: morse_decode [-b LO-HI][-f FREQ][-k][-r RATE][-s WPM][-v] [<file>]\n");
+	fprintf(stderr, "\t-b LO-HI\tBand to skim, in Hz.\n");
+	fprintf(stderr, "\t-f FREQ\tTone frequency to listen for.\n");
+	fprintf(stderr, "\t-k\tSkim the whole band.\n");
+	fprintf(stderr, "\t-r RATE\tSample rate of raw input.\n");
+	fprintf(stderr, "\t-s WPM\tExpected speed (a hint).\n");
+	fprintf(stderr, "\t-v\tReport the speed at the end.\n");
+	exit(2);
+}
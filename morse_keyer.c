@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Send live Morse Code, with a sidetone. There are two kinds of input.
+ * With -e, the paddles are a pair of keys on a Linux input device
+ * (/dev/input/eventN), such as a keyboard or a USB paddle adapter, and
+ * the iambic keyer (see keyer.c) does the rest. Otherwise, whatever is
+ * typed on the standard input is sent, a character at a time, as soon
+ * as it's typed. Either way, the audio goes out a few milliseconds at a
+ * time through a small sound card buffer, so it follows the input as
+ * closely as possible. The latency (from a paddle going down or a key
+ * being typed to the tone coming out) is reported at the end.
+ *
+ * The command-line options are as follows:
+ *   -a NN      Set the output volume (0 -> 100)
+ *   -b MS      The sound card buffer, in ms (default 20)
+ *   -e DEVICE  Read the paddles from this input device
+ *   -k DIT,DAH The key codes for the paddles (default left and right
+ *              Ctrl, 29,97)
+ *   -m A|B     The iambic keyer mode (default B)
+ *   -o FILE    Write to a file (.wav or raw PCM) rather than the soundcard
+ *   -p MS      The audio period, in ms (default 5)
+ *   -R RATE    Ask for this sample rate
+ *   -s WPM     Set the WPM (a number between 5 and 60)
+ *
+ * Typing Escape or Ctrl-D stops it. With -e, use Ctrl-C.
+ *
+ * Try:
+ *   ./morse_keyer -s 25
+ *   sudo ./morse_keyer -e /dev/input/event3 -m A
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#include "libmorse.h"
+
+int		paddles(int, struct morse_keyer *, int, int, int *);
+int		keyboard(int, struct morse_keyer *);
+void	restore();
+void	stop(int);
+void	usage();
+
+struct termios	saved;
+int				raw = 0;
+volatile int	stopped = 0;
+
+/*
+ * All life begins here...
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, len, wpm, ampl, mode, rate, fd, dit, dah, state, period;
+	double buffer_time, period_time;
+	char *cp, *backend, *outfile, *device;
+	struct termios t;
+	struct morse *mp;
+	struct morse_keyer *kp;
+	struct morse_keyer_stats st;
+
+	opterr = 0;
+	wpm = 18;
+	ampl = rate = -1;
+	mode = MORSE_KEYER_B;
+	dit = KEY_LEFTCTRL;
+	dah = KEY_RIGHTCTRL;
+	buffer_time = 20.0;
+	period_time = 5.0;
+	backend = outfile = device = NULL;
+	while ((i = getopt(argc, argv, "a:b:e:k:m:o:p:R:s:")) != EOF) {
+		switch (i) {
+		case 'a':
+			if ((ampl = atoi(optarg)) < 0 || ampl > 100) {
+				fprintf(stderr, "Amplitude between 0 and 100.\n");
+				usage();
+			}
+			break;
+
+		case 'b':
+			if ((buffer_time = atof(optarg)) < 1.0) {
+				fprintf(stderr, "The buffer should be at least 1ms.\n");
+				usage();
+			}
+			break;
+
+		case 'e':
+			device = optarg;
+			break;
+
+		case 'k':
+			dit = atoi(optarg);
+			if ((cp = strchr(optarg, ',')) == NULL || (dah = atoi(cp + 1)) == dit) {
+				fprintf(stderr, "Key codes should be DIT,DAH.\n");
+				usage();
+			}
+			break;
+
+		case 'm':
+			if (strcmp(optarg, "A") == 0 || strcmp(optarg, "a") == 0)
+				mode = MORSE_KEYER_A;
+			else if (strcmp(optarg, "B") == 0 || strcmp(optarg, "b") == 0)
+				mode = MORSE_KEYER_B;
+			else {
+				fprintf(stderr, "Keyer mode should be A or B.\n");
+				usage();
+			}
+			break;
+
+		case 'o':
+			outfile = optarg;
+			len = strlen(outfile);
+			if (len > 4 && strcmp(outfile + len - 4, ".wav") == 0)
+				backend = "wav";
+			else
+				backend = "raw";
+			break;
+
+		case 'p':
+			if ((period_time = atof(optarg)) < 0.5) {
+				fprintf(stderr, "The period should be at least 0.5ms.\n");
+				usage();
+			}
+			break;
+
+		case 'R':
+			if ((rate = atoi(optarg)) < 8000 || rate > 192000) {
+				fprintf(stderr, "Sample rate should be between 8000 and 192000.\n");
+				usage();
+			}
+			break;
+
+		case 's':
+			if ((wpm = atoi(optarg)) < 5 || wpm > 60) {
+				fprintf(stderr, "WPM value should be between 5 and 60.\n");
+				usage();
+			}
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	}
+	if (optind != argc)
+		usage();
+	if (device != NULL) {
+		if ((fd = open(device, O_RDONLY | O_NONBLOCK)) < 0) {
+			perror(device);
+			exit(1);
+		}
+		/*
+		 * Have the events time-stamped on the keyer's clock, so the
+		 * latency can be measured from the moment the paddle moved.
+		 */
+		i = CLOCK_MONOTONIC;
+		if (ioctl(fd, EVIOCSCLOCKID, &i) < 0)
+			fprintf(stderr, "Can't use event time stamps, latency is approximate.\n");
+	} else {
+		fd = 0;
+		if (isatty(fd) && tcgetattr(fd, &saved) == 0) {
+			t = saved;
+			t.c_lflag &= ~ICANON;
+			t.c_cc[VMIN] = 1;
+			t.c_cc[VTIME] = 0;
+			tcsetattr(fd, TCSANOW, &t);
+			raw = 1;
+			atexit(restore);
+		}
+	}
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	if ((mp = morse_init(wpm)) == NULL) {
+		fprintf(stderr, "?Error - morse_init failed.\n");
+		exit(1);
+	}
+	if (ampl >= 0)
+		mp->amplitude = ampl;
+	if (rate > 0)
+		mp->sample_rate = rate;
+	mp->buffer_time = buffer_time;
+	mp->period_time = period_time;
+	if (backend != NULL && morse_open(mp, backend, outfile) < 0)
+		exit(1);
+	if (morse_setup(mp) < 0 || (kp = morse_keyer_init(mp, mode)) == NULL) {
+		fprintf(stderr, "?Error - audio setup failed.\n");
+		exit(1);
+	}
+	/*
+	 * Look at the input once a period (the one the sound card gave us,
+	 * which may not be quite what was asked for). The audio output
+	 * blocks until the sound card is ready for the next one, which keeps
+	 * time.
+	 */
+	period = (int )(mp->period_time * (double )mp->sample_rate / 1000.0 + 0.5);
+	state = 0;
+	while (!stopped) {
+		if (fd >= 0) {
+			if (device != NULL)
+				i = paddles(fd, kp, dit, dah, &state);
+			else
+				i = keyboard(fd, kp);
+			if (i < 0)
+				fd = -1;
+		}
+		if (morse_keyer_run(kp, period) < 0) {
+			fprintf(stderr, "?Error - audio output failed.\n");
+			exit(1);
+		}
+		/*
+		 * A file takes the audio as fast as it comes, so keep time
+		 * ourselves if someone is actually keying.
+		 */
+		if (outfile != NULL && (raw || device != NULL))
+			usleep((useconds_t )(mp->period_time * 1000.0));
+		if (fd < 0 && !morse_keyer_busy(kp))
+			break;
+	}
+	morse_drain(mp);
+	morse_keyer_stats(kp, &st);
+	if (st.count > 0)
+		fprintf(stderr, "Latency: %.1fms min, %.1fms avg, %.1fms max (%lu late) over %lu starts.\n",
+						st.min, st.total / st.count, st.max, st.late, st.count);
+	morse_keyer_free(kp);
+	morse_free(mp);
+	exit(0);
+}
+
+/*
+ * Read whatever paddle events are waiting. "statep" keeps track of which
+ * paddles are down. Key repeats are ignored. Returns -1 if the device
+ * has gone away.
+ */
+int
+paddles(int fd, struct morse_keyer *kp, int dit, int dah, int *statep)
+{
+	int i, n, bit;
+	double when;
+	struct input_event ev[16];
+
+	while ((n = read(fd, ev, sizeof(ev))) > 0) {
+		for (i = 0; i < n / (int )sizeof(struct input_event); i++) {
+			if (ev[i].type != EV_KEY || ev[i].value == 2)
+				continue;
+			if (ev[i].code == dit)
+				bit = 01;
+			else if (ev[i].code == dah)
+				bit = 02;
+			else
+				continue;
+			if (ev[i].value)
+				*statep |= bit;
+			else
+				*statep &= ~bit;
+			when = (double )ev[i].time.tv_sec + (double )ev[i].time.tv_usec / 1000000.0;
+			morse_keyer_paddle(kp, *statep & 01, *statep & 02, when);
+		}
+	}
+	return(n == 0 || (n < 0 && errno != EAGAIN) ? -1 : 0);
+}
+
+/*
+ * Queue up whatever has been typed. Returns -1 at the end of the input
+ * (or if Escape or Ctrl-D is typed).
+ */
+int
+keyboard(int fd, struct morse_keyer *kp)
+{
+	int i, n;
+	char buf[64];
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) <= 0)
+		return(0);
+	if ((n = read(fd, buf, sizeof(buf))) <= 0)
+		return(-1);
+	for (i = 0; i < n; i++)
+		if (buf[i] == 033 || buf[i] == 004)
+			break;
+	morse_keyer_send(kp, buf, i, morse_keyer_now());
+	return(i < n ? -1 : 0);
+}
+
+/*
+ * Put the terminal back the way it was.
+ */
+void
+restore()
+{
+	if (raw)
+		tcsetattr(0, TCSANOW, &saved);
+}
+
+/*
+ * Stop at the end of the current period.
+ */
+void
+stop(int sig)
+{
+	stopped = 1;
+}
+
+/*
+ * Print a brief usage message and quit.
+ */
+void
+usage()
+{
+	fprintf(stderr, "Usage: morse_keyer [-a AMPL][-b MS][-e DEVICE][-k DIT,DAH][-m A|B][-o FILE][-p MS][-R RATE][-s WPM]\n");
+	fprintf(stderr, "\t-a AMPL\tAmplification - a number between 0 and 100.\n");
+	fprintf(stderr, "\t-b MS\tSound card buffer in ms.\n");
+	fprintf(stderr, "\t-e DEVICE\tRead the paddles from this input device.\n");
+	fprintf(stderr, "\t-k DIT,DAH\tKey codes for the paddles.\n");
+	fprintf(stderr, "\t-m A|B\tIambic keyer mode.\n");
+	fprintf(stderr, "\t-o FILE\tWrite a .wav (or raw PCM) file. Use '-' for stdout.\n");
+	fprintf(stderr, "\t-p MS\tAudio period in ms.\n");
+	fprintf(stderr, "\t-R RATE\tAsk for this sample rate.\n");
+	fprintf(stderr, "\t-s WPM\tSet the rate in words per minute.\n");
+	exit(2);
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Simulate a contest pileup: a crowd of stations all calling at once,
+ * each with its own callsign, speed, pitch, strength and start time.
+ * They are mixed together (see mixer.c) and played, or written to a
+ * file. The stations are listed at the end, so the result can be checked
+ * against morse_decode -k.
+ *
+ * The band is split into slots at least SLOT Hz wide, and each station
+ * is put somewhere in a slot of its own, but never closer than SPACING Hz
+ * to its neighbours.
+ * Any closer, and they can't be told apart by ear (or by the skimmer),
+ * as the keying itself spreads each signal over several tens of Hz.
+ *
+ * The command-line options are as follows:
+ *   -b LO-HI   The range of pitches (default 300-3000Hz)
+ *   -n NN      The number of stations (default 20)
+ *   -o FILE    Write to a file (.wav or raw PCM) rather than the soundcard
+ *   -r NN      How many times each station sends its call (default 2)
+ *   -S SEED    Seed for the random number generator
+ *   -s MIN-MAX The range of speeds (default 18-35 WPM)
+ *   -t SECS    Spread the starts over this many seconds (default 2)
+ *
+ * Try:
+ *   ./morse_pileup -n 20 -o - | ./morse_decode -k
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libmorse.h"
+
+#define MAX_STATIONS	200
+#define SLOT			100.0
+#define SPACING			80.0
+
+void	callsign(char *);
+int		range(int, int);
+void	usage();
+
+/*
+ * All life begins here...
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, j, n, len, nstations, nslots, repeat, min_wpm, max_wpm;
+	int slot[MAX_STATIONS];
+	double lo, hi, spread, width;
+	char call[16], text[128], *cp, *backend, *outfile;
+	struct morse *out, *mp[MAX_STATIONS];
+	struct morse_mixer *xp;
+	FILE *fp;
+
+	opterr = 0;
+	nstations = 20;
+	repeat = 2;
+	min_wpm = 18;
+	max_wpm = 35;
+	lo = 300.0;
+	hi = 3000.0;
+	spread = 2.0;
+	backend = outfile = NULL;
+	srandom(time(NULL));
+	while ((i = getopt(argc, argv, "b:n:o:r:S:s:t:")) != EOF) {
+		switch (i) {
+		case 'b':
+			lo = atof(optarg);
+			if ((cp = strchr(optarg, '-')) == NULL || (hi = atof(cp + 1)) <= lo || lo < 100.0) {
+				fprintf(stderr, "Pitch range should be LO-HI in Hz.\n");
+				usage();
+			}
+			break;
+
+		case 'n':
+			if ((nstations = atoi(optarg)) < 1 || nstations > MAX_STATIONS) {
+				fprintf(stderr, "Between 1 and %d stations.\n", MAX_STATIONS);
+				usage();
+			}
+			break;
+
+		case 'o':
+			outfile = optarg;
+			len = strlen(outfile);
+			if (len > 4 && strcmp(outfile + len - 4, ".wav") == 0)
+				backend = "wav";
+			else
+				backend = "raw";
+			break;
+
+		case 'r':
+			if ((repeat = atoi(optarg)) < 1 || repeat > 5) {
+				fprintf(stderr, "Repeat count should be between 1 and 5.\n");
+				usage();
+			}
+			break;
+
+		case 'S':
+			srandom(atoi(optarg));
+			break;
+
+		case 's':
+			min_wpm = atoi(optarg);
+			max_wpm = (cp = strchr(optarg, '-')) != NULL ? atoi(cp + 1) : min_wpm;
+			if (min_wpm < 5 || max_wpm > 60 || min_wpm > max_wpm) {
+				fprintf(stderr, "WPM range should be MIN-MAX, between 5 and 60.\n");
+				usage();
+			}
+			break;
+
+		case 't':
+			if ((spread = atof(optarg)) < 0.0) {
+				fprintf(stderr, "Start spread can't be negative.\n");
+				usage();
+			}
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	}
+	if (optind != argc)
+		usage();
+	if ((nslots = (int )((hi - lo) / SLOT)) > MAX_STATIONS)
+		nslots = MAX_STATIONS;
+	if (nstations > nslots) {
+		fprintf(stderr, "?Error - %d stations won't fit %.0fHz apart between %.0f and %.0fHz.\n",
+						nstations, SLOT, lo, hi);
+		exit(1);
+	}
+	/*
+	 * Shuffle the slots, and give the stations the first few. Within
+	 * its slot, a station can be anywhere which keeps it SPACING Hz from
+	 * whatever is in the next slot.
+	 */
+	width = (hi - lo) / (double )nslots;
+	for (n = 0; n < nslots; n++)
+		slot[n] = n;
+	for (n = nslots - 1; n > 0; n--) {
+		i = range(0, n);
+		j = slot[n];
+		slot[n] = slot[i];
+		slot[i] = j;
+	}
+	if ((out = morse_init(18)) == NULL) {
+		fprintf(stderr, "?Error - morse_init failed.\n");
+		exit(1);
+	}
+	if (backend != NULL && morse_open(out, backend, outfile) < 0)
+		exit(1);
+	/*
+	 * Get the audio going first, so everything is generated at
+	 * whatever sample rate it settles on.
+	 */
+	if (morse_setup(out) < 0 || (xp = morse_mix_init(out->sample_rate)) == NULL) {
+		fprintf(stderr, "?Error - audio setup failed.\n");
+		exit(1);
+	}
+	/*
+	 * Don't mix the report in with the audio if that's going to stdout.
+	 */
+	fp = (outfile != NULL && strcmp(outfile, "-") == 0) ? stderr : stdout;
+	/*
+	 * Keep the level of each station down, so that a handful of
+	 * them can overlap before the limiter has to do anything.
+	 */
+	xp->gain = 4.0 / (nstations + 3);
+	for (n = 0; n < nstations; n++) {
+		if ((mp[n] = morse_init(range(min_wpm, max_wpm))) == NULL) {
+			fprintf(stderr, "?Error - morse_init failed.\n");
+			exit(1);
+		}
+		mp[n]->tone_frequency = lo + width * ((double )slot[n] + 0.5) +
+				(width - SPACING) * ((double )random() / (double )RAND_MAX - 0.5);
+		mp[n]->amplitude = range(30, 100);
+		mp[n]->sample_rate = out->sample_rate;
+		morse_calc_params(mp[n]);
+		callsign(call);
+		for (text[0] = '\0', i = 0; i < repeat; i++) {
+			strcat(text, call);
+			strcat(text, " ");
+		}
+		if (morse_mix_add(xp, mp[n], text, spread * (double )random() / (double )RAND_MAX) < 0) {
+			fprintf(stderr, "?Error - morse_mix_add failed.\n");
+			exit(1);
+		}
+		fprintf(fp, "%7.1fHz %2dWPM %3d%%: %s\n", mp[n]->tone_frequency,
+						mp[n]->wpm, mp[n]->amplitude, call);
+	}
+	if (morse_mix_play(xp, out) < 0 || morse_drain(out) < 0) {
+		fprintf(stderr, "?Error - audio output failed.\n");
+		exit(1);
+	}
+	fprintf(fp, "Total time: %.2f seconds.\n", morse_timestamp(out));
+	morse_free(out);
+	morse_mix_free(xp);
+	for (n = 0; n < nstations; n++)
+		morse_free(mp[n]);
+	exit(0);
+}
+
+/*
+ * Make up a plausible-looking callsign: a prefix of one or two letters,
+ * a digit, and a suffix of one to three letters.
+ */
+void
+callsign(char *cp)
+{
+	int i, n;
+
+	n = range(1, 2);
+	for (i = 0; i < n; i++)
+		*cp++ = 'A' + range(0, 25);
+	*cp++ = '0' + range(0, 9);
+	n = range(1, 3);
+	for (i = 0; i < n; i++)
+		*cp++ = 'A' + range(0, 25);
+	*cp = '\0';
+}
+
+/*
+ * Return a random number between "lo" and "hi" inclusive.
+ */
+int
+range(int lo, int hi)
+{
+	return(lo + random() % (hi - lo + 1));
+}
+
+/*
+ * Print a brief usage message and quit.
+ */
+void
+usage()
+{
+	fprintf(stderr, "Usage: morse_pileup [-b LO-HI][-n NN][-o FILE][-r NN][-S SEED][-s MIN-MAX][-t SECS]\n");
+	fprintf(stderr, "\t-b LO-HI\tRange of pitches in Hz.\n");
+	fprintf(stderr, "\t-n NN\tNumber of stations.\n");
+	fprintf(stderr, "\t-o FILE\tWrite a .wav (or raw PCM) file. Use '-' for stdout.\n");
+	fprintf(stderr, "\t-r NN\tHow many times each station sends its call.\n");
+	fprintf(stderr, "\t-S SEED\tSeed the random number generator.\n");
+	fprintf(stderr, "\t-s MIN-MAX\tRange of speeds in words per minute.\n");
+	fprintf(stderr, "\t-t SECS\tSpread the starts over this many seconds.\n");
+	exit(2);
+}
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * A render service. This listens on a UNIX-domain socket and renders
+ * Morse Code for its clients (see client.c), keeping a cache of the
+ * words it has rendered (see cache.c) so that a word which comes up
+ * again, at the same speed and pitch, costs no more than a copy. Each
+ * client gets its own thread, and they all share the one cache. The
+ * cache statistics are printed when the server is stopped.
+ *
+ * The command-line options are as follows:
+ *   -m MB      The size of the cache in megabytes (default 64)
+ *   -S PATH    The socket to listen on (default /tmp/morse.sock)
+ *
+ * Try:
+ *   ./morse_server &
+ *   ./morse_client -n 100 -v CQ CQ DE EI4HRB
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libmorse.h"
+
+/*
+ * The longest reply we'll render (about 50 minutes at 44.1kHz).
+ */
+#define MAX_SAMPLES		(1 << 27)
+
+struct morse_cache	*cache;
+volatile sig_atomic_t	stop;
+
+void	*serve(void *);
+int		render(int, struct morse *, struct morse_request *, char *);
+void	catch(int);
+void	usage();
+
+/*
+ * All life begins here...
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, fd, sfd;
+	long mbytes;
+	char *path;
+	pthread_t tid;
+	struct sockaddr_un sun;
+	struct sigaction sa;
+	struct morse_cache_stats stats;
+
+	opterr = 0;
+	mbytes = 64;
+	path = MORSE_SOCKET;
+	while ((i = getopt(argc, argv, "m:S:")) != EOF) {
+		switch (i) {
+		case 'm':
+			if ((mbytes = atol(optarg)) < 1) {
+				fprintf(stderr, "Cache size should be at least 1MB.\n");
+				usage();
+			}
+			break;
+
+		case 'S':
+			path = optarg;
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	}
+	if (optind != argc)
+		usage();
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "morse_server: socket path too long.\n");
+		exit(1);
+	}
+	if ((cache = morse_cache_init(mbytes * 1024 * 1024)) == NULL) {
+		fprintf(stderr, "?Error - morse_cache_init failed.\n");
+		exit(1);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+			bind(sfd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+			listen(sfd, 64) < 0) {
+		perror(path);
+		exit(1);
+	}
+	/*
+	 * No SA_RESTART, so that accept() gives up when we're told to stop.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = catch;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	while (!stop) {
+		if ((fd = accept(sfd, NULL, NULL)) < 0) {
+			if (errno != EINTR)
+				perror("morse_server: accept");
+			continue;
+		}
+		if (pthread_create(&tid, NULL, serve, (void *)(long )fd) != 0) {
+			perror("morse_server: pthread_create");
+			close(fd);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+	close(sfd);
+	unlink(path);
+	morse_cache_stats(cache, &stats);
+	printf("%lu hits, %lu misses (%.1f%% hit rate), %lu evictions.\n",
+				stats.hits, stats.misses,
+				stats.hits + stats.misses > 0 ?
+					100.0 * stats.hits / (stats.hits + stats.misses) : 0.0,
+				stats.evictions);
+	printf("%lu words cached, %.1f of %.1f MB.\n", stats.entries,
+				stats.bytes / 1048576.0, stats.max_bytes / 1048576.0);
+	exit(0);
+}
+
+/*
+ * Look after one client, until it goes away.
+ */
+void *
+serve(void *arg)
+{
+	int fd = (int )(long )arg;
+	char *text;
+	struct morse *mp;
+	struct morse_request req;
+	struct morse_reply rep;
+	struct morse_cache_stats stats;
+
+	text = NULL;
+	if ((mp = morse_init(18)) == NULL || (text = (char *)malloc(MORSE_MAX_TEXT + 1)) == NULL) {
+		fprintf(stderr, "morse_server: out of memory.\n");
+		morse_free(mp);
+		close(fd);
+		return(NULL);
+	}
+	while (_morse_read_all(fd, &req, sizeof(req)) == 0) {
+		rep.status = 0;
+		rep.nsamples = 0;
+		if (req.op == MORSE_REQ_RENDER) {
+			if (req.len < 0 || req.len > MORSE_MAX_TEXT ||
+					_morse_read_all(fd, text, req.len) < 0)
+				break;
+			text[req.len] = '\0';
+			if (render(fd, mp, &req, text) < 0)
+				break;
+			continue;
+		}
+		if (req.op == MORSE_REQ_STATS) {
+			morse_cache_stats(cache, &stats);
+			if (_morse_write_all(fd, &rep, sizeof(rep)) < 0 ||
+					_morse_write_all(fd, &stats, sizeof(stats)) < 0)
+				break;
+			continue;
+		}
+		rep.status = -1;
+		if (_morse_write_all(fd, &rep, sizeof(rep)) < 0)
+			break;
+	}
+	free(text);
+	morse_free(mp);
+	close(fd);
+	return(NULL);
+}
+
+/*
+ * Render a request and send it back. A bad request just gets an error
+ * reply. The parameters are only recomputed when they change, as that
+ * costs more than sending a cached word. Returns -1 if the client has
+ * gone away.
+ */
+int
+render(int fd, struct morse *mp, struct morse_request *rp, char *text)
+{
+	int err;
+	short *buf = NULL;
+	struct morse_reply rep;
+
+	rep.status = -1;
+	rep.nsamples = 0;
+	if (rp->sample_rate >= 4000 && rp->sample_rate <= 192000 &&
+			rp->tone_frequency > 0.0 && rp->tone_frequency < rp->sample_rate / 2 &&
+			rp->ramp_time >= 0.0 && rp->ramp_time <= 100.0) {
+		if (mp->wpm != rp->wpm || mp->farnsworth != rp->farnsworth ||
+				mp->amplitude != rp->amplitude || mp->sample_rate != rp->sample_rate ||
+				mp->tone_frequency != rp->tone_frequency || mp->ramp_time != rp->ramp_time) {
+			mp->wpm = rp->wpm;
+			mp->farnsworth = rp->farnsworth;
+			mp->amplitude = rp->amplitude;
+			mp->sample_rate = rp->sample_rate;
+			mp->tone_frequency = rp->tone_frequency;
+			mp->ramp_time = rp->ramp_time;
+			morse_calc_params(mp);
+		}
+		if (morse_duration(mp, text) <= MAX_SAMPLES &&
+				(rep.nsamples = morse_cache_render(cache, mp, text, &buf)) >= 0)
+			rep.status = 0;
+		else
+			rep.nsamples = 0;
+	}
+	err = _morse_write_all(fd, &rep, sizeof(rep));
+	if (err == 0 && rep.nsamples > 0)
+		err = _morse_write_all(fd, buf, rep.nsamples * sizeof(short));
+	free(buf);
+	return(err);
+}
+
+/*
+ * Time to stop.
+ */
+void
+catch(int sig)
+{
+	stop = 1;
+}
+
+/*
+ * Print a brief usage message and quit.
+ */
+void
+usage()
+{
+	fprintf(stderr, "Usage: morse_server [-m MB][-S PATH]\n");
+	fprintf(stderr, "\t-m MB\tSize of the word cache in megabytes.\n");
+	fprintf(stderr, "\t-S PATH\tThe socket to listen on.\n");
+	exit(2);
+}
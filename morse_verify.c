@@ -0,0 +1,992 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * A conformance test for the Morse timing. For every speed from 5 to 60
+ * WPM, with and without Farnsworth spacing, there are two cases:
+ *   chars      Every character in the Morse table, rendered on its own
+ *   paris      The word PARIS, over and over, sent through the raw file
+ *              backend, so the timing is corrected as it goes
+ *   decode     A short QSO, rendered and then decoded again, both with
+ *              and without telling the decoder the speed
+ *   parallel   The QSO over and over, rendered in parallel with the
+ *              timing kept exact, and sent through the raw file backend
+ * and, once at the end:
+ *   skim       A small pileup, mixed and then skimmed
+ *
+ * The key-down and key-up runs are measured from the samples themselves,
+ * and each one is checked against the timing in the ARRL paper (see
+ * params.c), worked out here from scratch: the dits, dahs and the gaps
+ * inside a character, and the gaps between characters and words. The
+ * very start and end of each tone are so quiet that a sample or two can
+ * come out as zero, and a dah is three dits rounded to whole samples, so
+ * each run is allowed a few samples either way: four, and one more for
+ * every 10kHz of the sample rate, as the ramps are that much longer.
+ * The speed over the whole run of PARIS (from the start of the first word
+ * to the start of the last) is checked to within the same few samples.
+ * The decode case has to give back the text it was given, word spaces and
+ * all. The parallel render has to be the same as what was sent, sample
+ * for sample, at every speed, even where the elements and gaps aren't
+ * whole numbers of samples. The skim case has to find every call in the
+ * pileup within a channel or two of where it was sent, and no text at all
+ * anywhere else. There's no decoder (or threads) in the fixed-point
+ * build, so all three are left out.
+ *
+ * Each case also gets two checksums: one of the keying (where the key goes
+ * down and for how long, and the length of the stream), and one of the
+ * audio itself. The keying is the same on every machine, and in the
+ * fixed-point build. The audio depends on the build and the vector
+ * kernels in use, which are named in the first line of the results, so
+ * the audio checksums of an earlier run are only checked if it used the
+ * same ones. "make verify" uses the scalar kernels, so that verify.golden
+ * pins the audio as well as the keying. A "-" in place of a checksum
+ * isn't checked.
+ *
+ * To compare the fixed-point build with the normal one, the normal build
+ * writes out the samples of every chars and paris case (-w), and the
+ * fixed-point build reads them back (-c) and checks that none of its own
+ * are out by more than a few counts: four, by default, as the worst seen
+ * is three (see audio.c). There are far too many samples to keep, so
+ * "make verify-fixed" pipes them straight from one to the other.
+ *
+ * The results are written as tab-separated columns, with a header line,
+ * and the exit status is non-zero if anything failed.
+ *
+ * The command-line options are as follows:
+ *   -b FILE    Check the checksums against an earlier set of results
+ *   -c FILE    Compare the samples with the ones in this file ("-" for
+ *              the standard input)
+ *   -d NN      How many counts a sample can be out by, with -c
+ *   -n NN      How many times to send PARIS (default 10)
+ *   -R RATE    Sample rate (default 44100)
+ *   -t NN      How many samples a run can be out by
+ *   -v         Print every run which is out, not just the first
+ *   -w FILE    Write the samples to this file
+ *
+ * Try:
+ *   make verify > before.tsv
+ *   (change something)
+ *   make verify VERIFY_FLAGS="-b before.tsv"
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libmorse.h"
+
+#define RUN_DIT			0
+#define RUN_DAH			1
+#define RUN_GAP			2
+#define RUN_CGAP		3
+#define RUN_WGAP		4
+
+#define MAX_BASELINE	512
+
+#define DECODE_TEXT		"CQ CQ DE EI4HRB EI4HRB PSE K"
+
+#define SKIM_CALLS		3
+#define SKIM_NEAR		50.0
+
+struct	run	{
+	int				kind;
+	int				start;
+	int				len;
+};
+
+struct	runs	{
+	struct run		*run;
+	int				nruns;
+	int				size;
+};
+
+struct	baseline	{
+	char			key[64];
+	char			keysum[16];
+	char			pcmsum[16];
+};
+
+struct	station	{
+	double			frequency;
+	int				wpm;
+	int				amplitude;
+	double			start;
+	const char		*call;
+};
+
+struct	result	{
+	double			worst;
+	double			wpm;
+	unsigned int	keysum;
+	unsigned int	pcmsum;
+	int				pcmdiff;
+	int				failed;
+};
+
+void	verify_chars(struct morse *, struct result *);
+void	verify_paris(struct morse *, struct result *);
+void	verify_decode(struct morse *, struct result *);
+void	verify_parallel(struct morse *, struct result *);
+int		stream(struct morse *, const char *, short **);
+void	verify_skim(struct result *);
+void	compare(const short *, int, struct result *);
+void	check(struct morse *, struct runs *, struct runs *, const char *, struct result *);
+void	expect(struct runs *, const char *);
+void	measure(struct morse *, struct runs *, const short *, int);
+void	add_run(struct runs *, int, int, int);
+double	arrl(struct morse *, int);
+void	report(const char *, int, int, struct result *);
+unsigned int hash(unsigned int, const void *, int);
+void	load(const char *);
+void	usage();
+
+const char *kinds[] = {"dit", "dah", "gap", "character gap", "word gap"};
+
+int				nbase = 0;
+char			kernels[32];
+char			base_kernels[32];
+int				rate = 44100;
+int				words = 10;
+int				tolerance = -1;
+int				verbose = 0;
+int				failures = 0;
+int				max_diff = 4;
+int				worst_diff = 0;
+FILE			*pcm_in = NULL;
+FILE			*pcm_out = NULL;
+struct baseline	base[MAX_BASELINE];
+
+/*
+ * The pileup for the skim case. The stations are close together, at
+ * different strengths, and they overlap.
+ */
+struct station	stations[] = {
+	{ 520.0, 22, 80, 0.3, "EI4HRB"},
+	{ 640.0, 31, 45, 0.0, "DL1ABC"},
+	{ 890.0, 18, 100, 1.1, "K1XYZ"},
+	{ 985.0, 27, 35, 0.8, "VE3RZ"},
+	{1230.0, 26, 60, 0.6, "JA3QRP"},
+	{1580.0, 35, 40, 0.2, "VK2DX"},
+	{2210.0, 28, 90, 1.5, "G4FOO"},
+};
+
+/*
+ * All life begins here...
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, wpm, fw;
+	char *basefile;
+	struct morse *mp;
+	struct result res;
+
+	opterr = 0;
+	basefile = NULL;
+	while ((i = getopt(argc, argv, "b:c:d:n:R:t:vw:")) != EOF) {
+		switch (i) {
+		case 'b':
+			basefile = optarg;
+			break;
+
+		case 'c':
+			if (strcmp(optarg, "-") == 0)
+				pcm_in = stdin;
+			else if ((pcm_in = fopen(optarg, "r")) == NULL) {
+				perror(optarg);
+				exit(1);
+			}
+			break;
+
+		case 'd':
+			if ((max_diff = atoi(optarg)) < 0) {
+				fprintf(stderr, "Difference can't be negative.\n");
+				usage();
+			}
+			break;
+
+		case 'n':
+			if ((words = atoi(optarg)) < 2 || words > 1000) {
+				fprintf(stderr, "Number of words should be between 2 and 1000.\n");
+				usage();
+			}
+			break;
+
+		case 'R':
+			if ((rate = atoi(optarg)) < 4000 || rate > 192000) {
+				fprintf(stderr, "Sample rate should be between 4000 and 192000.\n");
+				usage();
+			}
+			break;
+
+		case 't':
+			if ((tolerance = atoi(optarg)) < 0) {
+				fprintf(stderr, "Tolerance can't be negative.\n");
+				usage();
+			}
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case 'w':
+			if ((pcm_out = fopen(optarg, "w")) == NULL) {
+				perror(optarg);
+				exit(1);
+			}
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	}
+	if (optind != argc)
+		usage();
+#ifdef MORSE_FIXED
+	strcpy(kernels, "fixed point");
+#else
+	snprintf(kernels, sizeof(kernels), "%s kernels", morse_simd_select()->name);
+#endif
+	if (basefile != NULL)
+		load(basefile);
+	if (tolerance < 0)
+		tolerance = 4 + rate / 10000;
+	printf("# libmorse conformance, %s, %d words of PARIS, %d samples either way\n",
+					kernels, words, tolerance);
+	if (nbase > 0 && strcmp(base_kernels, kernels) != 0)
+		printf("# the audio isn't checked, as %s used %s\n",
+					basefile, base_kernels[0] ? base_kernels : "something else");
+	printf("case\twpm\tfw\trate\tworst\teffective_wpm\tkeysum\tpcmsum\tresult\n");
+	for (fw = 0; fw < 2; fw++) {
+		for (wpm = 5; wpm <= 60; wpm++) {
+			if ((mp = morse_init(wpm)) == NULL) {
+				fprintf(stderr, "?Error - morse_init failed.\n");
+				exit(1);
+			}
+			mp->farnsworth = fw;
+			mp->sample_rate = rate;
+			morse_calc_params(mp);
+			verify_chars(mp, &res);
+			report("chars", wpm, fw, &res);
+			verify_paris(mp, &res);
+			report("paris", wpm, fw, &res);
+#ifndef MORSE_FIXED
+			verify_decode(mp, &res);
+			report("decode", wpm, fw, &res);
+			verify_parallel(mp, &res);
+			report("parallel", wpm, fw, &res);
+#endif
+			morse_free(mp);
+		}
+	}
+#ifndef MORSE_FIXED
+	verify_skim(&res);
+	report("skim", 0, 0, &res);
+#endif
+	if (pcm_in != NULL) {
+		if (getc(pcm_in) != EOF) {
+			printf("# there are more samples to compare than were made\n");
+			failures++;
+		}
+		printf("# samples out by at most %d (%d allowed)\n", worst_diff, max_diff);
+	}
+	if (pcm_out != NULL && fclose(pcm_out) == EOF) {
+		fprintf(stderr, "?Error - can't write the samples.\n");
+		exit(1);
+	}
+	printf("# %d failures\n", failures);
+	exit(failures > 0 ? 1 : 0);
+}
+
+/*
+ * Render each character in the Morse table on its own, and check the
+ * elements and the gaps between them.
+ */
+void
+verify_chars(struct morse *mp, struct result *rp)
+{
+	int i, ch, n, nkeys;
+	char str[2], label[4];
+	short *buf;
+	struct morse_key *keys;
+	struct runs want, got;
+
+	memset((char *)rp, 0, sizeof(struct result));
+	rp->wpm = -1.0;
+	memset((char *)&want, 0, sizeof(struct runs));
+	memset((char *)&got, 0, sizeof(struct runs));
+	for (ch = 1; ch < 128; ch++) {
+		if (morse_table[ch] == 0)
+			continue;
+		str[0] = ch;
+		str[1] = '\0';
+		if (ch < ' ')
+			snprintf(label, sizeof(label), "^%c", ch + '@');
+		else
+			strcpy(label, str);
+		if ((n = morse_render_alloc(mp, str, &buf)) <= 0 ||
+				(nkeys = morse_render_keys(mp, str, &keys)) < 0) {
+			fprintf(stderr, "?Error - can't render character %d.\n", ch);
+			exit(1);
+		}
+		for (i = 0; i < nkeys; i++) {
+			rp->keysum = hash(rp->keysum, &keys[i].start, sizeof(keys[i].start));
+			rp->keysum = hash(rp->keysum, &keys[i].len, sizeof(keys[i].len));
+		}
+		rp->pcmsum = hash(rp->pcmsum, buf, n * sizeof(short));
+		compare(buf, n, rp);
+		want.nruns = got.nruns = 0;
+		expect(&want, str);
+		measure(mp, &got, buf, n);
+		check(mp, &want, &got, label, rp);
+		free(keys);
+		free(buf);
+	}
+	free(want.run);
+	free(got.run);
+}
+
+/*
+ * Send PARIS (and one more, so that the last word has a start) through
+ * the raw backend into a scratch file, and read it back. As well as the
+ * runs, check the speed from the start of the first word to the start of
+ * the last one.
+ */
+void
+verify_paris(struct morse *mp, struct result *rp)
+{
+	int i, n;
+	char *text;
+	short *buf;
+	struct runs want, got;
+	double want_len, got_len;
+
+	memset((char *)rp, 0, sizeof(struct result));
+	memset((char *)&want, 0, sizeof(struct runs));
+	memset((char *)&got, 0, sizeof(struct runs));
+	if ((text = (char *)malloc((words + 1) * 6)) == NULL) {
+		perror("morse_verify: malloc");
+		exit(1);
+	}
+	for (text[0] = '\0', i = 0; i <= words; i++)
+		strcat(text, "PARIS ");
+	n = stream(mp, text, &buf);
+	free(text);
+	rp->keysum = hash(0, &n, sizeof(n));
+	rp->pcmsum = hash(0, buf, n * sizeof(short));
+	compare(buf, n, rp);
+	for (i = 0; i <= words; i++)
+		expect(&want, i < words ? "PARIS " : "PARIS");
+	measure(mp, &got, buf, n);
+	check(mp, &want, &got, "PARIS", rp);
+	if (want.nruns == got.nruns) {
+		/*
+		 * Each word of PARIS is the same number of runs.
+		 */
+		i = (want.nruns + 1) / (words + 1);
+		want_len = (double )words * 60.0 * (double )rate / (double )mp->wpm;
+		got_len = (double )(got.run[i * words].start - got.run[0].start);
+		rp->wpm = (double )words * 60.0 * (double )rate / got_len;
+		if (fabs(got_len - want_len) > (double )tolerance) {
+			printf("# %d WPM%s: %d words of PARIS took %.0f samples, not %.1f\n",
+					mp->wpm, mp->farnsworth ? " (Farnsworth)" : "",
+					words, got_len, want_len);
+			rp->failed = 1;
+		}
+	}
+	free(want.run);
+	free(got.run);
+	free(buf);
+}
+
+#ifndef MORSE_FIXED
+/*
+ * Render a few words, and decode them again. The first gap between
+ * characters is the one most likely to be mistaken for a word space with
+ * Farnsworth spacing, so the text starts with a two-letter word. The
+ * keying checksum is of the text which came back (which has to match).
+ */
+void
+verify_decode(struct morse *mp, struct result *rp)
+{
+	int n, len, hint;
+	char text[256];
+	short *buf;
+	struct morse_decoder *dp;
+
+	memset((char *)rp, 0, sizeof(struct result));
+	rp->wpm = -1.0;
+	if ((n = morse_render_alloc(mp, DECODE_TEXT, &buf)) <= 0) {
+		fprintf(stderr, "?Error - can't render the decode text.\n");
+		exit(1);
+	}
+	rp->pcmsum = hash(0, buf, n * sizeof(short));
+	for (hint = 0; hint < 2; hint++) {
+		if ((dp = morse_decode_init(rate, mp->tone_frequency)) == NULL) {
+			fprintf(stderr, "?Error - morse_decode_init failed.\n");
+			exit(1);
+		}
+		if (hint)
+			morse_decode_speed(dp, mp->wpm);
+		len = morse_decode(dp, buf, n, text, sizeof(text) - 1);
+		len += morse_decode_flush(dp, text + len, sizeof(text) - 1 - len);
+		morse_decode_free(dp);
+		while (len > 0 && text[len - 1] == ' ')
+			len--;
+		text[len] = '\0';
+		rp->keysum = hash(rp->keysum, text, len);
+		if (strcmp(text, DECODE_TEXT) != 0) {
+			printf("# %d WPM%s: decoded \"%s\"%s\n", mp->wpm,
+					mp->farnsworth ? " (Farnsworth)" : "",
+					text, hint ? " with the speed given" : "");
+			rp->failed = 1;
+		}
+	}
+	free(buf);
+}
+
+/*
+ * Render the QSO over and over (enough words for more than one thread to
+ * get some) in parallel, with the timing kept exact, and check that it's
+ * the same as sending it. The duration should be exact as well.
+ */
+void
+verify_parallel(struct morse *mp, struct result *rp)
+{
+	int i, n, len;
+	char *text;
+	short *buf, *sent;
+
+	memset((char *)rp, 0, sizeof(struct result));
+	rp->wpm = -1.0;
+	if ((text = (char *)malloc(words * (sizeof(DECODE_TEXT) + 1))) == NULL) {
+		perror("morse_verify: malloc");
+		exit(1);
+	}
+	for (text[0] = '\0', i = 0; i < words; i++) {
+		strcat(text, DECODE_TEXT);
+		strcat(text, " ");
+	}
+	len = stream(mp, text, &sent);
+	mp->exact_render = 1;
+	if ((n = morse_render_parallel(mp, text, strlen(text), &buf, 4)) < 0) {
+		fprintf(stderr, "?Error - morse_render_parallel failed.\n");
+		exit(1);
+	}
+	if (morse_duration(mp, text) != len) {
+		printf("# %d WPM%s: the duration is %llu samples, not %d\n",
+					mp->wpm, mp->farnsworth ? " (Farnsworth)" : "",
+					morse_duration(mp, text), len);
+		rp->failed = 1;
+	}
+	mp->exact_render = 0;
+	rp->keysum = hash(0, &n, sizeof(n));
+	rp->pcmsum = hash(0, buf, n * sizeof(short));
+	if (n != len) {
+		printf("# %d WPM%s: the parallel render is %d samples, not %d\n",
+					mp->wpm, mp->farnsworth ? " (Farnsworth)" : "", n, len);
+		rp->failed = 1;
+	} else {
+		for (i = 0; i < n && buf[i] == sent[i]; i++)
+			;
+		if (i < n) {
+			printf("# %d WPM%s: the parallel render is out at sample %d\n",
+					mp->wpm, mp->farnsworth ? " (Farnsworth)" : "", i);
+			rp->failed = 1;
+		}
+	}
+	free(sent);
+	free(buf);
+	free(text);
+}
+
+/*
+ * Mix a small pileup, and skim it. Every call has to turn up on a
+ * channel near its station, and there must be no text at all on any
+ * channel which isn't. The keying checksum is of the text which came
+ * back, channel by channel.
+ */
+void
+verify_skim(struct result *rp)
+{
+	int i, j, n, nstations, *len;
+	char text[256], **found;
+	short samples[4096];
+	float mix[4096];
+	struct morse *mp[sizeof(stations) / sizeof(stations[0])];
+	struct morse_mixer *xp;
+	struct morse_skimmer *sp;
+	struct station *stp;
+
+	memset((char *)rp, 0, sizeof(struct result));
+	rp->wpm = -1.0;
+	nstations = sizeof(stations) / sizeof(stations[0]);
+	if ((xp = morse_mix_init(rate)) == NULL ||
+				(sp = morse_skim_init(rate, 300.0, 3300.0)) == NULL) {
+		fprintf(stderr, "?Error - can't set up the pileup.\n");
+		exit(1);
+	}
+	xp->gain = 4.0 / (nstations + 3);
+	for (i = 0; i < nstations; i++) {
+		stp = &stations[i];
+		if ((mp[i] = morse_init(stp->wpm)) == NULL) {
+			fprintf(stderr, "?Error - morse_init failed.\n");
+			exit(1);
+		}
+		mp[i]->tone_frequency = stp->frequency;
+		mp[i]->amplitude = stp->amplitude;
+		mp[i]->sample_rate = rate;
+		morse_calc_params(mp[i]);
+		for (text[0] = '\0', j = 0; j < SKIM_CALLS; j++) {
+			strcat(text, stp->call);
+			strcat(text, " ");
+		}
+		if (morse_mix_add(xp, mp[i], text, stp->start) < 0) {
+			fprintf(stderr, "?Error - morse_mix_add failed.\n");
+			exit(1);
+		}
+	}
+	found = (char **)calloc(sp->nchannels, sizeof(char *));
+	len = (int *)calloc(sp->nchannels, sizeof(int));
+	if (found == NULL || len == NULL) {
+		perror("morse_verify: calloc");
+		exit(1);
+	}
+	/*
+	 * Follow the mix with a second of silence, so that the last
+	 * characters on every channel come out.
+	 */
+	for (j = rate; ; ) {
+		if ((n = morse_mix_render(xp, mix, 4096)) > 0) {
+			for (i = 0; i < n; i++)
+				samples[i] = mix[i] > 32767.0f ? 32767 :
+							mix[i] < -32768.0f ? -32768 : (short )mix[i];
+			rp->pcmsum = hash(rp->pcmsum, samples, n * sizeof(short));
+		} else if (j > 0) {
+			n = j < 4096 ? j : 4096;
+			memset((char *)samples, 0, n * sizeof(short));
+			j -= n;
+		} else
+			break;
+		morse_skim(sp, samples, n);
+		for (i = 0; i < sp->nchannels; i++) {
+			if (sp->channel[i].ntext == 0)
+				continue;
+			if ((found[i] = (char *)realloc(found[i], len[i] + MORSE_SKIM_TEXT + 1)) == NULL) {
+				perror("morse_verify: realloc");
+				exit(1);
+			}
+			len[i] += morse_skim_read(sp, i, found[i] + len[i], MORSE_SKIM_TEXT);
+			found[i][len[i]] = '\0';
+		}
+	}
+	for (i = 0; i < sp->nchannels; i++) {
+		if (len[i] == 0)
+			continue;
+		rp->keysum = hash(rp->keysum, &i, sizeof(i));
+		rp->keysum = hash(rp->keysum, found[i], len[i]);
+		for (j = 0; j < nstations; j++)
+			if (fabs(sp->channel[i].frequency - stations[j].frequency) < SKIM_NEAR)
+				break;
+		if (j == nstations) {
+			printf("# skim: \"%s\" at %.1fHz, where there's nobody\n",
+						found[i], sp->channel[i].frequency);
+			rp->failed = 1;
+		}
+	}
+	for (j = 0; j < nstations; j++) {
+		stp = &stations[j];
+		for (i = 0; i < sp->nchannels; i++)
+			if (len[i] > 0 && fabs(sp->channel[i].frequency - stp->frequency) < SKIM_NEAR &&
+							strstr(found[i], stp->call) != NULL)
+				break;
+		if (i == sp->nchannels) {
+			printf("# skim: didn't find %s at %.0fHz\n", stp->call, stp->frequency);
+			rp->failed = 1;
+		}
+		morse_free(mp[j]);
+	}
+	for (i = 0; i < sp->nchannels; i++)
+		free(found[i]);
+	free(found);
+	free(len);
+	morse_skim_free(sp);
+	morse_mix_free(xp);
+}
+#endif
+
+/*
+ * Send some text through the raw backend into a scratch file, and read
+ * it back. Returns the number of samples.
+ */
+int
+stream(struct morse *mp, const char *strp, short **bufp)
+{
+	int fd, size;
+	char tmpname[64];
+	short *buf;
+	FILE *fp;
+
+	strcpy(tmpname, "/tmp/morse_verifyXXXXXX");
+	if ((fd = mkstemp(tmpname)) < 0) {
+		perror(tmpname);
+		exit(1);
+	}
+	close(fd);
+	if (morse_open(mp, "raw", tmpname) < 0) {
+		fprintf(stderr, "?Error - can't open the raw backend.\n");
+		exit(1);
+	}
+	morse_send_string(mp, strp);
+	if (morse_drain(mp) < 0) {
+		fprintf(stderr, "?Error - audio output failed.\n");
+		exit(1);
+	}
+	morse_close(mp);
+	if ((fp = fopen(tmpname, "r")) == NULL) {
+		perror(tmpname);
+		exit(1);
+	}
+	fseek(fp, 0L, SEEK_END);
+	size = (int )ftell(fp);
+	rewind(fp);
+	if ((buf = (short *)malloc(size + 1)) == NULL ||
+				fread(buf, 1, size, fp) != size) {
+		fprintf(stderr, "?Error - can't read back %s.\n", tmpname);
+		exit(1);
+	}
+	fclose(fp);
+	unlink(tmpname);
+	morse_le16(buf, size / sizeof(short));
+	*bufp = buf;
+	return(size / sizeof(short));
+}
+
+/*
+ * Write out the samples of a case (with -w), or compare them with the
+ * ones which were written out by another build (with -c).
+ */
+void
+compare(const short *buf, int n, struct result *rp)
+{
+	int i, k, diff;
+	short in[1024];
+
+	if (pcm_out != NULL && fwrite(buf, sizeof(short), n, pcm_out) != n) {
+		fprintf(stderr, "?Error - can't write the samples.\n");
+		exit(1);
+	}
+	if (pcm_in == NULL)
+		return;
+	for (; n > 0; buf += k, n -= k) {
+		if ((k = n) > 1024)
+			k = 1024;
+		if (fread(in, sizeof(short), k, pcm_in) != k) {
+			printf("# ran out of samples to compare\n");
+			rp->failed = 1;
+			pcm_in = NULL;
+			return;
+		}
+		for (i = 0; i < k; i++) {
+			if ((diff = abs(buf[i] - in[i])) > rp->pcmdiff)
+				rp->pcmdiff = diff;
+		}
+	}
+	if (rp->pcmdiff > worst_diff)
+		worst_diff = rp->pcmdiff;
+}
+
+/*
+ * Compare the runs which were measured with the ones which were wanted,
+ * and note the worst difference.
+ */
+void
+check(struct morse *mp, struct runs *want, struct runs *got, const char *str, struct result *rp)
+{
+	int i, worst = 0;
+	double d, exact;
+
+	if (want->nruns != got->nruns) {
+		printf("# %d WPM%s: \"%s\" came out as %d runs, not %d\n",
+				mp->wpm, mp->farnsworth ? " (Farnsworth)" : "",
+				str, got->nruns, want->nruns);
+		rp->failed = 1;
+		return;
+	}
+	for (i = 0; i < want->nruns; i++) {
+		exact = arrl(mp, want->run[i].kind);
+		d = fabs((double )got->run[i].len - exact);
+		if (d > rp->worst)
+			rp->worst = d;
+		if (d <= (double )tolerance)
+			continue;
+		if (verbose || worst == 0)
+			printf("# %d WPM%s: \"%s\" run %d (a %s) is %d samples, not %.1f\n",
+					mp->wpm, mp->farnsworth ? " (Farnsworth)" : "",
+					str, i, kinds[want->run[i].kind],
+					got->run[i].len, exact);
+		worst = 1;
+		rp->failed = 1;
+	}
+}
+
+/*
+ * Work out the runs for a string of text, straight from the Morse table.
+ * The lengths are filled in later (see arrl()). A space is a word gap.
+ */
+void
+expect(struct runs *rp, const char *strp)
+{
+	int nsyms, bitreg;
+
+	for (; *strp != '\0'; strp++) {
+		if (*strp == ' ') {
+			rp->run[rp->nruns - 1].kind = RUN_WGAP;
+			continue;
+		}
+		bitreg = morse_table[*strp & 0x7f];
+		if ((nsyms = (bitreg >> 6) & 07) == 0)
+			nsyms = 8;
+		bitreg &= 077;
+		while (nsyms-- > 0) {
+			add_run(rp, (bitreg & 01) ? RUN_DAH : RUN_DIT, 0, 0);
+			add_run(rp, RUN_GAP, 0, 0);
+			bitreg >>= 1;
+		}
+		rp->run[rp->nruns - 1].kind = RUN_CGAP;
+	}
+	/*
+	 * Nothing is sent after the last element.
+	 */
+	if (rp->nruns > 0 && strp[-1] != ' ')
+		rp->nruns--;
+}
+
+/*
+ * Measure the runs in a block of audio. The key is down from the first
+ * sample which isn't zero, and stays down until there's been silence for
+ * more than half a cycle of the tone (a sample can be zero anywhere the
+ * carrier crosses zero).
+ */
+void
+measure(struct morse *mp, struct runs *rp, const short *buf, int n)
+{
+	int i, on, last, quiet;
+
+	quiet = rate / ((int )mp->tone_frequency * 2) + 1;
+	for (on = last = -1, i = 0; i < n; i++) {
+		if (buf[i] == 0) {
+			if (on >= 0 && i - last > quiet) {
+				add_run(rp, RUN_DIT, on, last + 1 - on);
+				on = -1;
+			}
+			continue;
+		}
+		if (on < 0) {
+			if (last >= 0)
+				add_run(rp, RUN_GAP, last + 1, i - last - 1);
+			on = i;
+		}
+		last = i;
+	}
+	if (on >= 0)
+		add_run(rp, RUN_DIT, on, last + 1 - on);
+}
+
+/*
+ * Add a run to a list of them.
+ */
+void
+add_run(struct runs *rp, int kind, int start, int len)
+{
+	if (rp->nruns >= rp->size) {
+		rp->size = rp->size > 0 ? rp->size * 2 : 64;
+		if ((rp->run = (struct run *)realloc(rp->run, rp->size * sizeof(struct run))) == NULL) {
+			perror("morse_verify: realloc");
+			exit(1);
+		}
+	}
+	rp->run[rp->nruns].kind = kind;
+	rp->run[rp->nruns].start = start;
+	rp->run[rp->nruns].len = len;
+	rp->nruns++;
+}
+
+/*
+ * The exact length of a run, in samples, from the ARRL paper. An element
+ * is 1.2/WPM seconds. With Farnsworth spacing below 18WPM, the elements
+ * go at 18WPM, and the gaps between characters and words are stretched
+ * so that PARIS (31 elements of its own, and 19 of gaps) still takes a
+ * minute divided by the speed.
+ */
+double
+arrl(struct morse *mp, int kind)
+{
+	double element, gap;
+
+	if (mp->farnsworth && mp->wpm < 18) {
+		element = 1.2 / 18.0;
+		gap = (60.0 / (double )mp->wpm - 31.0 * element) / 19.0;
+	} else
+		element = gap = 1.2 / (double )mp->wpm;
+	switch (kind) {
+	case RUN_DAH:
+		return((double )rate * element * 3.0);
+
+	case RUN_CGAP:
+		return((double )rate * gap * 3.0);
+
+	case RUN_WGAP:
+		return((double )rate * gap * 7.0);
+
+	default:
+		return((double )rate * element);
+	}
+}
+
+/*
+ * Print the result of a case, and check it against the baseline (if
+ * there is one).
+ */
+void
+report(const char *name, int wpm, int fw, struct result *rp)
+{
+	int i;
+	char key[64], keysum[16], pcmsum[16];
+
+	snprintf(key, sizeof(key), "%s\t%d\t%d\t%d", name, wpm, fw, rate);
+	snprintf(keysum, sizeof(keysum), "%08x", rp->keysum);
+	snprintf(pcmsum, sizeof(pcmsum), "%08x", rp->pcmsum);
+	for (i = 0; i < nbase; i++)
+		if (strcmp(base[i].key, key) == 0)
+			break;
+	if (i < nbase && strcmp(base[i].keysum, "-") != 0 && strcmp(base[i].keysum, keysum) != 0) {
+		printf("# %s: the keying has changed\n", key);
+		rp->failed = 1;
+	}
+	if (i < nbase && strcmp(base_kernels, kernels) == 0 &&
+			strcmp(base[i].pcmsum, "-") != 0 && strcmp(base[i].pcmsum, pcmsum) != 0) {
+		printf("# %s: the audio has changed\n", key);
+		rp->failed = 1;
+	}
+	if (rp->pcmdiff > max_diff) {
+		printf("# %s: a sample is out by %d\n", key, rp->pcmdiff);
+		rp->failed = 1;
+	}
+	printf("%s\t%.1f\t", key, rp->worst);
+	if (rp->wpm > 0.0)
+		printf("%.3f", rp->wpm);
+	else
+		printf("-");
+	printf("\t%s\t%s\t%s\n", keysum, pcmsum, rp->failed ? "FAIL" : "ok");
+	fflush(stdout);
+	if (rp->failed)
+		failures++;
+}
+
+/*
+ * The FNV-1a hash of a block of memory, carrying on from "h" (which is
+ * zero to start). The samples and keys are in native byte order, so the
+ * checksums are only the same between machines of the same kind.
+ */
+unsigned int
+hash(unsigned int h, const void *p, int len)
+{
+	const unsigned char *cp = (const unsigned char *)p;
+
+	if (h == 0)
+		h = 2166136261U;
+	while (len-- > 0)
+		h = (h ^ *cp++) * 16777619U;
+	return(h);
+}
+
+/*
+ * Load the results of an earlier run. The key is the first four columns,
+ * and the checksums are the seventh and eighth. The kernels it used are
+ * in the first line.
+ */
+void
+load(const char *file)
+{
+	char line[256], *col[9], *cp;
+	int n;
+	FILE *fp;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		perror(file);
+		exit(1);
+	}
+	base_kernels[0] = '\0';
+	while (nbase < MAX_BASELINE && fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "# libmorse conformance, ", 24) == 0) {
+			for (n = 0, cp = line + 24; n < sizeof(base_kernels) - 1 &&
+						*cp != ',' && *cp != '\0'; n++)
+				base_kernels[n] = *cp++;
+			base_kernels[n] = '\0';
+		}
+		if (line[0] == '#' || strncmp(line, "case\t", 5) == 0)
+			continue;
+		for (n = 0, cp = line; n < 9 && (col[n] = strsep(&cp, "\t\n")) != NULL; n++)
+			;
+		if (n < 8)
+			continue;
+		snprintf(base[nbase].key, sizeof(base[0].key), "%s\t%s\t%s\t%s",
+						col[0], col[1], col[2], col[3]);
+		snprintf(base[nbase].keysum, sizeof(base[0].keysum), "%s", col[6]);
+		snprintf(base[nbase].pcmsum, sizeof(base[0].pcmsum), "%s", col[7]);
+		nbase++;
+	}
+	fclose(fp);
+}
+
+/*
+ * Print a brief usage message and quit.
+ */
+void
+usage()
+{
+	fprintf(stderr, "Usage: morse_verify [-b FILE][-c FILE][-d NN][-n NN][-R RATE][-t NN][-v][-w FILE]\n");
+	fprintf(stderr, "\t-b FILE\tCheck the checksums against an earlier set of results.\n");
+	fprintf(stderr, "\t-c FILE\tCompare the samples with the ones in FILE.\n");
+	fprintf(stderr, "\t-d NN\tHow many counts a sample can be out by, with -c.\n");
+	fprintf(stderr, "\t-n NN\tHow many times to send PARIS.\n");
+	fprintf(stderr, "\t-R RATE\tSample rate.\n");
+	fprintf(stderr, "\t-t NN\tHow many samples a run can be out by.\n");
+	fprintf(stderr, "\t-v\tPrint every run which is out, not just the first.\n");
+	fprintf(stderr, "\t-w FILE\tWrite the samples to FILE.\n");
+	exit(2);
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Generate a copying exercise: a run of words picked at random from a
+ * dictionary, using only certain characters (such as those learned so
+ * far with the Koch method), and send them. The words are listed at the
+ * end, for checking what was copied.
+ *
+ * The command-line options are as follows:
+ *   -C FILE    Keep the index of the word list in this file (the default
+ *              is in ~/.cache)
+ *   -c CHARS   Only use words made up of these characters
+ *   -f WPM     Invoke "Farnsworth" mode
+ *   -k LESSON  Only use the characters of this Koch lesson and before
+ *   -l MIN-MAX The range of word lengths (default 5)
+ *   -n NN      The number of words (default 20)
+ *   -o FILE    Write to a file (.wav or raw PCM) rather than the soundcard
+ *   -p         Just print the words, don't send them
+ *   -S SEED    Seed for the random number generator
+ *   -s WPM     Set the WPM (a number between 5 and 60)
+ *   -v         Say how many words there were to choose from, and how
+ *              long the word list took to load
+ *   -w FILE    The word list (default /usr/share/dict/words)
+ *
+ * Try:
+ *   ./morse_words -k 12 -l 3-6 -s 20
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libmorse.h"
+
+double	now();
+void	usage();
+
+/*
+ * All life begins here...
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, n, len, nwords, min_len, max_len, wpm, fw, print, verbose;
+	unsigned long long charset;
+	char *cp, *wordfile, *cachefile, *backend, *outfile;
+	const char *word;
+	double start, elapsed;
+	FILE *fp;
+	struct morse *mp;
+	struct morse_words *wp;
+	struct morse_wordsel *sp;
+
+	opterr = fw = print = verbose = 0;
+	nwords = 20;
+	min_len = max_len = 5;
+	wpm = 18;
+	charset = MORSE_CHARSET_ALL;
+	wordfile = "/usr/share/dict/words";
+	cachefile = backend = outfile = NULL;
+	srandom(time(NULL));
+	while ((i = getopt(argc, argv, "C:c:f:k:l:n:o:pS:s:vw:")) != EOF) {
+		switch (i) {
+		case 'C':
+			cachefile = optarg;
+			break;
+
+		case 'c':
+			charset = morse_charset(optarg);
+			break;
+
+		case 'f':
+			fw = 1;
+			if ((wpm = atoi(optarg)) < 5 || wpm > 60) {
+				fprintf(stderr, "WPM value should be between 5 and 60.\n");
+				usage();
+			}
+			break;
+
+		case 'k':
+			if ((n = atoi(optarg)) < 1 || n >= (int )strlen(MORSE_KOCH_ORDER)) {
+				fprintf(stderr, "Koch lesson should be between 1 and %d.\n",
+								(int )strlen(MORSE_KOCH_ORDER) - 1);
+				usage();
+			}
+			charset = morse_koch_charset(n);
+			break;
+
+		case 'l':
+			min_len = max_len = atoi(optarg);
+			if ((cp = strchr(optarg, '-')) != NULL)
+				max_len = atoi(cp + 1);
+			if (min_len < 1 || min_len > max_len) {
+				fprintf(stderr, "Word lengths should be MIN-MAX, at least one.\n");
+				usage();
+			}
+			break;
+
+		case 'n':
+			if ((nwords = atoi(optarg)) < 1) {
+				fprintf(stderr, "Need at least one word.\n");
+				usage();
+			}
+			break;
+
+		case 'o':
+			outfile = optarg;
+			len = strlen(outfile);
+			if (len > 4 && strcmp(outfile + len - 4, ".wav") == 0)
+				backend = "wav";
+			else
+				backend = "raw";
+			break;
+
+		case 'p':
+			print = 1;
+			break;
+
+		case 'S':
+			srandom(atoi(optarg));
+			break;
+
+		case 's':
+			fw = 0;
+			if ((wpm = atoi(optarg)) < 5 || wpm > 60) {
+				fprintf(stderr, "WPM value should be between 5 and 60.\n");
+				usage();
+			}
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case 'w':
+			wordfile = optarg;
+			break;
+
+		default:
+			usage();
+			break;
+		}
+	}
+	if (optind != argc)
+		usage();
+	/*
+	 * Don't mix the report in with the audio if that's going to stdout.
+	 */
+	fp = (outfile != NULL && strcmp(outfile, "-") == 0) ? stderr : stdout;
+	start = now();
+	if ((wp = morse_words_open(wordfile, cachefile)) == NULL)
+		exit(1);
+	if ((sp = morse_words_select(wp, min_len, max_len, charset)) == NULL) {
+		fprintf(stderr, "?Error - morse_words_select failed.\n");
+		exit(1);
+	}
+	elapsed = now() - start;
+	if (verbose)
+		fprintf(fp, "%d of %d words (%d groups), index %s in %.3fms.\n",
+				sp->nwords, wp->nwords, wp->ngroups,
+				wp->cached ? "loaded" : "built", elapsed * 1000.0);
+	if (sp->nwords == 0) {
+		fprintf(stderr, "morse_words: no suitable words in %s.\n", wordfile);
+		exit(1);
+	}
+	mp = NULL;
+	if (!print) {
+		if ((mp = morse_init(wpm)) == NULL) {
+			fprintf(stderr, "?Error - morse_init failed.\n");
+			exit(1);
+		}
+		if (fw)
+			mp->farnsworth = 1;
+		if (backend != NULL && morse_open(mp, backend, outfile) < 0)
+			exit(1);
+	}
+	for (i = 0; i < nwords; i++) {
+		word = morse_words_random(sp, &len);
+		if (mp != NULL && morse_send_text(mp, word, len) < 0)
+			break;
+		fprintf(fp, "%.*s%c", len, word, (i % 10 == 9 || i == nwords - 1) ? '\n' : ' ');
+	}
+	if (mp != NULL) {
+		if (morse_drain(mp) < 0) {
+			fprintf(stderr, "?Error - audio output failed.\n");
+			exit(1);
+		}
+		fprintf(fp, "Total time: %.2f seconds.\n", morse_timestamp(mp));
+		morse_free(mp);
+	}
+	morse_words_free(sp);
+	morse_words_close(wp);
+	exit(0);
+}
+
+/*
+ * Return the current (monotonic) time in seconds.
+ */
+double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double )ts.tv_sec + (double )ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ * Print a brief usage message and quit.
+ */
+void
+usage()
+{
+	fprintf(stderr, "Usage: morse_words [-C FILE][-c CHARS][-f WPM][-k LESSON][-l MIN-MAX][-n NN]\n");
+	fprintf(stderr, "\t\t[-o FILE][-p][-S SEED][-s WPM][-v][-w FILE]\n");
+	fprintf(stderr, "\t-C FILE\tKeep the index of the word list in this file.\n");
+	fprintf(stderr, "\t-c CHARS\tOnly use words made up of these characters.\n");
+	fprintf(stderr, "\t-f WPM\tInvoke 'Farnsworth' mode for easier learning.\n");
+	fprintf(stderr, "\t-k LESSON\tOnly use the characters up to this Koch lesson.\n");
+	fprintf(stderr, "\t-l MIN-MAX\tRange of word lengths.\n");
+	fprintf(stderr, "\t-n NN\tNumber of words.\n");
+	fprintf(stderr, "\t-o FILE\tWrite a .wav (or raw PCM) file. Use '-' for stdout.\n");
+	fprintf(stderr, "\t-p\tJust print the words.\n");
+	fprintf(stderr, "\t-S SEED\tSeed the random number generator.\n");
+	fprintf(stderr, "\t-s WPM\tSet the rate in words per minute.\n");
+	fprintf(stderr, "\t-v\tSay how many words there were to choose from.\n");
+	fprintf(stderr, "\t-w FILE\tWord list.\n");
+	exit(2);
+}
@@ -45,6 +45,49 @@
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
 
+#ifdef MORSE_FIXED
+/*
+ * Divide one whole number of samples by another, giving the result in
+ * 32.32 fixed point, rounded to the nearest. The remainder is divided
+ * separately so that nothing overflows.
+ */
+static long long
+_params_exact(long long num, long long den)
+{
+	return((num / den) * MORSE_EXACT_ONE + ((num % den) * MORSE_EXACT_ONE + den / 2) / den);
+}
+
+/*
+ * The same timing as below, worked out in whole numbers. An element is
+ * 1.2/WPM seconds, or rate*6/(5*WPM) samples. The Farnsworth element
+ * (below) comes to rate*(900-31*WPM)/(285*WPM) samples, with the real
+ * speed pegged at 18WPM.
+ */
+void
+morse_calc_params(struct morse *mp)
+{
+	long long rate;
+
+	mp->wpm = MIN(MAX(mp->wpm, 5), 60);
+	mp->amplitude = MIN(MAX(mp->amplitude, 0), 100);
+	mp->word = (mp->amplitude * 32767) / 100;
+	rate = (long long )mp->sample_rate;
+	if (mp->farnsworth && mp->wpm < 18) {
+		mp->bit_exact = _params_exact(rate * 6, 5 * 18);
+		mp->char_exact = _params_exact(rate * (900 - 31 * mp->wpm) * 3, 285 * mp->wpm);
+		mp->word_exact = _params_exact(rate * (900 - 31 * mp->wpm) * 7, 285 * mp->wpm);
+	} else {
+		mp->bit_exact = _params_exact(rate * 6, 5 * mp->wpm);
+		mp->char_exact = _params_exact(rate * 6 * 3, 5 * mp->wpm);
+		mp->word_exact = _params_exact(rate * 6 * 7, 5 * mp->wpm);
+	}
+	mp->bit_time = (unsigned int )((mp->bit_exact + MORSE_EXACT_ONE / 2) / MORSE_EXACT_ONE);
+	mp->char_delay = (unsigned int )((mp->char_exact + MORSE_EXACT_ONE / 2) / MORSE_EXACT_ONE);
+	mp->word_delay = (unsigned int )((mp->word_exact + MORSE_EXACT_ONE / 2) / MORSE_EXACT_ONE);
+	morse_audio_setup(mp);
+}
+#else
+
 /*
  * Apply some heuristics to the set parameters and compute the morse timing.
  * The maths is a little intense. For more information, there is a great
@@ -94,39 +137,83 @@ morse_calc_params(struct morse *mp)
 	 * delays as a function of the number of audio samples to be skipped.
 	 */
 	element_time = 1.2 / effective_wpm;
-	mp->bit_time = (int )((double )mp->sample_rate * element_time + 0.5);
+	mp->bit_exact = (double )mp->sample_rate * element_time;
+	mp->bit_time = (int )(mp->bit_exact + 0.5);
 	if (fw) {
 		/*
 		 * Farnsworth inter-character and inter-word
-		 * delays. Unfortunately there is a slight round-off
-		 * error here which can result in an inexact
-		 * implementation.
+		 * delays. There is a slight round-off error when
+		 * these are turned into whole samples, but it is
+		 * carried along and made up as we go (see
+		 * morse_audio_silence()).
 		 */
 		element_time = (60.0/my_wpm - 37.2/effective_wpm) / 19.0;
 	}
-	mp->char_delay = (int )((double )mp->sample_rate * element_time * 3.0 + 0.5);
-	mp->word_delay = (int )((double )mp->sample_rate * element_time * 7.0 + 0.5);
+	mp->char_exact = (double )mp->sample_rate * element_time * 3.0;
+	mp->word_exact = (double )mp->sample_rate * element_time * 7.0;
+	mp->char_delay = (int )(mp->char_exact + 0.5);
+	mp->word_delay = (int )(mp->word_exact + 0.5);
+	/*
+	 * Every dit and every dah is identical for a given set of parameters,
+	 * so build the waveforms once, here, rather than for each element.
+	 */
+	morse_audio_setup(mp);
 }
+#endif
 
 /*
  * Just before we begin audio out, we need to set up some bits and pieces
  * like the audio buffer and some of the offsets. Recompute the parameters
- * for good measure, too.
+ * once the backend has picked its sample rate, too.
  *
- * This function is called automatically.
+ * This function is called automatically. Returns -1 (and sets the error
+ * flag) if the audio output can't be started.
  */
-void
+int
 _morse_commence(struct morse *mp)
 {
-	morse_calc_params(mp);
 	mp->sym_delay = 0;
+	mp->sym_exact = 0;
+	mp->drift = 0;
 	mp->time_stamp = 0;
-	sound_commence(mp);
-	mp->buffer = (unsigned short *)malloc(AUDIO_BUFFER_SIZE * sizeof(unsigned short));
-	if (mp->buffer == NULL) {
+	mp->buffer = NULL;
+	mp->mapped = 0;
+	mp->format = MORSE_S16;
+	mp->channels = 1;
+	if ((mp->backend == NULL && morse_open(mp, NULL, NULL) < 0) ||
+			mp->backend->commence(mp) < 0) {
+		mp->error = 1;
+		return(-1);
+	}
+	/*
+	 * The backend may have settled on a different sample rate, so this
+	 * has to wait until now.
+	 */
+	morse_calc_params(mp);
+	_morse_audio_mark(mp);
+	if (_morse_audio_buffer(mp) < 0) {
+#ifdef MORSE_FIXED
+		fprintf(stderr, "libmorse: the fixed-point build can't do that output format\n");
+#else
 		perror("libmorse: malloc");
-		exit(1);
+#endif
+		mp->error = 1;
+		return(-1);
 	}
 	mp->offset = 0;
 	mp->setup_done = 1;
+	return(0);
+}
+
+/*
+ * Start the audio output now, rather than waiting for the first character.
+ * Useful if you need to know the sample rate the device settled on before
+ * sending anything. Returns -1 if the audio output can't be started.
+ */
+int
+morse_setup(struct morse *mp)
+{
+	if (!mp->setup_done && _morse_commence(mp) < 0)
+		return(-1);
+	return(mp->error ? -1 : 0);
 }
@@ -0,0 +1,508 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Render Morse Code into memory rather than out through the sound device.
+ * This is useful for generating audio in bulk on machines with no sound
+ * card, or for handing the PCM to something else entirely.
+ *
+ * Normally, each element and gap is rounded to a whole number of samples
+ * and left at that, so a word always renders the same way (which is what
+ * the cache relies on). The speed is then out by whatever the rounding
+ * costs. With the exact_render flag set, the rounding is made up in the
+ * gaps as it goes, just as it is for the audio output (see audio.c), so
+ * the result is the same as would have been sent.
+ *
+ * A long text can also be rendered in parallel. Where each word starts
+ * depends only on the lengths of the words before it, which come
+ * straight from the Morse table, so those are added up first, along with
+ * how much drift there is at the start of each word. Then a set of
+ * threads render the words straight into their places in the output,
+ * each starting with the drift the word would have had. As the carrier
+ * runs off the sample clock, each word comes out exactly as it would have
+ * done in one long render. There are no threads in the fixed-point build,
+ * so no parallel rendering either.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifndef MORSE_FIXED
+#include <pthread.h>
+#endif
+
+#include "libmorse.h"
+
+/*
+ * Called by the audio block functions when we're rendering. Convert the
+ * samples (or zeroes, if wp is NULL) into the render buffer, growing it if
+ * we're allowed to. Anything which doesn't fit is counted but dropped.
+ */
+void
+_morse_render_out(struct morse *mp, const MORSE_SAMPLE *wp, int len)
+{
+	int n, size;
+	short *np;
+
+	if (mp->render == MORSE_RENDER_KEYS) {
+		mp->render_count += len;
+		return;
+	}
+	if (mp->render == MORSE_RENDER_GROW && mp->render_count + len > mp->render_size) {
+		size = mp->render_size > 0 ? mp->render_size : AUDIO_BUFFER_SIZE;
+		while (size < mp->render_count + len)
+			size *= 2;
+		if ((np = (short *)realloc(mp->render_buf, size * sizeof(short))) == NULL) {
+			/*
+			 * Out of memory. Drop the buffer and just keep counting
+			 * so the caller can tell what happened.
+			 */
+			free(mp->render_buf);
+			mp->render_buf = NULL;
+			mp->render_size = 0;
+			mp->render = MORSE_RENDER_FIXED;
+		} else {
+			mp->render_buf = np;
+			mp->render_size = size;
+		}
+	}
+	n = mp->render_count < mp->render_size ? mp->render_size - (int )mp->render_count : 0;
+	if (n > len)
+		n = len;
+	if (n > 0) {
+		if (wp != NULL)
+#ifdef MORSE_FIXED
+			memcpy(&mp->render_buf[mp->render_count], wp, n * sizeof(short));
+#else
+			mp->simd->convert(&mp->render_buf[mp->render_count], wp, n);
+#endif
+		else
+			memset(&mp->render_buf[mp->render_count], 0, n * sizeof(short));
+	}
+	mp->render_count += len;
+}
+
+/*
+ * Do the actual rendering. The device state (time stamp, pending gap and
+ * so on) is saved and restored around the call, so rendering can be mixed
+ * freely with normal output. Note that the parameters are not recomputed
+ * here - call morse_calc_params() after changing them. The result starts
+ * with the first element and stops at the end of the last one, without
+ * any trailing gap. An exact render starts with no drift, as the audio
+ * output does.
+ */
+static int
+_render(struct morse *mp, const char *strp)
+{
+	int setup_done, prosign;
+	unsigned int sym_delay;
+	unsigned long long time_stamp;
+	MORSE_EXACT sym_exact, drift;
+
+	setup_done = mp->setup_done;
+	time_stamp = mp->time_stamp;
+	sym_delay = mp->sym_delay;
+	sym_exact = mp->sym_exact;
+	drift = mp->drift;
+	prosign = mp->prosign;
+	mp->setup_done = 1;
+	mp->sym_delay = 0;
+	mp->drift = 0;
+	mp->render_count = 0;
+	morse_send_string(mp, strp);
+	mp->setup_done = setup_done;
+	mp->time_stamp = time_stamp;
+	mp->sym_delay = sym_delay;
+	mp->sym_exact = sym_exact;
+	mp->drift = drift;
+	mp->prosign = prosign;
+	mp->render = MORSE_RENDER_NONE;
+	return((int )mp->render_count);
+}
+
+/*
+ * Render a string into a caller-supplied buffer of "size" samples. Like
+ * snprintf(), the return value is the total number of samples in the
+ * rendered string, which may be more than would fit. Passing a NULL
+ * buffer and a size of zero is a cheap way to find out how big a buffer
+ * is needed.
+ */
+int
+morse_render_string(struct morse *mp, const char *strp, short *buf, int size)
+{
+	mp->render = MORSE_RENDER_FIXED;
+	mp->render_buf = buf;
+	mp->render_size = buf != NULL ? size : 0;
+	return(_render(mp, strp));
+}
+
+/*
+ * Render a string into a buffer allocated (and grown as necessary) by the
+ * library. The caller is responsible for freeing it. Returns the number of
+ * samples, or -1 if we ran out of memory.
+ */
+int
+morse_render_alloc(struct morse *mp, const char *strp, short **bufp)
+{
+	int n;
+
+	mp->render = MORSE_RENDER_GROW;
+	mp->render_buf = NULL;
+	mp->render_size = 0;
+	if ((n = _render(mp, strp)) > 0 && mp->render_buf == NULL) {
+		*bufp = NULL;
+		return(-1);
+	}
+	*bufp = mp->render_buf;
+	mp->render_buf = NULL;
+	return(n);
+}
+
+/*
+ * Called instead of generating a tone when we're only after the keying.
+ * Note down when the key went down and for how long.
+ */
+void
+_morse_render_key(struct morse *mp, int len)
+{
+	int size;
+	struct morse_key *kp;
+
+	if (mp->nkeys >= 0 && mp->nkeys >= mp->keys_size) {
+		size = mp->keys_size > 0 ? mp->keys_size * 2 : 64;
+		if ((kp = (struct morse_key *)realloc(mp->keys, size * sizeof(struct morse_key))) == NULL) {
+			free(mp->keys);
+			mp->keys = NULL;
+			mp->keys_size = 0;
+			mp->nkeys = -1;
+		} else {
+			mp->keys = kp;
+			mp->keys_size = size;
+		}
+	}
+	if (mp->nkeys >= 0) {
+		mp->keys[mp->nkeys].start = mp->render_count;
+		mp->keys[mp->nkeys].len = len;
+		mp->nkeys++;
+	}
+	mp->render_count += len;
+}
+
+/*
+ * Work out the keying for a string, without generating any audio. This
+ * is all that's needed to drive a real transmitter (or anything else
+ * with an on/off key), and it's far cheaper than rendering. The key-down
+ * periods go into an array allocated by the library, which the caller is
+ * responsible for freeing. The timing is exactly that of the rendered
+ * audio, so it's only kept exact if the exact_render flag is set. Returns
+ * the number of them, or -1 if we ran out of memory.
+ */
+int
+morse_render_keys(struct morse *mp, const char *strp, struct morse_key **keysp)
+{
+	mp->render = MORSE_RENDER_KEYS;
+	mp->keys = NULL;
+	mp->nkeys = mp->keys_size = 0;
+	_render(mp, strp);
+	if (mp->nkeys < 0) {
+		free(mp->keys);
+		*keysp = NULL;
+		return(-1);
+	}
+	*keysp = mp->keys;
+	mp->keys = NULL;
+	return(mp->nkeys);
+}
+
+/*
+ * Work out how long a word will take, as the send functions in morse.c
+ * would do it. The gap before each element is added in as we go, and
+ * "gap" (and "exact") are left holding whatever gap would come next. If
+ * "drift" isn't NULL, the timing is kept exact as it goes, as in
+ * morse_audio_silence().
+ */
+static unsigned int
+_word_duration(struct morse *mp, const char *strp, const char *endp,
+				unsigned int *gap, MORSE_EXACT *exact, MORSE_EXACT *drift)
+{
+	int nsyms, bitreg, prosign = 0;
+	unsigned int len, total = 0;
+	const char *cp;
+
+	if (strp == endp)
+		return(0);
+	if (*strp == '<') {
+		strp++;
+		if ((cp = memchr(strp, '>', endp - strp)) != NULL)
+			endp = cp;
+		prosign = 1;
+	}
+	for (; strp < endp; strp++) {
+		bitreg = morse_table[*strp & 0x7f];
+		if ((nsyms = (bitreg >> 6) & 07) == 0)
+			nsyms = 8;
+		bitreg &= 077;
+		while (nsyms-- > 0) {
+			if (drift != NULL && *gap > 0)
+				total += _morse_audio_gap(drift, *gap, *exact);
+			else
+				total += *gap;
+			len = (bitreg & 01) ? mp->bit_time * 3 : mp->bit_time;
+			if (drift != NULL)
+				*drift += ((bitreg & 01) ? mp->bit_exact * 3 : mp->bit_exact) -
+								(MORSE_EXACT )len * MORSE_EXACT_ONE;
+			total += len;
+			bitreg >>= 1;
+			*gap = mp->bit_time;
+			*exact = mp->bit_exact;
+		}
+		if (!prosign) {
+			*gap = mp->char_delay;
+			*exact = mp->char_exact;
+		}
+	}
+	*gap = mp->word_delay;
+	*exact = mp->word_exact;
+	return(total);
+}
+
+/*
+ * Return the number of samples it would take to send a string, straight
+ * from the Morse table, without rendering anything. This is the same as
+ * morse_render_string() would return (so there's no trailing gap), and
+ * so it's only exact if the exact_render flag is set. As with rendering,
+ * the parameters are not recomputed here.
+ */
+unsigned long long
+morse_duration(struct morse *mp, const char *strp)
+{
+	unsigned int gap = 0;
+	unsigned long long total = 0;
+	MORSE_EXACT exact = 0, drift = 0;
+	const char *cp, *endp;
+
+	while (strp != NULL && *strp != '\0') {
+		if ((cp = strpbrk(strp, " \t")) != NULL) {
+			endp = cp++;
+			while (isspace(*cp))
+				cp++;
+		} else
+			endp = strp + strlen(strp);
+		total += _word_duration(mp, strp, endp, &gap, &exact, mp->exact_render ? &drift : NULL);
+		strp = cp;
+	}
+	return(total);
+}
+
+#ifndef MORSE_FIXED
+/*
+ * A word to be rendered in parallel, and the job as a whole. The threads
+ * take the words a batch at a time.
+ */
+#define RENDER_BATCH	64
+
+struct	render_word	{
+	const char		*strp;
+	int				len;
+	unsigned int	start;
+	MORSE_EXACT		drift;
+};
+
+struct	render_job	{
+	struct morse	*mp;
+	struct render_word *word;
+	int				nwords;
+	int				next;
+	int				error;
+	short			*buf;
+	int				size;
+	pthread_mutex_t	lock;
+};
+
+/*
+ * Split the text into words just as morse_send_text() does, and work out
+ * where each one starts (and with how much drift, for an exact render).
+ * There is a word gap between each pair of words, and nothing after the
+ * last one. Returns the total number of samples, or -1 if we ran out of
+ * memory (or the text would take too long).
+ */
+static int
+_render_words(struct render_job *jp, const char *strp, int len)
+{
+	int max = 0;
+	unsigned int gap, dur;
+	unsigned long long total = 0;
+	MORSE_EXACT exact, drift = 0, *dp = jp->mp->exact_render ? &drift : NULL;
+	const char *cp, *endp, *wp;
+	struct render_word *np;
+
+	jp->nwords = 0;
+	jp->word = NULL;
+	for (endp = strp + len; strp < endp; strp = cp) {
+		for (wp = strp; wp < endp && *wp != ' ' && *wp != '\t' && *wp != '\0'; wp++)
+			;
+		if (wp < endp && *wp == '\0')
+			endp = wp;
+		if (wp > strp) {
+			if (jp->nwords == max) {
+				max = max > 0 ? max * 2 : 1024;
+				if ((np = (struct render_word *)realloc(jp->word, max * sizeof(struct render_word))) == NULL)
+					return(-1);
+				jp->word = np;
+			}
+			if (jp->nwords > 0 && dp != NULL)
+				total += _morse_audio_gap(dp, jp->mp->word_delay, jp->mp->word_exact);
+			else if (jp->nwords > 0)
+				total += jp->mp->word_delay;
+			jp->word[jp->nwords].strp = strp;
+			jp->word[jp->nwords].len = wp - strp;
+			jp->word[jp->nwords].drift = drift;
+			jp->word[jp->nwords++].start = (unsigned int )total;
+			gap = 0;
+			dur = _word_duration(jp->mp, strp, wp, &gap, &exact, dp);
+			if ((total += dur) > 0x7fffffff)
+				return(-1);
+		}
+		for (cp = wp; cp < endp && (cp == wp || isspace(*cp)); cp++)
+			;
+	}
+	return((int )total);
+}
+
+/*
+ * A rendering thread. It has a morse instance of its own, set up just
+ * like the caller's, and renders each word by starting the clock where
+ * the word starts, with the whole output as the render buffer.
+ */
+static void *
+_render_worker(void *arg)
+{
+	int i, n;
+	struct render_job *jp = (struct render_job *)arg;
+	struct morse *mp;
+	struct render_word *rp;
+
+	if ((mp = morse_init(jp->mp->wpm)) == NULL) {
+		pthread_mutex_lock(&jp->lock);
+		jp->error = 1;
+		pthread_mutex_unlock(&jp->lock);
+		return(NULL);
+	}
+	mp->farnsworth = jp->mp->farnsworth;
+	mp->amplitude = jp->mp->amplitude;
+	mp->sample_rate = jp->mp->sample_rate;
+	mp->tone_frequency = jp->mp->tone_frequency;
+	mp->ramp_time = jp->mp->ramp_time;
+	mp->exact_render = jp->mp->exact_render;
+	morse_calc_params(mp);
+	mp->setup_done = 1;
+	while (1) {
+		pthread_mutex_lock(&jp->lock);
+		i = jp->next;
+		jp->next += RENDER_BATCH;
+		pthread_mutex_unlock(&jp->lock);
+		if (i >= jp->nwords)
+			break;
+		if ((n = jp->nwords - i) > RENDER_BATCH)
+			n = RENDER_BATCH;
+		for (rp = &jp->word[i]; n-- > 0; rp++) {
+			mp->render = MORSE_RENDER_FIXED;
+			mp->render_buf = jp->buf;
+			mp->render_size = jp->size;
+			mp->render_count = rp->start;
+			mp->sym_delay = 0;
+			mp->drift = rp->drift;
+			morse_send_text(mp, rp->strp, rp->len);
+		}
+	}
+	mp->render = MORSE_RENDER_NONE;
+	mp->render_buf = NULL;
+	morse_free(mp);
+	return(NULL);
+}
+
+/*
+ * Render "len" bytes of text into a buffer allocated by the library,
+ * using "nthreads" threads (or one per processor, if zero). The caller is
+ * responsible for freeing the buffer. The audio is exactly the same as
+ * morse_render_alloc() would give, and so with the exact_render flag set,
+ * the same as would have been sent to the audio output. Returns the
+ * number of samples, or -1 if something went wrong.
+ */
+int
+morse_render_parallel(struct morse *mp, const char *strp, int len, short **bufp, int nthreads)
+{
+	int i, n, total;
+	pthread_t *tids;
+	struct render_job job;
+
+	*bufp = NULL;
+	if (nthreads <= 0 && (nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nthreads = 1;
+	job.mp = mp;
+	job.next = job.error = 0;
+	if ((total = _render_words(&job, strp, len)) < 0) {
+		free(job.word);
+		return(-1);
+	}
+	if (nthreads > (job.nwords + RENDER_BATCH - 1) / RENDER_BATCH)
+		nthreads = (job.nwords + RENDER_BATCH - 1) / RENDER_BATCH;
+	job.size = total;
+	job.buf = (short *)calloc(total + 1, sizeof(short));
+	tids = (pthread_t *)malloc((nthreads + 1) * sizeof(pthread_t));
+	if (job.buf == NULL || tids == NULL) {
+		free(job.word);
+		free(job.buf);
+		free(tids);
+		return(-1);
+	}
+	pthread_mutex_init(&job.lock, NULL);
+	for (n = 0; n < nthreads; n++)
+		if (pthread_create(&tids[n], NULL, _render_worker, &job) != 0)
+			break;
+	if (n == 0)
+		_render_worker(&job);
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+	free(tids);
+	free(job.word);
+	if (job.error) {
+		free(job.buf);
+		return(-1);
+	}
+	*bufp = job.buf;
+	return(total);
+}
+#endif
@@ -0,0 +1,673 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * Vectorized kernels for the hot loops, with a scalar fallback. The best
+ * set for the processor we're running on is chosen at run time, so the
+ * same binary works everywhere. Each kernel set is a constant table, so
+ * there is no global state to worry about.
+ *
+ * The tone kernel is the oscillator used for synthesis. Rather than call
+ * sin() for every sample, it rotates a complex phasor by a fixed step
+ * each sample. The vector versions keep one phasor per lane, each a few
+ * samples apart, and rotate them all by the step raised to the number of
+ * lanes. The caller starts each call from an exact phase, so rounding
+ * errors never get the chance to build up.
+ *
+ * The noise kernel runs eight xoshiro128++ generators side by side, one
+ * per lane, and only uses integer arithmetic until the very end, so every
+ * version gives exactly the same noise for the same seed.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libmorse.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+/*
+ * The mean and (the inverse of) the standard deviation of the sum of four
+ * 16-bit uniform values.
+ */
+#define NOISE_MEAN		131070.0f
+#define NOISE_SCALE		2.6429e-5f
+
+/*
+ * Scalar versions. Compute the magnitude of a set of complex values held
+ * as separate real and imaginary arrays.
+ */
+static void
+_scalar_magnitude(const float *re, const float *im, float *mag, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		mag[i] = sqrtf(re[i] * re[i] + im[i] * im[i]);
+}
+
+/*
+ * Move each envelope value towards the corresponding magnitude by a
+ * factor of alpha (a simple one-pole low-pass filter).
+ */
+static void
+_scalar_envelope(float *env, const float *mag, float alpha, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		env[i] += alpha * (mag[i] - env[i]);
+}
+
+/*
+ * Generate a shaped tone. The phasor starts at (re, im), which also sets
+ * the amplitude, and is rotated by (c, s) for each sample. The output is
+ * the imaginary part, scaled by the envelope.
+ */
+static void
+_scalar_tone(float *out, const float *env, float re, float im, float c, float s, int n)
+{
+	int i;
+	float t;
+
+	for (i = 0; i < n; i++) {
+		out[i] = env[i] * im;
+		t = re * c - im * s;
+		im = re * s + im * c;
+		re = t;
+	}
+}
+
+/*
+ * Convert to 16-bit samples, rounding to the nearest and clipping.
+ */
+static void
+_scalar_convert(short *out, const float *in, int n)
+{
+	int i;
+	long v;
+
+	for (i = 0; i < n; i++) {
+		if ((v = lrintf(in[i])) > 32767)
+			v = 32767;
+		else if (v < -32768)
+			v = -32768;
+		out[i] = (short )v;
+	}
+}
+
+/*
+ * Work out the starting phasors for "lanes" lanes, and the rotation
+ * which moves each lane on by that many samples.
+ */
+static void
+_simd_lanes(float *zr, float *zi, float *wr, float *wi, float re, float im, float c, float s, int lanes)
+{
+	int k;
+	float t;
+
+	for (k = 0; k < lanes; k++) {
+		zr[k] = re;
+		zi[k] = im;
+		t = re * c - im * s;
+		im = re * s + im * c;
+		re = t;
+	}
+	*wr = c;
+	*wi = s;
+	for (k = 1; k < lanes; k *= 2) {
+		t = *wr * *wr - *wi * *wi;
+		*wi = 2.0f * *wr * *wi;
+		*wr = t;
+	}
+}
+
+/*
+ * Add one block of samples into another.
+ */
+static void
+_scalar_mix(float *acc, const float *in, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		acc[i] += in[i];
+}
+
+/*
+ * One step of the xoshiro128++ generator in one lane. The four words of
+ * the state are MORSE_NOISE_LANES apart, as they are held a word at a
+ * time across all of the lanes.
+ */
+static unsigned int
+_scalar_step(unsigned int *s)
+{
+	unsigned int r, t;
+
+	r = s[0] + s[3 * MORSE_NOISE_LANES];
+	r = ((r << 7) | (r >> 25)) + s[0];
+	t = s[MORSE_NOISE_LANES] << 9;
+	s[2 * MORSE_NOISE_LANES] ^= s[0];
+	s[3 * MORSE_NOISE_LANES] ^= s[MORSE_NOISE_LANES];
+	s[MORSE_NOISE_LANES] ^= s[2 * MORSE_NOISE_LANES];
+	s[0] ^= s[3 * MORSE_NOISE_LANES];
+	s[2 * MORSE_NOISE_LANES] ^= t;
+	t = s[3 * MORSE_NOISE_LANES];
+	s[3 * MORSE_NOISE_LANES] = (t << 11) | (t >> 21);
+	return(r);
+}
+
+/*
+ * Generate "n" samples of noise with a variance of one, where "n" is a
+ * multiple of MORSE_NOISE_LANES. Each sample is the sum of four 16-bit
+ * uniform values, the two halves of two steps of its lane's generator,
+ * which is near enough Gaussian for hiss.
+ */
+static void
+_scalar_noise(float *out, unsigned int *state, int n)
+{
+	int i, k;
+	unsigned int a, b;
+
+	for (i = 0; i < n; i += MORSE_NOISE_LANES) {
+		for (k = 0; k < MORSE_NOISE_LANES; k++) {
+			a = _scalar_step(state + k);
+			b = _scalar_step(state + k);
+			a = (a >> 16) + (a & 0xffff) + (b >> 16) + (b & 0xffff);
+			out[i + k] = ((float )(int )a - NOISE_MEAN) * NOISE_SCALE;
+		}
+	}
+}
+
+static const struct morse_simd scalar_simd = {
+	"scalar",
+	_scalar_magnitude,
+	_scalar_envelope,
+	_scalar_tone,
+	_scalar_convert,
+	_scalar_mix,
+	_scalar_noise
+};
+
+#ifdef SIMD_X86
+/*
+ * SSE versions. SSE2 is always there on x86-64, but we check anyway for
+ * the sake of 32-bit builds.
+ */
+__attribute__((target("sse2"))) static void
+_sse_magnitude(const float *re, const float *im, float *mag, int n)
+{
+	int i;
+	__m128 r, m;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		r = _mm_loadu_ps(re + i);
+		m = _mm_loadu_ps(im + i);
+		r = _mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(m, m));
+		_mm_storeu_ps(mag + i, _mm_sqrt_ps(r));
+	}
+	_scalar_magnitude(re + i, im + i, mag + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+_sse_envelope(float *env, const float *mag, float alpha, int n)
+{
+	int i;
+	__m128 a, e;
+
+	a = _mm_set1_ps(alpha);
+	for (i = 0; i + 4 <= n; i += 4) {
+		e = _mm_loadu_ps(env + i);
+		e = _mm_add_ps(e, _mm_mul_ps(a, _mm_sub_ps(_mm_loadu_ps(mag + i), e)));
+		_mm_storeu_ps(env + i, e);
+	}
+	_scalar_envelope(env + i, mag + i, alpha, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+_sse_tone(float *out, const float *env, float re, float im, float c, float s, int n)
+{
+	int i;
+	float zr[4], zi[4], wr, wi;
+	__m128 r, m, t, vwr, vwi;
+
+	if (n < 4) {
+		_scalar_tone(out, env, re, im, c, s, n);
+		return;
+	}
+	_simd_lanes(zr, zi, &wr, &wi, re, im, c, s, 4);
+	r = _mm_loadu_ps(zr);
+	m = _mm_loadu_ps(zi);
+	vwr = _mm_set1_ps(wr);
+	vwi = _mm_set1_ps(wi);
+	for (i = 0; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(env + i), m));
+		t = _mm_sub_ps(_mm_mul_ps(r, vwr), _mm_mul_ps(m, vwi));
+		m = _mm_add_ps(_mm_mul_ps(r, vwi), _mm_mul_ps(m, vwr));
+		r = t;
+	}
+	_scalar_tone(out + i, env + i, _mm_cvtss_f32(r), _mm_cvtss_f32(m), c, s, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+_sse_convert(short *out, const float *in, int n)
+{
+	int i;
+	__m128i a, b;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm_cvtps_epi32(_mm_loadu_ps(in + i));
+		b = _mm_cvtps_epi32(_mm_loadu_ps(in + i + 4));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+	}
+	_scalar_convert(out + i, in + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+_sse_mix(float *acc, const float *in, int n)
+{
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_loadu_ps(in + i)));
+	_scalar_mix(acc + i, in + i, n - i);
+}
+
+__attribute__((target("sse2"))) static __m128i
+_sse_step(__m128i *s)
+{
+	__m128i r, t;
+
+	r = _mm_add_epi32(s[0], s[3]);
+	r = _mm_add_epi32(_mm_or_si128(_mm_slli_epi32(r, 7), _mm_srli_epi32(r, 25)), s[0]);
+	t = _mm_slli_epi32(s[1], 9);
+	s[2] = _mm_xor_si128(s[2], s[0]);
+	s[3] = _mm_xor_si128(s[3], s[1]);
+	s[1] = _mm_xor_si128(s[1], s[2]);
+	s[0] = _mm_xor_si128(s[0], s[3]);
+	s[2] = _mm_xor_si128(s[2], t);
+	s[3] = _mm_or_si128(_mm_slli_epi32(s[3], 11), _mm_srli_epi32(s[3], 21));
+	return(r);
+}
+
+__attribute__((target("sse2"))) static void
+_sse_noise(float *out, unsigned int *state, int n)
+{
+	int i, h, j;
+	__m128i s[2][4], a, b, m;
+
+	m = _mm_set1_epi32(0xffff);
+	for (h = 0; h < 2; h++)
+		for (j = 0; j < 4; j++)
+			s[h][j] = _mm_loadu_si128((__m128i *)(state + j * MORSE_NOISE_LANES + h * 4));
+	for (i = 0; i < n; i += MORSE_NOISE_LANES) {
+		for (h = 0; h < 2; h++) {
+			a = _sse_step(s[h]);
+			b = _sse_step(s[h]);
+			a = _mm_add_epi32(_mm_add_epi32(_mm_srli_epi32(a, 16), _mm_and_si128(a, m)),
+						_mm_add_epi32(_mm_srli_epi32(b, 16), _mm_and_si128(b, m)));
+			_mm_storeu_ps(out + i + h * 4, _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(a),
+						_mm_set1_ps(NOISE_MEAN)), _mm_set1_ps(NOISE_SCALE)));
+		}
+	}
+	for (h = 0; h < 2; h++)
+		for (j = 0; j < 4; j++)
+			_mm_storeu_si128((__m128i *)(state + j * MORSE_NOISE_LANES + h * 4), s[h][j]);
+}
+
+static const struct morse_simd sse_simd = {
+	"sse2",
+	_sse_magnitude,
+	_sse_envelope,
+	_sse_tone,
+	_sse_convert,
+	_sse_mix,
+	_sse_noise
+};
+
+/*
+ * AVX2 versions, eight lanes at a time.
+ */
+__attribute__((target("avx2"))) static void
+_avx2_magnitude(const float *re, const float *im, float *mag, int n)
+{
+	int i;
+	__m256 r, m;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		r = _mm256_loadu_ps(re + i);
+		m = _mm256_loadu_ps(im + i);
+		r = _mm256_add_ps(_mm256_mul_ps(r, r), _mm256_mul_ps(m, m));
+		_mm256_storeu_ps(mag + i, _mm256_sqrt_ps(r));
+	}
+	_sse_magnitude(re + i, im + i, mag + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+_avx2_envelope(float *env, const float *mag, float alpha, int n)
+{
+	int i;
+	__m256 a, e;
+
+	a = _mm256_set1_ps(alpha);
+	for (i = 0; i + 8 <= n; i += 8) {
+		e = _mm256_loadu_ps(env + i);
+		e = _mm256_add_ps(e, _mm256_mul_ps(a, _mm256_sub_ps(_mm256_loadu_ps(mag + i), e)));
+		_mm256_storeu_ps(env + i, e);
+	}
+	_sse_envelope(env + i, mag + i, alpha, n - i);
+}
+
+/*
+ * The rotation is one long chain of dependent multiplies, so two sets of
+ * eight lanes are kept going at once to keep the pipeline full.
+ */
+__attribute__((target("avx2"))) static void
+_avx2_tone(float *out, const float *env, float re, float im, float c, float s, int n)
+{
+	int i;
+	float zr[16], zi[16], wr, wi;
+	__m256 r0, m0, r1, m1, t, vwr, vwi;
+
+	if (n < 16) {
+		_sse_tone(out, env, re, im, c, s, n);
+		return;
+	}
+	_simd_lanes(zr, zi, &wr, &wi, re, im, c, s, 16);
+	r0 = _mm256_loadu_ps(zr);
+	m0 = _mm256_loadu_ps(zi);
+	r1 = _mm256_loadu_ps(zr + 8);
+	m1 = _mm256_loadu_ps(zi + 8);
+	vwr = _mm256_set1_ps(wr);
+	vwi = _mm256_set1_ps(wi);
+	for (i = 0; i + 16 <= n; i += 16) {
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(env + i), m0));
+		_mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_loadu_ps(env + i + 8), m1));
+		t = _mm256_sub_ps(_mm256_mul_ps(r0, vwr), _mm256_mul_ps(m0, vwi));
+		m0 = _mm256_add_ps(_mm256_mul_ps(r0, vwi), _mm256_mul_ps(m0, vwr));
+		r0 = t;
+		t = _mm256_sub_ps(_mm256_mul_ps(r1, vwr), _mm256_mul_ps(m1, vwi));
+		m1 = _mm256_add_ps(_mm256_mul_ps(r1, vwi), _mm256_mul_ps(m1, vwr));
+		r1 = t;
+	}
+	_scalar_tone(out + i, env + i, _mm256_cvtss_f32(r0), _mm256_cvtss_f32(m0), c, s, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+_avx2_convert(short *out, const float *in, int n)
+{
+	int i;
+	__m256i a, b;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = _mm256_cvtps_epi32(_mm256_loadu_ps(in + i));
+		b = _mm256_cvtps_epi32(_mm256_loadu_ps(in + i + 8));
+		/*
+		 * The pack works within each 128-bit half, so put the
+		 * 64-bit pieces back in order afterwards.
+		 */
+		a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *)(out + i), a);
+	}
+	_sse_convert(out + i, in + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+_avx2_mix(float *acc, const float *in, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_loadu_ps(in + i)));
+	_sse_mix(acc + i, in + i, n - i);
+}
+
+__attribute__((target("avx2"))) static __m256i
+_avx2_step(__m256i *s)
+{
+	__m256i r, t;
+
+	r = _mm256_add_epi32(s[0], s[3]);
+	r = _mm256_add_epi32(_mm256_or_si256(_mm256_slli_epi32(r, 7), _mm256_srli_epi32(r, 25)), s[0]);
+	t = _mm256_slli_epi32(s[1], 9);
+	s[2] = _mm256_xor_si256(s[2], s[0]);
+	s[3] = _mm256_xor_si256(s[3], s[1]);
+	s[1] = _mm256_xor_si256(s[1], s[2]);
+	s[0] = _mm256_xor_si256(s[0], s[3]);
+	s[2] = _mm256_xor_si256(s[2], t);
+	s[3] = _mm256_or_si256(_mm256_slli_epi32(s[3], 11), _mm256_srli_epi32(s[3], 21));
+	return(r);
+}
+
+__attribute__((target("avx2"))) static void
+_avx2_noise(float *out, unsigned int *state, int n)
+{
+	int i, j;
+	__m256i s[4], a, b, m;
+
+	m = _mm256_set1_epi32(0xffff);
+	for (j = 0; j < 4; j++)
+		s[j] = _mm256_loadu_si256((__m256i *)(state + j * MORSE_NOISE_LANES));
+	for (i = 0; i < n; i += MORSE_NOISE_LANES) {
+		a = _avx2_step(s);
+		b = _avx2_step(s);
+		a = _mm256_add_epi32(_mm256_add_epi32(_mm256_srli_epi32(a, 16), _mm256_and_si256(a, m)),
+					_mm256_add_epi32(_mm256_srli_epi32(b, 16), _mm256_and_si256(b, m)));
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(a),
+					_mm256_set1_ps(NOISE_MEAN)), _mm256_set1_ps(NOISE_SCALE)));
+	}
+	for (j = 0; j < 4; j++)
+		_mm256_storeu_si256((__m256i *)(state + j * MORSE_NOISE_LANES), s[j]);
+}
+
+static const struct morse_simd avx2_simd = {
+	"avx2",
+	_avx2_magnitude,
+	_avx2_envelope,
+	_avx2_tone,
+	_avx2_convert,
+	_avx2_mix,
+	_avx2_noise
+};
+#endif
+
+#ifdef SIMD_NEON
+/*
+ * NEON versions for ARM.
+ */
+static void
+_neon_magnitude(const float *re, const float *im, float *mag, int n)
+{
+	int i;
+	float32x4_t r, m;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		r = vld1q_f32(re + i);
+		m = vld1q_f32(im + i);
+		r = vmlaq_f32(vmulq_f32(r, r), m, m);
+#ifdef __aarch64__
+		vst1q_f32(mag + i, vsqrtq_f32(r));
+#else
+		m = vrsqrteq_f32(vmaxq_f32(r, vdupq_n_f32(1e-30f)));
+		m = vmulq_f32(m, vrsqrtsq_f32(vmulq_f32(r, m), m));
+		vst1q_f32(mag + i, vmulq_f32(r, m));
+#endif
+	}
+	_scalar_magnitude(re + i, im + i, mag + i, n - i);
+}
+
+static void
+_neon_envelope(float *env, const float *mag, float alpha, int n)
+{
+	int i;
+	float32x4_t e;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		e = vld1q_f32(env + i);
+		e = vmlaq_n_f32(e, vsubq_f32(vld1q_f32(mag + i), e), alpha);
+		vst1q_f32(env + i, e);
+	}
+	_scalar_envelope(env + i, mag + i, alpha, n - i);
+}
+
+static void
+_neon_tone(float *out, const float *env, float re, float im, float c, float s, int n)
+{
+	int i;
+	float zr[4], zi[4], wr, wi;
+	float32x4_t r, m, t;
+
+	if (n < 4) {
+		_scalar_tone(out, env, re, im, c, s, n);
+		return;
+	}
+	_simd_lanes(zr, zi, &wr, &wi, re, im, c, s, 4);
+	r = vld1q_f32(zr);
+	m = vld1q_f32(zi);
+	for (i = 0; i + 4 <= n; i += 4) {
+		vst1q_f32(out + i, vmulq_f32(vld1q_f32(env + i), m));
+		t = vmlsq_n_f32(vmulq_n_f32(r, wr), m, wi);
+		m = vmlaq_n_f32(vmulq_n_f32(m, wr), r, wi);
+		r = t;
+	}
+	_scalar_tone(out + i, env + i, vgetq_lane_f32(r, 0), vgetq_lane_f32(m, 0), c, s, n - i);
+}
+
+static void
+_neon_convert(short *out, const float *in, int n)
+{
+	int i = 0;
+
+#ifdef __aarch64__
+	for (; i + 4 <= n; i += 4)
+		vst1_s16(out + i, vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(in + i))));
+#endif
+	_scalar_convert(out + i, in + i, n - i);
+}
+
+static void
+_neon_mix(float *acc, const float *in, int n)
+{
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		vst1q_f32(acc + i, vaddq_f32(vld1q_f32(acc + i), vld1q_f32(in + i)));
+	_scalar_mix(acc + i, in + i, n - i);
+}
+
+static uint32x4_t
+_neon_step(uint32x4_t *s)
+{
+	uint32x4_t r, t;
+
+	r = vaddq_u32(s[0], s[3]);
+	r = vaddq_u32(vorrq_u32(vshlq_n_u32(r, 7), vshrq_n_u32(r, 25)), s[0]);
+	t = vshlq_n_u32(s[1], 9);
+	s[2] = veorq_u32(s[2], s[0]);
+	s[3] = veorq_u32(s[3], s[1]);
+	s[1] = veorq_u32(s[1], s[2]);
+	s[0] = veorq_u32(s[0], s[3]);
+	s[2] = veorq_u32(s[2], t);
+	s[3] = vorrq_u32(vshlq_n_u32(s[3], 11), vshrq_n_u32(s[3], 21));
+	return(r);
+}
+
+static void
+_neon_noise(float *out, unsigned int *state, int n)
+{
+	int i, h, j;
+	uint32x4_t s[2][4], a, b, m;
+
+	m = vdupq_n_u32(0xffff);
+	for (h = 0; h < 2; h++)
+		for (j = 0; j < 4; j++)
+			s[h][j] = vld1q_u32(state + j * MORSE_NOISE_LANES + h * 4);
+	for (i = 0; i < n; i += MORSE_NOISE_LANES) {
+		for (h = 0; h < 2; h++) {
+			a = _neon_step(s[h]);
+			b = _neon_step(s[h]);
+			a = vaddq_u32(vaddq_u32(vshrq_n_u32(a, 16), vandq_u32(a, m)),
+						vaddq_u32(vshrq_n_u32(b, 16), vandq_u32(b, m)));
+			vst1q_f32(out + i + h * 4, vmulq_n_f32(vsubq_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(a)),
+						vdupq_n_f32(NOISE_MEAN)), NOISE_SCALE));
+		}
+	}
+	for (h = 0; h < 2; h++)
+		for (j = 0; j < 4; j++)
+			vst1q_u32(state + j * MORSE_NOISE_LANES + h * 4, s[h][j]);
+}
+
+static const struct morse_simd neon_simd = {
+	"neon",
+	_neon_magnitude,
+	_neon_envelope,
+	_neon_tone,
+	_neon_convert,
+	_neon_mix,
+	_neon_noise
+};
+#endif
+
+/*
+ * Pick the best set of kernels for this processor. Setting the
+ * environment variable MORSE_SIMD to "scalar" forces the plain C
+ * versions, which is handy for comparing results.
+ */
+const struct morse_simd *
+morse_simd_select()
+{
+	char *cp;
+
+	if ((cp = getenv("MORSE_SIMD")) != NULL && strcmp(cp, "scalar") == 0)
+		return(&scalar_simd);
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return(&avx2_simd);
+	if (__builtin_cpu_supports("sse2"))
+		return(&sse_simd);
+#endif
+#ifdef SIMD_NEON
+	return(&neon_simd);
+#endif
+	return(&scalar_simd);
+}
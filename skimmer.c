@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * A wideband "skimmer" which decodes every Morse signal in a chunk of the
+ * audio passband at once. The input is cut into overlapping frames, each
+ * of which is windowed and run through an FFT, so each FFT bin becomes a
+ * narrow channel. The magnitude of each channel is smoothed and handed to
+ * its own decoder (see decode.c) once per frame.
+ *
+ * Each channel's key-down level is tracked as a peak which dies away over
+ * a few seconds, so it doesn't depend on how much of the time the key is
+ * down. A signal which falls between two bins shows up in both, so a
+ * channel's output is only kept if its level is at least as high as that
+ * of its neighbours. The window sidelobes and key clicks of a strong
+ * signal leak into the channels either side of it, less and less the
+ * further away they are: SKIRT_DB down, and SKIRT_SLOPE dB more for every
+ * Hz, up to SKIRT_MAX. The leaks from every signal are added up for each
+ * channel, and anything which comes in below that is treated as key-up,
+ * so the key clicks next door don't turn into dits. A channel whose own
+ * peak is below it is ignored altogether. And a channel has to be at
+ * least FLOOR times the noise floor of the band, taken as the level which
+ * a quarter of the channels are below, or it's only decoding noise.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libmorse.h"
+
+#define SKIRT_DB	6.0
+#define SKIRT_SLOPE	0.14
+#define SKIRT_MAX	45.0
+#define FLOOR		4.0
+#define SHOULDER	1.4f
+#define PEAK_TIME	2.0
+
+/*
+ * Create a skimmer covering the frequencies between "lo" and "hi" Hz.
+ * The FFT size is chosen to give channels somewhere around 15 to 25Hz
+ * apart, which is narrow enough to separate signals 80Hz apart in a
+ * pileup, with a window of 40 to 80ms. That's longer than a dit at 40 WPM,
+ * but the frames overlap by seven eighths, so the key-up between two dits
+ * still shows up.
+ */
+struct morse_skimmer *
+morse_skim_init(int sample_rate, double lo, double hi)
+{
+	int i, j, n, bits, first, last;
+	double bin, db;
+	struct morse_skimmer *sp;
+
+	if ((sp = (struct morse_skimmer *)calloc(1, sizeof(struct morse_skimmer))) == NULL)
+		return(NULL);
+	for (n = 64, bits = 6; n < sample_rate / 25; n *= 2, bits++)
+		;
+	bin = (double )sample_rate / (double )n;
+	if ((first = (int )ceil(lo / bin)) < 1)
+		first = 1;
+	if ((last = (int )floor(hi / bin)) >= n / 2)
+		last = n / 2 - 1;
+	if (last < first) {
+		free(sp);
+		return(NULL);
+	}
+	sp->sample_rate = sample_rate;
+	sp->fft_size = n;
+	sp->hop = n / 8;
+	sp->first_bin = first;
+	sp->nchannels = last - first + 1;
+	sp->fill = 0;
+	sp->decay = (float )exp(-(double )sp->hop / (PEAK_TIME * (double )sample_rate));
+	sp->simd = morse_simd_select();
+	sp->input = (float *)malloc(n * sizeof(float));
+	sp->window = (float *)malloc(n * sizeof(float));
+	sp->re = (float *)malloc(n * sizeof(float));
+	sp->im = (float *)malloc(n * sizeof(float));
+	sp->cosine = (float *)malloc(n / 2 * sizeof(float));
+	sp->sine = (float *)malloc(n / 2 * sizeof(float));
+	sp->bitrev = (int *)malloc(n * sizeof(int));
+	sp->mag = (float *)calloc(sp->nchannels, sizeof(float));
+	sp->env = (float *)calloc(sp->nchannels, sizeof(float));
+	sp->level = (float *)calloc(sp->nchannels, sizeof(float));
+	sp->sorted = (float *)malloc(sp->nchannels * sizeof(float));
+	sp->skirt = (float *)malloc(sp->nchannels * sizeof(float));
+	sp->channel = (struct morse_skim_channel *)malloc(sp->nchannels * sizeof(struct morse_skim_channel));
+	if (sp->input == NULL || sp->window == NULL || sp->re == NULL ||
+			sp->im == NULL || sp->cosine == NULL || sp->sine == NULL ||
+			sp->bitrev == NULL || sp->mag == NULL || sp->env == NULL ||
+			sp->level == NULL || sp->sorted == NULL ||
+			sp->skirt == NULL || sp->channel == NULL) {
+		morse_skim_free(sp);
+		return(NULL);
+	}
+	/*
+	 * A Hann window, scaled so that a sinusoid of amplitude A in the
+	 * middle of a bin comes out with a magnitude of A.
+	 */
+	for (i = 0; i < n; i++)
+		sp->window[i] = (float )((1.0 - cos(2.0 * M_PI * i / n)) * 2.0 / n);
+	for (i = 0; i < n / 2; i++) {
+		sp->cosine[i] = (float )cos(2.0 * M_PI * i / n);
+		sp->sine[i] = (float )-sin(2.0 * M_PI * i / n);
+	}
+	for (i = 0; i < n; i++) {
+		for (sp->bitrev[i] = 0, j = 0; j < bits; j++)
+			if (i & (1 << j))
+				sp->bitrev[i] |= 1 << (bits - 1 - j);
+	}
+	/*
+	 * How much louder a channel this far away has to be for this one to
+	 * be just its skirt.
+	 */
+	for (i = 0; i < sp->nchannels; i++) {
+		if ((db = SKIRT_DB + SKIRT_SLOPE * bin * (double )i) > SKIRT_MAX)
+			db = SKIRT_MAX;
+		sp->skirt[i] = (float )pow(10.0, db / 20.0);
+	}
+	for (i = 0; i < sp->nchannels; i++) {
+		sp->channel[i].frequency = (double )(first + i) * bin;
+		sp->channel[i].ntext = 0;
+		_morse_decode_setup(&sp->channel[i].decoder, sample_rate, sp->hop);
+		sp->channel[i].decoder.tone_frequency = sp->channel[i].frequency;
+	}
+	return(sp);
+}
+
+/*
+ * Release the skimmer.
+ */
+void
+morse_skim_free(struct morse_skimmer *sp)
+{
+	free(sp->input);
+	free(sp->window);
+	free(sp->re);
+	free(sp->im);
+	free(sp->cosine);
+	free(sp->sine);
+	free(sp->bitrev);
+	free(sp->mag);
+	free(sp->env);
+	free(sp->level);
+	free(sp->sorted);
+	free(sp->skirt);
+	free(sp->channel);
+	free(sp);
+}
+
+/*
+ * An in-place radix-2 FFT on the (bit-reversed) real and imaginary
+ * arrays.
+ */
+static void
+_skim_fft(struct morse_skimmer *sp)
+{
+	int i, j, a, b, len, half, step;
+	float wr, wi, tr, ti, *re = sp->re, *im = sp->im;
+
+	for (len = 2; len <= sp->fft_size; len <<= 1) {
+		half = len / 2;
+		step = sp->fft_size / len;
+		for (i = 0; i < sp->fft_size; i += len) {
+			for (j = 0; j < half; j++) {
+				wr = sp->cosine[j * step];
+				wi = sp->sine[j * step];
+				a = i + j;
+				b = a + half;
+				tr = re[b] * wr - im[b] * wi;
+				ti = re[b] * wi + im[b] * wr;
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
+
+/*
+ * Is channel i at least as loud as the ones either side of it?
+ */
+static int
+_skim_peak(struct morse_skimmer *sp, const float *level, int i)
+{
+	if (i > 0 && level[i] < level[i - 1])
+		return(0);
+	if (i < sp->nchannels - 1 && level[i] < level[i + 1])
+		return(0);
+	return(1);
+}
+
+/*
+ * Is the signal in channel i really in the one next to it, j? It is if
+ * j is louder, and either a peak in its own right or well above i (so i
+ * is on the slope of a peak further away). If j is only a little louder,
+ * and not a peak, it's probably between i and a stronger signal on the
+ * other side, and picking up a bit of both.
+ */
+static int
+_skim_louder(struct morse_skimmer *sp, int i, int j)
+{
+	if (sp->level[j] <= sp->level[i])
+		return(0);
+	return(_skim_peak(sp, sp->level, j) || sp->level[j] > sp->level[i] * SHOULDER);
+}
+
+/*
+ * How much of the skirts of the other signals could leak into channel i?
+ * The skirts of several of them can add up, so it's the sum, with each
+ * signal counted once, at its peak.
+ */
+static float
+_skim_leak(struct morse_skimmer *sp, int i)
+{
+	int j;
+	float leak = 0.0f;
+
+	for (j = 0; j < sp->nchannels; j++)
+		if (j != i && _skim_peak(sp, sp->level, j))
+			leak += sp->level[j] / sp->skirt[j > i ? j - i : i - j];
+	return(leak);
+}
+
+/*
+ * For sorting the levels, quietest first.
+ */
+static int
+_skim_compare(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+
+	return(x < y ? -1 : (x > y));
+}
+
+/*
+ * Process one complete frame. Returns the number of characters decoded.
+ */
+static int
+_skim_frame(struct morse_skimmer *sp)
+{
+	int i, n, total;
+	char text[8];
+	float floor, leak, env, *level = sp->level;
+	struct morse_skim_channel *cp;
+
+	for (i = 0; i < sp->fft_size; i++) {
+		sp->re[sp->bitrev[i]] = sp->input[i] * sp->window[i];
+		sp->im[i] = 0.0f;
+	}
+	_skim_fft(sp);
+	sp->simd->magnitude(sp->re + sp->first_bin, sp->im + sp->first_bin, sp->mag, sp->nchannels);
+	sp->simd->envelope(sp->env, sp->mag, 0.5f, sp->nchannels);
+	for (i = 0; i < sp->nchannels; i++)
+		if ((level[i] *= sp->decay) < sp->env[i])
+			level[i] = sp->env[i];
+	memcpy(sp->sorted, level, sp->nchannels * sizeof(float));
+	qsort(sp->sorted, sp->nchannels, sizeof(float), _skim_compare);
+	floor = sp->sorted[sp->nchannels / 4] * FLOOR;
+	for (total = i = 0; i < sp->nchannels; i++) {
+		cp = &sp->channel[i];
+		/*
+		 * Anything below what the other signals could be leaking in
+		 * (their key clicks, mostly) is treated as key-up.
+		 */
+		leak = _skim_leak(sp, i);
+		env = sp->env[i] < leak ? 0.0f : sp->env[i];
+		if ((n = _morse_decode_level(&cp->decoder, env, text, sizeof(text))) == 0)
+			continue;
+		if ((i > 0 && _skim_louder(sp, i, i - 1)) ||
+				(i < sp->nchannels - 1 && _skim_louder(sp, i, i + 1)))
+			continue;
+		if (level[i] < floor || level[i] < leak)
+			continue;
+		if (n > MORSE_SKIM_TEXT - cp->ntext)
+			n = MORSE_SKIM_TEXT - cp->ntext;
+		memcpy(cp->text + cp->ntext, text, n);
+		cp->ntext += n;
+		total += n;
+	}
+	return(total);
+}
+
+/*
+ * Feed a block of 16-bit samples into the skimmer. Returns the number of
+ * characters decoded (across all channels). Use morse_skim_read() to
+ * collect them before each channel's small text buffer fills up.
+ */
+int
+morse_skim(struct morse_skimmer *sp, const short *bp, int len)
+{
+	int n, total = 0;
+
+	while (len > 0) {
+		if ((n = sp->fft_size - sp->fill) > len)
+			n = len;
+		len -= n;
+		while (n-- > 0)
+			sp->input[sp->fill++] = (float )*bp++;
+		if (sp->fill < sp->fft_size)
+			break;
+		total += _skim_frame(sp);
+		memmove(sp->input, sp->input + sp->hop, (sp->fft_size - sp->hop) * sizeof(float));
+		sp->fill -= sp->hop;
+	}
+	return(total);
+}
+
+/*
+ * Collect the text decoded on a channel since the last call. Returns the
+ * number of characters copied.
+ */
+int
+morse_skim_read(struct morse_skimmer *sp, int chan, char *out, int size)
+{
+	int n;
+	struct morse_skim_channel *cp = &sp->channel[chan];
+
+	if ((n = cp->ntext) > size)
+		n = size;
+	memcpy(out, cp->text, n);
+	memmove(cp->text, cp->text + n, cp->ntext - n);
+	cp->ntext -= n;
+	return(n);
+}
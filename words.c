@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2020-21, Kalopa Robotics Limited.  All rights
+ * reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+ * NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABSTRACT
+ * A word list for generating exercises, such as five-letter words made
+ * up only of the characters learned so far. The dictionary file is
+ * mapped into memory rather than read, and indexed by word length and
+ * by the set of characters in each word. The character set is a bitmask,
+ * with a bit for each character which can be sent, so a word passes a
+ * filter if its mask has nothing outside the filter's mask.
+ *
+ * The index holds the words sorted by length and then mask, with a group
+ * for each run of words which have both the same, so a filter only has
+ * to look at the groups rather than every word. It is saved in a cache
+ * file (in ~/.cache, unless told otherwise), and the next time round, if
+ * the dictionary hasn't changed, the cache is simply mapped in as well,
+ * so nothing is parsed at all.
+ *
+ * A selection is the list of words which pass a filter, copied out of
+ * the groups which match, so a word can be drawn from it at random in
+ * constant time. The words point straight into the dictionary, so they
+ * aren't nul-terminated, and have whatever case they have there.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "libmorse.h"
+
+#define WORDS_MAGIC		0x4d525357
+#define WORDS_VERSION	1
+
+/*
+ * The start of the cache file. The dictionary is identified by its inode,
+ * size and modification time, and the bit for each character is saved
+ * too, in case the character set ever changes. The groups and then the
+ * words follow.
+ */
+struct	words_header	{
+	unsigned int	magic;
+	unsigned int	version;
+	unsigned long long ino;
+	unsigned long long size;
+	long long		mtime;
+	long			mtime_ns;
+	int				nwords;
+	int				ngroups;
+	signed char		bit[128];
+};
+
+/*
+ * A word while the index is being built.
+ */
+struct	words_entry	{
+	unsigned long long mask;
+	unsigned int	len;
+	unsigned int	offset;
+};
+
+/*
+ * Work out which bit goes with each character. The characters which
+ * can be sent are numbered in order, and lower case letters get the
+ * same bit as upper case. Anything else gets -1.
+ */
+static void
+_words_bits(signed char *bit)
+{
+	int c, n;
+
+	for (c = n = 0; c < 128; c++) {
+		bit[c] = -1;
+		if (c <= ' ' || (c >= 'a' && c <= 'z') || morse_table[c] == 0)
+			continue;
+		bit[c] = n++;
+	}
+	for (c = 'a'; c <= 'z'; c++)
+		bit[c] = bit[c - 'a' + 'A'];
+}
+
+/*
+ * Return the character set mask for a string of characters. Anything
+ * which can't be sent is ignored.
+ */
+unsigned long long
+morse_charset(const char *strp)
+{
+	unsigned long long mask = 0;
+	signed char bit[128];
+
+	_words_bits(bit);
+	for (; *strp != '\0'; strp++)
+		if (!(*strp & 0x80) && bit[(int )*strp] >= 0)
+			mask |= 1ULL << bit[(int )*strp];
+	return(mask);
+}
+
+/*
+ * Return the character set for a lesson of the Koch method. Lesson one
+ * has the first two characters, and each lesson after that adds one.
+ */
+unsigned long long
+morse_koch_charset(int lesson)
+{
+	int n;
+	char chars[64];
+
+	if ((n = lesson + 1) > (int )strlen(MORSE_KOCH_ORDER))
+		n = strlen(MORSE_KOCH_ORDER);
+	if (n < 0)
+		n = 0;
+	strncpy(chars, MORSE_KOCH_ORDER, n);
+	chars[n] = '\0';
+	return(morse_charset(chars));
+}
+
+/*
+ * Sort the words by length, then mask, then where they are in the file.
+ */
+static int
+_words_compare(const void *a, const void *b)
+{
+	const struct words_entry *ep = (const struct words_entry *)a;
+	const struct words_entry *fp = (const struct words_entry *)b;
+
+	if (ep->len != fp->len)
+		return(ep->len < fp->len ? -1 : 1);
+	if (ep->mask != fp->mask)
+		return(ep->mask < fp->mask ? -1 : 1);
+	if (ep->offset != fp->offset)
+		return(ep->offset < fp->offset ? -1 : 1);
+	return(0);
+}
+
+/*
+ * Build the index from the dictionary, one word per line. Words with
+ * anything which can't be sent (including spaces) are left out.
+ */
+static int
+_words_build(struct morse_words *wp)
+{
+	int i, n, max;
+	unsigned long p, q, start, end;
+	unsigned long long mask;
+	signed char bit[128];
+	struct words_entry *ep, *np;
+	struct morse_wordgroup *gp;
+	struct morse_word *word;
+	const char *text = wp->text;
+
+	_words_bits(bit);
+	n = max = 0;
+	ep = NULL;
+	for (start = 0; start < wp->size; start = end + 1) {
+		for (end = start; end < wp->size && text[end] != '\n'; end++)
+			;
+		p = end;
+		if (p > start && text[p - 1] == '\r')
+			p--;
+		if (p == start)
+			continue;
+		mask = 0;
+		for (q = start; q < p; q++) {
+			if ((text[q] & 0x80) || bit[(int )text[q]] < 0)
+				break;
+			mask |= 1ULL << bit[(int )text[q]];
+		}
+		if (q < p)
+			continue;
+		if (n == max) {
+			max = max > 0 ? max * 2 : 4096;
+			if ((np = (struct words_entry *)realloc(ep, max * sizeof(struct words_entry))) == NULL) {
+				free(ep);
+				return(-1);
+			}
+			ep = np;
+		}
+		ep[n].mask = mask;
+		ep[n].len = p - start;
+		ep[n++].offset = start;
+	}
+	if (n > 0)
+		qsort(ep, n, sizeof(struct words_entry), _words_compare);
+	gp = (struct morse_wordgroup *)malloc((n + 1) * sizeof(struct morse_wordgroup));
+	word = (struct morse_word *)malloc((n + 1) * sizeof(struct morse_word));
+	if (gp == NULL || word == NULL) {
+		free(ep);
+		free(gp);
+		free(word);
+		return(-1);
+	}
+	wp->ngroups = 0;
+	for (i = 0; i < n; i++) {
+		if (i == 0 || ep[i].len != ep[i - 1].len || ep[i].mask != ep[i - 1].mask) {
+			gp[wp->ngroups].mask = ep[i].mask;
+			gp[wp->ngroups].len = ep[i].len;
+			gp[wp->ngroups].start = i;
+			gp[wp->ngroups].count = 0;
+			gp[wp->ngroups++].pad = 0;
+		}
+		gp[wp->ngroups - 1].count++;
+		word[i].offset = ep[i].offset;
+		word[i].len = ep[i].len;
+	}
+	free(ep);
+	wp->nwords = n;
+	wp->group = gp;
+	wp->word = word;
+	return(0);
+}
+
+/*
+ * Work out where the cache for a dictionary goes, if the caller didn't
+ * say. It's named after the dictionary's device and inode.
+ */
+static int
+_words_cache_path(struct stat *sp, char *path, int size)
+{
+	char *cp, dir[1024];
+
+	if ((cp = getenv("XDG_CACHE_HOME")) != NULL && *cp != '\0')
+		snprintf(dir, sizeof(dir), "%s", cp);
+	else if ((cp = getenv("HOME")) != NULL && *cp != '\0')
+		snprintf(dir, sizeof(dir), "%s/.cache", cp);
+	else
+		return(-1);
+	mkdir(dir, 0755);
+	if (snprintf(path, size, "%s/libmorse-words-%llx-%llx.idx", dir,
+				(unsigned long long )sp->st_dev, (unsigned long long )sp->st_ino) >= size)
+		return(-1);
+	return(0);
+}
+
+/*
+ * Fill in the header which describes the dictionary.
+ */
+static void
+_words_header(struct words_header *hp, struct stat *sp)
+{
+	memset(hp, 0, sizeof(struct words_header));
+	hp->magic = WORDS_MAGIC;
+	hp->version = WORDS_VERSION;
+	hp->ino = sp->st_ino;
+	hp->size = sp->st_size;
+	hp->mtime = sp->st_mtim.tv_sec;
+	hp->mtime_ns = sp->st_mtim.tv_nsec;
+	_words_bits(hp->bit);
+}
+
+/*
+ * Map in the cached index, if there is one and it's for this version of
+ * the dictionary. Returns -1 if it can't be used.
+ */
+static int
+_words_load(struct morse_words *wp, const char *path, struct stat *sp)
+{
+	int fd;
+	unsigned long size;
+	struct stat st;
+	struct words_header h, *hp;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return(-1);
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t )sizeof(struct words_header)) {
+		close(fd);
+		return(-1);
+	}
+	wp->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (wp->map == MAP_FAILED) {
+		wp->map = NULL;
+		return(-1);
+	}
+	wp->map_size = st.st_size;
+	hp = (struct words_header *)wp->map;
+	_words_header(&h, sp);
+	h.nwords = hp->nwords;
+	h.ngroups = hp->ngroups;
+	size = sizeof(struct words_header) + (unsigned long )hp->ngroups * sizeof(struct morse_wordgroup) +
+					(unsigned long )hp->nwords * sizeof(struct morse_word);
+	if (memcmp(&h, hp, sizeof(struct words_header)) != 0 || hp->nwords < 0 ||
+					hp->ngroups < 0 || size != wp->map_size) {
+		munmap(wp->map, wp->map_size);
+		wp->map = NULL;
+		return(-1);
+	}
+	wp->nwords = hp->nwords;
+	wp->ngroups = hp->ngroups;
+	wp->group = (const struct morse_wordgroup *)(hp + 1);
+	wp->word = (const struct morse_word *)(wp->group + wp->ngroups);
+	wp->cached = 1;
+	return(0);
+}
+
+/*
+ * Save the index in the cache file. It's written under a temporary name
+ * and then renamed, so nobody ever maps in half of one. It doesn't
+ * matter if this fails, it just means building the index again next
+ * time.
+ */
+static void
+_words_save(struct morse_words *wp, const char *path, struct stat *sp)
+{
+	int ok;
+	char tmp[1100];
+	FILE *fp;
+	struct words_header h;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int )getpid());
+	if ((fp = fopen(tmp, "w")) == NULL)
+		return;
+	_words_header(&h, sp);
+	h.nwords = wp->nwords;
+	h.ngroups = wp->ngroups;
+	ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+		fwrite(wp->group, sizeof(struct morse_wordgroup), wp->ngroups, fp) == wp->ngroups &&
+		fwrite(wp->word, sizeof(struct morse_word), wp->nwords, fp) == wp->nwords;
+	if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+/*
+ * Open a dictionary, one word per line. The index is loaded from the
+ * cache file if it's up to date, and built (and saved) otherwise. With
+ * no cache file named, one is picked in ~/.cache. Returns NULL if the
+ * dictionary can't be opened.
+ */
+struct morse_words *
+morse_words_open(const char *fname, const char *cachefile)
+{
+	int fd;
+	char path[1024];
+	struct stat st;
+	struct morse_words *wp;
+
+	if ((fd = open(fname, O_RDONLY)) < 0) {
+		perror(fname);
+		return(NULL);
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(fname);
+		close(fd);
+		return(NULL);
+	}
+	if ((wp = (struct morse_words *)calloc(1, sizeof(struct morse_words))) == NULL) {
+		close(fd);
+		return(NULL);
+	}
+	wp->size = st.st_size;
+	wp->text = "";
+	if (wp->size > 0 && (wp->text = (const char *)mmap(NULL, wp->size, PROT_READ,
+							MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror(fname);
+		close(fd);
+		free(wp);
+		return(NULL);
+	}
+	close(fd);
+	if (cachefile == NULL && _words_cache_path(&st, path, sizeof(path)) == 0)
+		cachefile = path;
+	if (cachefile != NULL && _words_load(wp, cachefile, &st) == 0)
+		return(wp);
+	if (_words_build(wp) < 0) {
+		perror("libmorse: malloc");
+		morse_words_close(wp);
+		return(NULL);
+	}
+	if (cachefile != NULL)
+		_words_save(wp, cachefile, &st);
+	return(wp);
+}
+
+/*
+ * Release the dictionary. Any selections from it have to go first.
+ */
+void
+morse_words_close(struct morse_words *wp)
+{
+	if (wp->map != NULL)
+		munmap(wp->map, wp->map_size);
+	else {
+		free((void *)wp->group);
+		free((void *)wp->word);
+	}
+	if (wp->size > 0)
+		munmap((void *)wp->text, wp->size);
+	free(wp);
+}
+
+/*
+ * Does a group of words pass the filter?
+ */
+static int
+_words_match(const struct morse_wordgroup *gp, int minlen, int maxlen, unsigned long long charset)
+{
+	if (minlen > 0 && gp->len < (unsigned int )minlen)
+		return(0);
+	if (maxlen > 0 && gp->len > (unsigned int )maxlen)
+		return(0);
+	return((gp->mask & ~charset) == 0);
+}
+
+/*
+ * Select the words with between "minlen" and "maxlen" characters (zero
+ * for no limit) which only use the characters in "charset". Returns
+ * NULL if there's no memory. A selection may well be empty.
+ */
+struct morse_wordsel *
+morse_words_select(struct morse_words *wp, int minlen, int maxlen, unsigned long long charset)
+{
+	int i, n;
+	const struct morse_wordgroup *gp;
+	struct morse_wordsel *sp;
+
+	if ((sp = (struct morse_wordsel *)malloc(sizeof(struct morse_wordsel))) == NULL)
+		return(NULL);
+	sp->wp = wp;
+	for (i = n = 0, gp = wp->group; i < wp->ngroups; i++, gp++)
+		if (_words_match(gp, minlen, maxlen, charset))
+			n += gp->count;
+	if ((sp->word = (struct morse_word *)malloc((n + 1) * sizeof(struct morse_word))) == NULL) {
+		free(sp);
+		return(NULL);
+	}
+	for (i = n = 0, gp = wp->group; i < wp->ngroups; i++, gp++) {
+		if (_words_match(gp, minlen, maxlen, charset)) {
+			memcpy(sp->word + n, wp->word + gp->start, gp->count * sizeof(struct morse_word));
+			n += gp->count;
+		}
+	}
+	sp->nwords = n;
+	return(sp);
+}
+
+/*
+ * Release a selection.
+ */
+void
+morse_words_free(struct morse_wordsel *sp)
+{
+	free(sp->word);
+	free(sp);
+}
+
+/*
+ * Return word "i" of a selection, and its length.
+ */
+const char *
+morse_words_get(struct morse_wordsel *sp, int i, int *lenp)
+{
+	*lenp = sp->word[i].len;
+	return(sp->wp->text + sp->word[i].offset);
+}
+
+/*
+ * Draw a word at random from a selection, and return it along with its
+ * length, or NULL if the selection is empty. Use srandom() to get the
+ * same words again.
+ */
+const char *
+morse_words_random(struct morse_wordsel *sp, int *lenp)
+{
+	long r, limit;
+
+	if (sp->nwords == 0)
+		return(NULL);
+	limit = RAND_MAX - RAND_MAX % sp->nwords;
+	while ((r = random()) >= limit)
+		;
+	return(morse_words_get(sp, (int )(r % sp->nwords), lenp));
+}